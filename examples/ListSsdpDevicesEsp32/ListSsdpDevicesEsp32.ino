@@ -32,6 +32,15 @@ void connectWiFi() {
   Serial.println(WiFi.localIP());
 }
 
+// called as soon as each device responds, return false to stop the discovery
+boolean onMediaServerFound(ssdpDevice* device, void* arg) {
+  Serial.print(F("Media server found at "));
+  Serial.print(device->host.toString());
+  Serial.print(F(":"));
+  Serial.println(device->port);
+  return false;  // the first one is enough
+}
+
 void setup(void) {
   Serial.begin(115200);
   Serial.println(F("Starting..."));
@@ -43,10 +52,23 @@ void setup(void) {
   Serial.print(F("Network Mask: "));
   Serial.println(WiFi.subnetMask().toString());
 
-  ssdpDeviceNode* ssdpDeviceNodeList = tinyUPnP.listSsdpDevices();
+  // returns as soon as the first media server responds rather than waiting for the timeout
+  tinyUPnP.discoverSsdpDevices(&onMediaServerFound, NULL, 1, "urn:schemas-upnp-org:device:MediaServer:1");
+
+  ssdpDeviceNode* ssdpDeviceNodeList = tinyUPnP.listSsdpDevices();  // owned by tinyUPnP, do not free
+  tinyUPnP.enrichSsdpDevices(ssdpDeviceNodeList);  // fills friendlyName, manufacturer and modelName of each device
   tinyUPnP.printSsdpDevices(ssdpDeviceNodeList);
 }
 
 void loop(void) {
-  delay(100000);
+  // keep the device list up to date using the SSDP announcements of the devices
+  tinyUPnP.processSsdpAnnouncements();
+
+  static unsigned long lastPrintTime = 0;
+  if (millis() - lastPrintTime > 100000) {
+    // answered from the device list, a new search is only sent if a device did not announce itself in time
+    tinyUPnP.printSsdpDevices(tinyUPnP.listSsdpDevices());
+    lastPrintTime = millis();
+  }
+  delay(100);
 }
\ No newline at end of file
@@ -19,25 +19,120 @@
 #define debugPrintln(...)
 #endif
 
+#if defined(ESP32)
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+#define WIFI_STA_DISCONNECTED_EVENT ARDUINO_EVENT_WIFI_STA_DISCONNECTED
+#else
+#define WIFI_STA_DISCONNECTED_EVENT SYSTEM_EVENT_STA_DISCONNECTED
+#endif
+#endif
+
 IPAddress ipMulti(239, 255, 255, 250);  // multicast address for SSDP
 IPAddress connectivityTestIp(64, 233, 187, 99);  // Google
 IPAddress ipNull(0, 0, 0, 0);  // indication to update rules when the IP of the device changes
 
-char packetBuffer[UPNP_UDP_TX_PACKET_MAX_SIZE];  // buffer to hold incoming packet
-char responseBuffer[UPNP_UDP_TX_RESPONSE_MAX_SIZE];
 
-char body_tmp[1200];
-char integer_string[32];
+SOAPAction SOAPActionAddPortMapping = {.name = "AddPortMapping", .id = SOAP_ACTION_ADD_PORT_MAPPING};
+SOAPAction SOAPActionGetSpecificPortMappingEntry = {.name = "GetSpecificPortMappingEntry", .id = SOAP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY};
+SOAPAction SOAPActionDeletePortMapping = {.name = "DeletePortMapping", .id = SOAP_ACTION_DELETE_PORT_MAPPING};
+SOAPAction SOAPActionGetGenericPortMappingEntry = {.name = "GetGenericPortMappingEntry", .id = SOAP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY};
+SOAPAction SOAPActionGetExternalIPAddress = {.name = "GetExternalIPAddress", .id = SOAP_ACTION_GET_EXTERNAL_IP_ADDRESS};
+SOAPAction SOAPActionGetStatusInfo = {.name = "GetStatusInfo", .id = SOAP_ACTION_GET_STATUS_INFO};
+SOAPAction SOAPActionAddAnyPortMapping = {.name = "AddAnyPortMapping", .id = SOAP_ACTION_ADD_ANY_PORT_MAPPING};
+
+SOAPAction * const SOAPActions[] = {
+    &SOAPActionAddPortMapping,
+    &SOAPActionGetSpecificPortMappingEntry,
+    &SOAPActionDeletePortMapping,
+    &SOAPActionGetGenericPortMappingEntry,
+    &SOAPActionGetExternalIPAddress,
+    &SOAPActionGetStatusInfo,
+    &SOAPActionAddAnyPortMapping,
+    0
+};
+
+// PCP and NAT-PMP messages are big endian
+static void writeUint16(uint8_t *buf, uint16_t value) {
+    buf[0] = (uint8_t) (value >> 8);
+    buf[1] = (uint8_t) value;
+}
+
+static void writeUint32(uint8_t *buf, uint32_t value) {
+    writeUint16(buf, (uint16_t) (value >> 16));
+    writeUint16(buf + 2, (uint16_t) value);
+}
+
+static uint16_t readUint16(const uint8_t *buf) {
+    return ((uint16_t) buf[0] << 8) | buf[1];
+}
+
+static uint32_t readUint32(const uint8_t *buf) {
+    return ((uint32_t) readUint16(buf) << 16) | readUint16(buf + 2);
+}
 
-SOAPAction SOAPActionGetSpecificPortMappingEntry = {.name = "GetSpecificPortMappingEntry"};
-SOAPAction SOAPActionDeletePortMapping = {.name = "DeletePortMapping"};
+// PCP addresses are 16 bytes, IPv4 addresses are IPv4-mapped (::ffff:a.b.c.d)
+static void writeIPv4MappedAddress(uint8_t *buf, IPAddress ip) {
+    memset(buf, 0, 10);
+    buf[10] = 0xff;
+    buf[11] = 0xff;
+    for (int i = 0; i < 4; i++) {
+        buf[12 + i] = ip[i];
+    }
+}
 
 // timeoutMs - timeout in milli seconds for the operations of this class, 0 for blocking operation
 TinyUPnP::TinyUPnP(unsigned long timeoutMs = 20000) {
     _timeoutMs = timeoutMs;
+    _operationDepth = 0;
+    _rateLimitPerSecond = 0;
+    _rateLimitBurst = 1;
+    _rateLimitTokens = 0;
+    _rateLimitRefillTime = 0;
+    _isRateLimitExceeded = false;
+    _gatewayCheckTime = 0;
+    _isFleetEnabled = false;
+    _fleetLeaderIP = ipNull;
+    _fleetLeaderSeenTime = 0;
+    _hasFleetLeaderState = false;
+    _isFleetStateDisputed = false;
+    _fleetLeaderUptime = -1;
+    _fleetLeaderExternalIP = ipNull;
+    _fleetLeaderCheckTime = 0;
+    _fleetAnnounceTime = 0;
+    _fleetAnnounceDelayMs = 0;
+    _client = &_wifiClient;
     _lastUpdateTime = 0;
+    _updateIntervalMs = 0;
+    _fallback = NULL;
     _consequtiveFails = 0;
+    _conflictPolicy = CONFLICT_POLICY_NONE;
+    _conflictMinPort = 0;
+    _conflictMaxPort = 0;
+    _descriptionLocations = descriptionLocationsIgd;
+    _natProtocol = NAT_PROTOCOL_UPNP_IGD;  // probing for PCP costs a gateway that does not answer it almost 2 seconds
+    _activeNatProtocol = NAT_PROTOCOL_AUTO;
+    memset(_pcpNonce, 0, sizeof(_pcpNonce));
+    _hasPcpNonce = false;
+    _allocator = &_heapAllocator;
+    _operationAllocator = &_arenaAllocator;
+    memset(&_allocationStats, 0, sizeof(_allocationStats));
+    memset(&_callAllocationStats, 0, sizeof(_callAllocationStats));
+    _isSubscribedToNetworkEvents = false;
+    _linkLossCount = 0;
+    _handledLinkLossCount = 0;
+    _lastGatewayIP = ipNull;
+    _lastLocalIP = ipNull;
     _headRuleNode = NULL;
+    _nextRuleIndex = 0;
+    _ssdpDeviceCache = NULL;
+    _ssdpListening = false;
+    _lastCommitTime = 0;
+    _lastCommitLocalIP = ipNull;
+    _externalIP = ipNull;
+    _externalIPCheckTime = 0;
+    _isWanConnected = false;
+    _routerUptime = -1;
+    _routerUptimeTime = 0;
     clearGatewayInfo(&_gwInfo);
 
     debugPrint(F("UPNP_UDP_TX_PACKET_MAX_SIZE="));
@@ -46,7 +141,31 @@ TinyUPnP::TinyUPnP(unsigned long timeoutMs = 20000) {
     debugPrintln(String(UPNP_UDP_TX_RESPONSE_MAX_SIZE));
 }
 
+TinyUPnP::TinyUPnP(unsigned long timeoutMs, Client *client) : TinyUPnP(timeoutMs) {
+    _client = client;
+}
+
 TinyUPnP::~TinyUPnP() {
+#if !defined(ESP8266)
+    if (_isSubscribedToNetworkEvents) {
+        WiFi.removeEvent(_disconnectedEventId);
+    }
+#endif
+
+    upnpRuleNode *currRuleNode = _headRuleNode;
+    while (currRuleNode != NULL) {
+        upnpRuleNode *del_ptr = currRuleNode;
+        currRuleNode = currRuleNode->next;
+        freeRuleNode(del_ptr);
+    }
+
+    ssdpDeviceNode *curr_ptr = _ssdpDeviceCache;
+    while (curr_ptr != NULL) {
+        ssdpDeviceNode *del_ptr = curr_ptr;
+        curr_ptr = curr_ptr->next;
+        freeObject(del_ptr->ssdpDevice);
+        freeObject(del_ptr);
+    }
 }
 
 void TinyUPnP::addPortMappingConfig(IPAddress ruleIP, int rulePort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName) {
@@ -54,19 +173,153 @@ void TinyUPnP::addPortMappingConfig(IPAddress ruleIP, int rulePort, String ruleP
 }
 
 void TinyUPnP::addPortMappingConfig(IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName) {
-    static int index = 0;
-    upnpRule *newUpnpRule = new upnpRule();
-    newUpnpRule->index = index++;
+    addRule(ruleIP, ruleInternalPort, ruleExternalPort, ruleProtocol, ruleLeaseDuration, ruleFriendlyName);
+}
+
+// returns the handle of the new rule, it is added to the IGD on the next commit
+int TinyUPnP::addRule(IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName) {
+    upnpRule *newUpnpRule = allocateObject<upnpRule>();
+    if (newUpnpRule == NULL) {
+        debugPrintln(F("ERROR: Out of memory for a new rule"));
+        return UPNP_RULE_INVALID_HANDLE;
+    }
+    newUpnpRule->index = _nextRuleIndex++;
     newUpnpRule->internalAddr = (ruleIP == WiFi.localIP()) ? ipNull : ruleIP;  // for automatic IP change handling
     newUpnpRule->internalPort = ruleInternalPort;
     newUpnpRule->externalPort = ruleExternalPort;
     newUpnpRule->leaseDuration = ruleLeaseDuration;
     newUpnpRule->protocol = ruleProtocol;
     newUpnpRule->devFriendlyName = ruleFriendlyName;
+    newUpnpRule->isDirty = true;
+    newUpnpRule->isRemoved = false;
+    newUpnpRule->lastCommitTime = 0;
+    newUpnpRule->isMapped = false;
+    newUpnpRule->grantedLeaseDuration = 0;
+    if (!insertRuleNode(newUpnpRule)) {
+        freeObject(newUpnpRule);
+        return UPNP_RULE_INVALID_HANDLE;
+    }
+    coalescePendingActions(newUpnpRule);
+    return newUpnpRule->index;
+}
+
+// the new values are sent to the IGD on the next commit, false if there is no rule with ruleHandle
+boolean TinyUPnP::updateRule(int ruleHandle, IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName) {
+    upnpRuleNode *node_ptr = findRuleNode(ruleHandle);
+    if (node_ptr == NULL) {
+        debugPrintln(F("ERROR: No rule with the given handle"));
+        return false;
+    }
+
+    upnpRule *rule_ptr = node_ptr->upnpRule;
+    IPAddress internalAddr = (ruleIP == WiFi.localIP()) ? ipNull : ruleIP;
+    // nothing to delete if the current values were never mapped
+    if (rule_ptr->isMapped
+            && (rule_ptr->externalPort != ruleExternalPort || rule_ptr->protocol != ruleProtocol || rule_ptr->internalAddr != internalAddr)) {
+        // the IGD would keep the old port mapping (or refuse the new one), delete it on the next commit
+        upnpRule *oldRule_ptr = allocateObject<upnpRule>(*rule_ptr);
+        if (oldRule_ptr == NULL) {
+            debugPrintln(F("ERROR: Out of memory for the rule to delete"));
+            return false;
+        }
+        oldRule_ptr->isRemoved = true;
+        oldRule_ptr->isDirty = true;
+        if (!insertRuleNode(oldRule_ptr)) {
+            freeObject(oldRule_ptr);
+            return false;
+        }
+        rule_ptr->lastCommitTime = 0;
+        rule_ptr->isMapped = false;
+    }
+
+    rule_ptr->internalAddr = internalAddr;
+    rule_ptr->internalPort = ruleInternalPort;
+    rule_ptr->externalPort = ruleExternalPort;
+    rule_ptr->leaseDuration = ruleLeaseDuration;
+    rule_ptr->protocol = ruleProtocol;
+    rule_ptr->devFriendlyName = ruleFriendlyName;
+    rule_ptr->isDirty = true;
+    coalescePendingActions(rule_ptr);
+    return true;
+}
+
+// the port mapping is deleted from the IGD on the next commit, false if there is no rule with ruleHandle
+// a rule that was never mapped is dropped right away
+boolean TinyUPnP::removeRule(int ruleHandle) {
+    upnpRuleNode *node_ptr = findRuleNode(ruleHandle);
+    if (node_ptr == NULL) {
+        debugPrintln(F("ERROR: No rule with the given handle"));
+        return false;
+    }
+    if (!node_ptr->upnpRule->isMapped) {
+        removeRuleNode(node_ptr);
+        return true;
+    }
+    node_ptr->upnpRule->isRemoved = true;
+    node_ptr->upnpRule->isDirty = true;
+    return true;
+}
+
+// removed rules are kept until their port mapping was deleted from the IGD
+boolean TinyUPnP::hasRules() {
+    return _headRuleNode != NULL;
+}
+
+// rule_ptr is the newest rule for its external port and protocol, the older pending actions for that port mapping are dropped:
+// a rule that was never mapped is dropped, a port mapping of the same internal target is taken over by rule_ptr (e.g. a rule
+// removed and added again before the commit) and only a port mapping of another internal target is still deleted, once
+void TinyUPnP::coalescePendingActions(upnpRule *rule_ptr) {
+    boolean hasRemoval = false;
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        upnpRuleNode *nextNode = currNode->next;
+        upnpRule *old_ptr = currNode->upnpRule;
+        if (old_ptr == rule_ptr || old_ptr->externalPort != rule_ptr->externalPort || old_ptr->protocol != rule_ptr->protocol) {
+            currNode = nextNode;
+            continue;
+        }
+        boolean isSameTarget = old_ptr->internalAddr == rule_ptr->internalAddr && old_ptr->internalPort == rule_ptr->internalPort;
+        if (old_ptr->isMapped && !isSameTarget && !hasRemoval) {
+            // the IGD would refuse (718) the new port mapping while it holds this one
+            old_ptr->isRemoved = true;
+            old_ptr->isDirty = true;
+            hasRemoval = true;
+            currNode = nextNode;
+            continue;
+        }
+        debugPrint(F("Coalesced the pending action of port mapping ["));
+        debugPrint(old_ptr->devFriendlyName);
+        debugPrintln(F("]"));
+        if (old_ptr->isMapped && isSameTarget) {
+            rule_ptr->lastCommitTime = old_ptr->lastCommitTime;  // the port mapping is still in the IGD
+            rule_ptr->isMapped = true;
+        }
+        removeRuleNode(currNode);
+        currNode = nextNode;
+    }
+}
+
+// NULL if there is no rule with ruleHandle (or it was removed)
+upnpRuleNode* TinyUPnP::findRuleNode(int ruleHandle) {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (currNode->upnpRule->index == ruleHandle && !currNode->upnpRule->isRemoved) {
+            return currNode;
+        }
+        currNode = currNode->next;
+    }
+    return NULL;
+}
 
+// false if out of memory, the rule is not owned by the list in that case
+boolean TinyUPnP::insertRuleNode(upnpRule *rule_ptr) {
     // linked list insert
-    upnpRuleNode *newUpnpRuleNode = new upnpRuleNode();
-    newUpnpRuleNode->upnpRule = newUpnpRule;
+    upnpRuleNode *newUpnpRuleNode = allocateObject<upnpRuleNode>();
+    if (newUpnpRuleNode == NULL) {
+        debugPrintln(F("ERROR: Out of memory for a new rule node"));
+        return false;
+    }
+    newUpnpRuleNode->upnpRule = rule_ptr;
     newUpnpRuleNode->next = NULL;
     
     if (_headRuleNode == NULL) {
@@ -78,6 +331,129 @@ void TinyUPnP::addPortMappingConfig(IPAddress ruleIP, int ruleInternalPort, int
         }
         currNode->next = newUpnpRuleNode;
     }
+    return true;
+}
+
+// unlinks node_ptr from the list of rules and frees it
+void TinyUPnP::removeRuleNode(upnpRuleNode *node_ptr) {
+    if (_headRuleNode == node_ptr) {
+        _headRuleNode = node_ptr->next;
+    } else {
+        upnpRuleNode *prevNode = _headRuleNode;
+        while (prevNode != NULL && prevNode->next != node_ptr) {
+            prevNode = prevNode->next;
+        }
+        if (prevNode == NULL) {
+            return;
+        }
+        prevNode->next = node_ptr->next;
+    }
+    freeRuleNode(node_ptr);
+}
+
+void TinyUPnP::freeRuleNode(upnpRuleNode *node_ptr) {
+    freeObject(node_ptr->upnpRule);
+    freeObject(node_ptr);
+}
+
+boolean TinyUPnP::hasDirtyRules() {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (currNode->upnpRule->isDirty) {
+            return true;
+        }
+        currNode = currNode->next;
+    }
+    return false;
+}
+
+// the rules directed to this device (see addPortMappingConfig) have to follow a change of its IP
+void TinyUPnP::markLocalRulesDirty() {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (currNode->upnpRule->internalAddr == ipNull && !currNode->upnpRule->isRemoved) {
+            currNode->upnpRule->isDirty = true;
+            currNode->upnpRule->lastCommitTime = 0;
+        }
+        currNode = currNode->next;
+    }
+}
+
+// the WiFi library keeps the handlers in a global list, so this is done on first use rather than in the constructor
+void TinyUPnP::subscribeNetworkEvents() {
+    if (_isSubscribedToNetworkEvents) {
+        return;
+    }
+    _isSubscribedToNetworkEvents = true;
+    _lastGatewayIP = WiFi.gatewayIP();
+    _lastLocalIP = WiFi.localIP();
+#if defined(ESP8266)
+    _disconnectedHandler = WiFi.onStationModeDisconnected([this] (const WiFiEventStationModeDisconnected &) {
+        _linkLossCount++;
+    });
+#else
+    _disconnectedEventId = WiFi.onEvent([this] (WiFiEvent_t, WiFiEventInfo_t) {
+        _linkLossCount++;
+    }, WIFI_STA_DISCONNECTED_EVENT);
+#endif
+}
+
+// true if handleNetworkChange has a change to handle, without handling it (the gateway info stays as it is)
+boolean TinyUPnP::isNetworkChanged() {
+    if (!_isSubscribedToNetworkEvents || WiFi.status() != WL_CONNECTED) {
+        return false;
+    }
+    return _linkLossCount != _handledLinkLossCount || WiFi.gatewayIP() != _lastGatewayIP || WiFi.localIP() != _lastLocalIP;
+}
+
+// a lost link (e.g. roaming to another network with the same gateway IP) or a new gateway means the IGD has to be
+// discovered again, a new local IP only affects the rules directed to this device, either way the update is due now
+void TinyUPnP::handleNetworkChange() {
+    subscribeNetworkEvents();
+    if (WiFi.status() != WL_CONNECTED) {
+        return;  // wait until the link is back
+    }
+
+    IPAddress gatewayIP = WiFi.gatewayIP();
+    IPAddress localIP = WiFi.localIP();
+    uint32_t linkLossCount = _linkLossCount;
+    boolean isGatewayChanged = linkLossCount != _handledLinkLossCount || gatewayIP != _lastGatewayIP;
+    boolean isLocalIPChanged = localIP != _lastLocalIP;
+    if (!isGatewayChanged && !isLocalIPChanged) {
+        return;
+    }
+    _handledLinkLossCount = linkLossCount;
+    _lastGatewayIP = gatewayIP;
+    _lastLocalIP = localIP;
+
+    debugPrint(F("Network change detected, gateway IP ["));
+    debugPrint(gatewayIP.toString());
+    debugPrint(F("] local IP ["));
+    debugPrint(localIP.toString());
+    debugPrintln(F("]"));
+
+    if (isGatewayChanged) {
+        clearGatewayInfo(&_gwInfo);  // all the rules are committed again to whatever IGD is found
+        _activeNatProtocol = NAT_PROTOCOL_AUTO;
+    } else {
+        markLocalRulesDirty();
+    }
+    _consequtiveFails = 0;
+    if (_updateIntervalMs > 0) {
+        _lastUpdateTime = millis() - _updateIntervalMs;
+    }
+}
+
+// the port mappings might have been lost by the IGD, verify all of them on the next commit
+void TinyUPnP::markAllRulesDirty() {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        currNode->upnpRule->isDirty = true;
+        if (!currNode->upnpRule->isRemoved) {
+            currNode->upnpRule->lastCommitTime = 0;
+        }
+        currNode = currNode->next;
+    }
 }
 
 portMappingResult TinyUPnP::commitPortMappings() {
@@ -86,23 +462,41 @@ portMappingResult TinyUPnP::commitPortMappings() {
         return EMPTY_PORT_MAPPING_CONFIG;
     }
 
-    unsigned long startTime = millis();
+    OperationScope operation(this);
+    _isRateLimitExceeded = false;
 
     // verify WiFi is connected
-    if (!testConnectivity(startTime)) {
+    if (!testConnectivity()) {
         debugPrintln(F("ERROR: not connected to WiFi, cannot continue"));
         return NETWORK_ERROR;
     }
 
+    subscribeNetworkEvents();
+    if (_lastCommitLocalIP != WiFi.localIP()) {
+        markLocalRulesDirty();
+    }
+
+    // a gateway that supports PCP or NAT-PMP maps each rule with a single datagram, no SSDP nor SOAP
+    if (_activeNatProtocol == NAT_PROTOCOL_AUTO) {
+        markAllRulesDirty();  // might be a different gateway
+        if (!detectNatProtocol(WiFi.gatewayIP())) {
+            debugPrintln(F("ERROR: The gateway does not support the configured protocol"));
+            return NETWORK_ERROR;
+        }
+    }
+    if (_activeNatProtocol != NAT_PROTOCOL_UPNP_IGD) {
+        return commitPcpPortMappings();
+    }
+
     // get all the needed IGD information using SSDP if we don't have it already
     if (!isGatewayInfoValid(&_gwInfo)) {
-        getGatewayInfo(&_gwInfo, startTime);
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        markAllRulesDirty();  // might be a different IGD
+        if (!getGatewayInfo(&_gwInfo)) {
             debugPrintln(F("ERROR: Invalid router info, cannot continue"));
-            _wifiClient.stop();
+            _client->stop();
             return NETWORK_ERROR;
         }
-        delay(1000);  // longer delay to allow more time for the router to update its rules
+        _deadline.sleep(1000);  // longer delay to allow more time for the router to update its rules
     }
 
     debugPrint(F("port ["));
@@ -120,42 +514,106 @@ portMappingResult TinyUPnP::commitPortMappings() {
     if (_gwInfo.port != _gwInfo.actionPort) {
         // in this case we need to connect to a different port
         debugPrintln(F("Connection port changed, disconnecting from IGD"));
-        _wifiClient.stop();
+        _client->stop();
     }
 
+    // only the rules that changed since the last commit (or whose lease is about to expire) are sent to the IGD
     bool allPortMappingsAlreadyExist = true;  // for debug
     int addedPortMappings = 0;  // for debug
+    // the removals go first, the old values of an updated rule would otherwise conflict (718) with its new port mapping
+    // removeAllPortMappingsFromIGD (called by verifyPortMapping) may drop removed rules, so no previous node is kept
     upnpRuleNode *currNode = _headRuleNode;
     while (currNode != NULL) {
+        upnpRuleNode *nextNode = currNode->next;
+        if (currNode->upnpRule->isRemoved) {
+            debugPrint(F("Delete port mapping for removed rule ["));
+            debugPrint(currNode->upnpRule->devFriendlyName);
+            debugPrintln(F("]"));
+            boolean isDeleted = deletePortMapping(&_gwInfo, currNode->upnpRule);
+            _client->stop();
+            if (isDeleted) {
+                removeRuleNode(currNode);
+            } else {
+                debugPrintln(F("Could not delete the port mapping, will try again on the next commit"));
+            }
+        }
+        currNode = nextNode;
+    }
+
+    currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (currNode->upnpRule->isRemoved) {
+            currNode = currNode->next;  // its delete failed above
+            continue;
+        }
+
+        if (!currNode->upnpRule->isDirty && !isRuleLeaseCloseToExpiry(currNode->upnpRule, _updateIntervalMs)) {
+            currNode = currNode->next;
+            continue;
+        }
+
         debugPrint(F("Verify port mapping for rule ["));
         debugPrint(currNode->upnpRule->devFriendlyName);
         debugPrintln(F("]"));
         bool currPortMappingAlreadyExists = true;  // for debug
+        // a rule updated in place is already mapped with its old values, so it is added again right away
+        boolean isUpdated = currNode->upnpRule->isDirty && currNode->upnpRule->lastCommitTime > 0;
         // TODO: since verifyPortMapping connects to the IGD then addPortMappingEntry can skip it
-        if (!verifyPortMapping(&_gwInfo, currNode->upnpRule)) {
+        if (isUpdated || !verifyPortMapping(&_gwInfo, currNode->upnpRule)) {
             // need to add the port mapping
             currPortMappingAlreadyExists = false;
             allPortMappingsAlreadyExist = false;
-            if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+            if (_deadline.isExpired()) {
                 debugPrintln(F("Timeout expired while trying to add a port mapping"));
-                _wifiClient.stop();
+                _client->stop();
                 return TIMEOUT;
             }
 
-            addPortMappingEntry(&_gwInfo, currNode->upnpRule);
+            soapActionResult addResult = addPortMappingEntry(&_gwInfo, currNode->upnpRule, &SOAPActionAddPortMapping);
+            if (addResult == SOAP_RESULT_ONLY_PERMANENT_LEASES && currNode->upnpRule->leaseDuration > 0) {
+                debugPrintln(F("IGD only supports permanent leases, adding the port mapping again with lease duration 0"));
+                currNode->upnpRule->leaseDuration = 0;
+                addResult = addPortMappingEntry(&_gwInfo, currNode->upnpRule, &SOAPActionAddPortMapping);
+            }
+            if (addResult == SOAP_RESULT_CONFLICT && resolvePortConflict(&_gwInfo, currNode->upnpRule)) {
+                addResult = SOAP_RESULT_SUCCESS;
+            }
+
+            switch (addResult) {
+                case SOAP_RESULT_SUCCESS:
+                    break;
+                case SOAP_RESULT_NETWORK_ERROR:
+                    _client->stop();
+                    return NETWORK_ERROR;
+                case SOAP_RESULT_CONFLICT:
+                    // retrying will not help, the external port is held by another host
+                    _client->stop();
+                    return PORT_CONFLICT;
+                default:
+                    // no point in verifying a port mapping the IGD refused
+                    _client->stop();
+                    return ACTION_REJECTED;
+            }
 
             int tries = 0;
-            while (tries <= 3) {
-                delay(2000);  // longer delay to allow more time for the router to update its rules
-                if (verifyPortMapping(&_gwInfo, currNode->upnpRule)) {
+            boolean isVerified = false;
+            while (tries <= 3 && !_deadline.isExpired()) {
+                _deadline.sleep(2000);  // longer delay to allow more time for the router to update its rules
+                soapActionResult verifyResult;
+                if (verifyPortMapping(&_gwInfo, currNode->upnpRule, &verifyResult)) {
+                    isVerified = true;
+                    break;
+                }
+                if (verifyResult != SOAP_RESULT_NO_SUCH_ENTRY && verifyResult != SOAP_RESULT_NETWORK_ERROR) {
+                    // the IGD will not answer differently on the next try
                     break;
                 }
                 tries++;
             }
 
-            if (tries > 3) {
-                _wifiClient.stop();
-                return VERIFICATION_FAILED;
+            if (!isVerified) {
+                _client->stop();
+                return _deadline.isExpired() ? TIMEOUT : VERIFICATION_FAILED;
             }
         }
 
@@ -166,10 +624,23 @@ portMappingResult TinyUPnP::commitPortMappings() {
             debugPrintln(F("] was added"));
         }
 
+        currNode->upnpRule->isDirty = false;
+        currNode->upnpRule->lastCommitTime = millis();
+        currNode->upnpRule->isMapped = true;
+        currNode->upnpRule->grantedLeaseDuration = 0;
         currNode = currNode->next;
     }
 
-    _wifiClient.stop();
+    _client->stop();
+
+    // remember the state of the IGD so that updatePortMappings can detect changes with a single query
+    // (a follower in fleet mode takes the state the leader checked instead)
+    _lastCommitTime = millis();
+    _lastCommitLocalIP = WiFi.localIP();
+    if (!adoptFleetState(_updateIntervalMs > 0 ? _updateIntervalMs : FLEET_MEMBER_TIMEOUT_MS)) {
+        updateGatewayStatus(&_gwInfo);
+        _gatewayCheckTime = millis();
+    }
     
     if (allPortMappingsAlreadyExist) {
         debugPrintln(F("All port mappings were already found in the IGD, not doing anything"));
@@ -187,28 +658,42 @@ portMappingResult TinyUPnP::commitPortMappings() {
     return SUCCESS;
 }
 
-boolean TinyUPnP::getGatewayInfo(gatewayInfo *deviceInfo, long startTime) {
+boolean TinyUPnP::getGatewayInfo(gatewayInfo *deviceInfo) {
     while (!connectUDP()) {
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        if (_deadline.isExpired()) {
             debugPrint(F("Timeout expired while connecting UDP"));
             _udpClient.stop();
             return false;
         }
-        delay(500);
+        _deadline.sleep(500);
         debugPrint(".");
     }
     debugPrintln("");  // \n
     
-    broadcastMSearch();
     IPAddress gatewayIP = WiFi.gatewayIP();
 
     debugPrint(F("Gateway IP ["));
     debugPrint(gatewayIP.toString());
     debugPrintln(F("]"));
 
+    // the gateway answers a unicast M-SEARCH right away, the multicast one is kept for IGDs that do not
+    // the first response from the gateway wins either way
+    unicastMSearch(gatewayIP);
+    broadcastMSearch();
+
+    unsigned long mSearchTime = millis();
+    boolean isProbed = false;
     ssdpDevice* ssdpDevice_ptr = NULL;
     while ((ssdpDevice_ptr = waitForUnicastResponseToMSearch(gatewayIP)) == NULL) {
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        // multicast might be filtered on this network (e.g. AP client isolation), look for the description directly
+        if (!isProbed && (millis() - mSearchTime > SSDP_GATEWAY_RESPONSE_WAIT_MS
+                || (_timeoutMs > 0 && _deadline.getRemainingMs() < (unsigned long) _timeoutMs / 2))) {
+            isProbed = true;
+            if (probeDescriptionLocations(deviceInfo, gatewayIP)) {
+                break;
+            }
+        }
+        if (_deadline.isExpired()) {
             debugPrintln(F("Timeout expired while waiting for the gateway router to respond to M-SEARCH message"));
             _udpClient.stop();
             return false;
@@ -216,37 +701,89 @@ boolean TinyUPnP::getGatewayInfo(gatewayInfo *deviceInfo, long startTime) {
         delay(1);
     }
 
-    deviceInfo->host = ssdpDevice_ptr->host;
-    deviceInfo->port = ssdpDevice_ptr->port;
-    deviceInfo->path = ssdpDevice_ptr->path;
-    // the following is the default and may be overridden if URLBase tag is specified
-    deviceInfo->actionPort = ssdpDevice_ptr->port;
+    if (ssdpDevice_ptr != NULL) {
+        deviceInfo->host = ssdpDevice_ptr->host;
+        deviceInfo->port = ssdpDevice_ptr->port;
+        deviceInfo->path = ssdpDevice_ptr->path;
+        // the following is the default and may be overridden if URLBase tag is specified
+        deviceInfo->actionPort = ssdpDevice_ptr->port;
 
-    delete ssdpDevice_ptr;
+        freeTemporaryObject(ssdpDevice_ptr);
+    }
 
     // close the UDP connection
     _udpClient.stop();
 
     // connect to IGD (TCP connection)
     while (!connectToIGD(deviceInfo->host, deviceInfo->port)) {
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        if (_deadline.isExpired()) {
             debugPrintln(F("Timeout expired while trying to connect to the IGD"));
-            _wifiClient.stop();
+            _client->stop();
             return false;
         }
-        delay(500);
+        _deadline.sleep(500);
     }
     
     // get event urls from the gateway IGD
     while (!getIGDEventURLs(deviceInfo)) {
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        if (_deadline.isExpired()) {
             debugPrintln(F("Timeout expired while adding a new port mapping"));
-            _wifiClient.stop();
+            _client->stop();
+            return false;
+        }
+        _deadline.sleep(500);
+    }
+
+    getSupportedActions(deviceInfo);
+
+    return true;
+}
+
+// fetches the description locations from the gateway in parallel, the first description that lists a WAN
+// connection service is used as if the gateway answered M-SEARCH with it
+// the fetches are made in batches on the stack, so probing takes nothing from the allocator
+boolean TinyUPnP::probeDescriptionLocations(gatewayInfo *deviceInfo, IPAddress gatewayIP) {
+    if (_descriptionLocations == NULL || _descriptionLocations[0].path == NULL) {
+        return false;
+    }
+    debugPrintln(F("The gateway did not respond to M-SEARCH, probing well-known description locations"));
+
+    auto onLine = [] (descriptionFetch *fetch, const String &line, void *arg) -> boolean {
+        descriptionFetch **hit_ptr = (descriptionFetch **) arg;
+        if (line.indexOf(F(":service:WANIPConnection:")) >= 0 || line.indexOf(F(":service:WANPPPConnection:")) >= 0) {
+            if (*hit_ptr == NULL) {
+                *hit_ptr = fetch;
+            }
             return false;
         }
-        delay(500);
+        return true;
+    };
+
+    descriptionFetch fetches[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    descriptionFetch *hit = NULL;
+    const descriptionLocation *location = _descriptionLocations;
+    while (hit == NULL && location->path != NULL) {
+        int count = 0;
+        for (; count < MAX_CONCURRENT_DESCRIPTION_FETCHES && location->path != NULL; count++, location++) {
+            fetches[count].host = gatewayIP;
+            fetches[count].port = location->port;
+            fetches[count].path = location->path;
+            fetches[count].context = NULL;
+        }
+        fetchDescriptions(fetches, count, onLine, &hit, MAX_CONCURRENT_DESCRIPTION_FETCHES);
     }
 
+    if (hit == NULL) {
+        return false;
+    }
+    debugPrint(F("IGD description found at ["));
+    debugPrint(String(hit->port));
+    debugPrint(hit->path);
+    debugPrintln(F("]"));
+    deviceInfo->host = gatewayIP;
+    deviceInfo->port = hit->port;
+    deviceInfo->path = hit->path;
+    deviceInfo->actionPort = hit->port;
     return true;
 }
 
@@ -257,6 +794,9 @@ void TinyUPnP::clearGatewayInfo(gatewayInfo *deviceInfo) {
     deviceInfo->actionPort = 0;
     deviceInfo->actionPath = "";
     deviceInfo->serviceTypeName = "";
+    deviceInfo->scpdPort = 0;
+    deviceInfo->scpdPath = "";
+    deviceInfo->supportedActions = 0;
 }
 
 boolean TinyUPnP::isGatewayInfoValid(gatewayInfo *deviceInfo) {
@@ -287,6 +827,13 @@ boolean TinyUPnP::isGatewayInfoValid(gatewayInfo *deviceInfo) {
 }
 
 portMappingResult TinyUPnP::updatePortMappings(unsigned long intervalMs, callback_function fallback) {
+    OperationScope operation(this);
+    setUpdateInterval(intervalMs, fallback);
+    handleNetworkChange();
+    if (_isFleetEnabled) {
+        processSsdpAnnouncements();  // the latest state shared by the leader
+    }
+
     if (millis() - _lastUpdateTime >= intervalMs) {
         debugPrintln(F("Updating port mapping"));
 
@@ -298,6 +845,7 @@ portMappingResult TinyUPnP::updatePortMappings(unsigned long intervalMs, callbac
 
             _consequtiveFails = 0;
             clearGatewayInfo(&_gwInfo);
+            _activeNatProtocol = NAT_PROTOCOL_AUTO;
             if (fallback != NULL) {
                 debugPrintln(F("Executing fallback method"));
                 fallback();
@@ -311,223 +859,1090 @@ portMappingResult TinyUPnP::updatePortMappings(unsigned long intervalMs, callbac
         // 	return;
         // }
 
+        // fast path - a single query to the IGD is enough if nothing changed since the last commit
+        // a follower in fleet mode does not even need that if the leader checked the IGD lately
+        boolean isFleetStateKnown = false;
+        boolean isStateUnchanged = isFleetStateUnchanged(intervalMs, &isFleetStateKnown);
+        if (!isFleetStateKnown) {
+            isStateUnchanged = isGatewayStateUnchanged(&_gwInfo);
+            if (isStateUnchanged) {
+                _gatewayCheckTime = millis();
+                if (_isFleetEnabled && isFleetLeader()) {
+                    announceToFleet();  // right away, so that the followers that update next can rely on it
+                }
+            }
+        }
+        if (isStateUnchanged && !hasDirtyRules() && !isLeaseCloseToExpiry(intervalMs)) {
+            debugPrintln(F("IGD state is unchanged, skipping port mappings verification"));
+            _lastUpdateTime = millis() - getUpdateJitterMs(intervalMs);
+            _client->stop();
+            _consequtiveFails = 0;
+            return ALREADY_MAPPED;
+        }
+        if (!isStateUnchanged) {
+            markAllRulesDirty();
+        }
+
         portMappingResult result = commitPortMappings();
 
         if (result == SUCCESS || result == ALREADY_MAPPED) {
-            _lastUpdateTime = millis();
-            _wifiClient.stop();
+            _lastUpdateTime = millis() - getUpdateJitterMs(intervalMs);
+            _client->stop();
             _consequtiveFails = 0;
+            if (_isFleetEnabled && isFleetLeader()) {
+                announceToFleet();
+            }
+            return result;
+        } else if (result == PORT_CONFLICT || result == ACTION_REJECTED) {
+            // the IGD refused the port mappings, an early retry would get the same answer
+            _lastUpdateTime = millis() - getUpdateJitterMs(intervalMs);
+            debugPrint(F("ERROR: The IGD refused the UPnP port mapping. Failed with error code ["));
+            debugPrint(String(result));
+            debugPrintln(F("]"));
+            _client->stop();
             return result;
         } else {
-            _lastUpdateTime += intervalMs / 2;  // delay next try
+            // transient failure, retry after an exponential backoff capped at half the interval
+            unsigned long backoffMs = intervalMs / 2;
+            if (_consequtiveFails < 16 && ((unsigned long) UPDATE_RETRY_BACKOFF_MIN_MS << _consequtiveFails) < backoffMs) {
+                backoffMs = (unsigned long) UPDATE_RETRY_BACKOFF_MIN_MS << _consequtiveFails;
+            }
+            _lastUpdateTime = millis() - intervalMs + backoffMs;  // delay next try
             debugPrint(F("ERROR: While updating UPnP port mapping. Failed with error code ["));
             debugPrint(String(result));
             debugPrintln(F("]"));
-            _wifiClient.stop();
-            _consequtiveFails++;
+            _client->stop();
+            if (!_isRateLimitExceeded) {
+                // a commit that only ran out of time waiting for the rate limit made progress, the IGD need not be discovered again
+                _consequtiveFails++;
+            }
             return result;
         }
     }
 
-    _wifiClient.stop();
+    _client->stop();
     return NOP;  // no need to check yet
 }
 
-boolean TinyUPnP::testConnectivity(unsigned long startTime) {
-    debugPrint(F("Testing WiFi connection for ["));
-    debugPrint(WiFi.localIP().toString());
-    debugPrint("]");
-    while (WiFi.status() != WL_CONNECTED) {
-        if (_timeoutMs > 0 && startTime > 0 && (millis() - startTime > _timeoutMs)) {
-            debugPrint(F(" ==> Timeout expired while verifying WiFi connection"));
-            _wifiClient.stop();
-            return false;
-        }
-        delay(200);
-        debugPrint(".");
-    }
-    debugPrintln(F(" ==> GOOD"));  // \n
+void TinyUPnP::setUpdateInterval(unsigned long intervalMs, callback_function fallback) {
+    _updateIntervalMs = intervalMs;
+    _fallback = fallback;
+}
 
-    debugPrint(F("Testing internet connection"));
-    _wifiClient.connect(connectivityTestIp, 80);
-    while (!_wifiClient.connected()) {
-        if (startTime + TCP_CONNECTION_TIMEOUT_MS > millis()) {
-            debugPrintln(F(" ==> BAD"));
-            _wifiClient.stop();
-            return false;
-        }
+// time left until the next update is due, updatePortMappings postpones it after a failure too
+// a network change makes the update due at once, it is handled by that update so polling has no side effects
+unsigned long TinyUPnP::getNextTimeoutMs() {
+    if (_updateIntervalMs == 0) {
+        return ULONG_MAX;
     }
-
-    debugPrintln(F(" ==> GOOD"));
-    _wifiClient.stop();
-    return true;
+    if (isNetworkChanged()) {
+        return 0;
+    }
+    unsigned long elapsedMs = millis() - _lastUpdateTime;
+    if (elapsedMs >= _updateIntervalMs) {
+        return 0;
+    }
+    return _updateIntervalMs - elapsedMs;
 }
 
-boolean TinyUPnP::verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-    if (!applyActionOnSpecificPortMapping(&SOAPActionGetSpecificPortMappingEntry ,deviceInfo, rule_ptr)) {
-        return false;
+// in fleet mode the next update is moved up by a random part of the interval, so that members which started together
+// (e.g. after a power outage) do not keep querying the IGD at the same time
+unsigned long TinyUPnP::getUpdateJitterMs(unsigned long intervalMs) {
+    if (!_isFleetEnabled || intervalMs < FLEET_UPDATE_JITTER_DIVISOR) {
+        return 0;
     }
+    return random(intervalMs / FLEET_UPDATE_JITTER_DIVISOR);
+}
 
-    debugPrintln(F("verifyPortMapping called"));
-    
-    // TODO: extract the current lease duration and return it instead of a boolean
-    boolean isSuccess = false;
-    boolean detectedChangedIP = false;
-    while (_wifiClient.available()) {
-        String line = _wifiClient.readStringUntil('\r');
-        debugPrint(line);
-        if (line.indexOf(F("errorCode")) >= 0) {
-            isSuccess = false;
-            // flush response and exit loop
-            while (_wifiClient.available()) {
-                line = _wifiClient.readStringUntil('\r');
-                debugPrint(line);
-            }
-            continue;
-        }
-
-        if (line.indexOf(F("NewInternalClient")) >= 0) {
-            String content = getTagContent(line, F("NewInternalClient"));
-            if (content.length() > 0) {
-                IPAddress ipAddressToVerify = (rule_ptr->internalAddr == ipNull) ? WiFi.localIP() : rule_ptr->internalAddr;
-                if (content == ipAddressToVerify.toString()) {
-                    isSuccess = true;
-                } else {
-                    detectedChangedIP = true;
-                }
-            }
-        }
+// to be called once getNextTimeoutMs expired
+portMappingResult TinyUPnP::onTimer() {
+    if (_updateIntervalMs == 0) {
+        return NOP;
     }
+    return updatePortMappings(_updateIntervalMs, _fallback);
+}
 
-    debugPrintln("");  // \n
+// policy - what to do when the external port of a rule is already mapped to another host
+// minPort, maxPort - the range of alternative external ports for CONFLICT_POLICY_RANGE
+void TinyUPnP::setPortConflictPolicy(portConflictPolicy policy, int minPort, int maxPort) {
+    _conflictPolicy = policy;
+    _conflictMinPort = minPort;
+    _conflictMaxPort = maxPort;
+}
 
-    _wifiClient.stop();
+void TinyUPnP::setDescriptionLocations(const descriptionLocation *locations) {
+    _descriptionLocations = locations;
+}
 
-    if (isSuccess) {
-        debugPrintln(F("Port mapping found in IGD"));
-    } else if (detectedChangedIP) {
-        debugPrintln(F("Detected a change in IP"));
-        removeAllPortMappingsFromIGD();
-    } else {
-        debugPrintln(F("Could not find port mapping in IGD"));
+// the external port actually assigned to the rule, which may differ from the configured one after a conflict
+// -1 if there is no rule with ruleHandle
+int TinyUPnP::getExternalPort(int ruleHandle) {
+    upnpRuleNode *node_ptr = findRuleNode(ruleHandle);
+    if (node_ptr == NULL) {
+        return -1;
     }
+    return node_ptr->upnpRule->externalPort;
+}
+
+// NAT_PROTOCOL_AUTO tries PCP first, then NAT-PMP if the gateway answered PCP with UNSUPP_VERSION, then UPnP IGD
+void TinyUPnP::setNatProtocol(natProtocol protocol) {
+    _natProtocol = protocol;
+    _activeNatProtocol = NAT_PROTOCOL_AUTO;
+}
+
+natProtocol TinyUPnP::getNatProtocol() {
+    return _activeNatProtocol;
+}
+
+void TinyUPnP::getPcpNonce(uint8_t nonce[PCP_NONCE_SIZE]) {
+    generatePcpNonce();
+    memcpy(nonce, _pcpNonce, PCP_NONCE_SIZE);
+}
+
+void TinyUPnP::setPcpNonce(const uint8_t nonce[PCP_NONCE_SIZE]) {
+    memcpy(_pcpNonce, nonce, PCP_NONCE_SIZE);
+    _hasPcpNonce = true;
+}
+
+// once per instance, from the hardware random number generator so that other hosts on the LAN cannot guess it
+void TinyUPnP::generatePcpNonce() {
+    if (_hasPcpNonce) {
+        return;
+    }
+    for (int i = 0; i < PCP_NONCE_SIZE; i += 4) {
+#if defined(ESP8266)
+        uint32_t value = RANDOM_REG32;
+#else
+        uint32_t value = esp_random();
+#endif
+        for (int j = 0; j < 4 && i + j < PCP_NONCE_SIZE; j++) {
+            _pcpNonce[i + j] = (uint8_t) (value >> (8 * j));
+        }
+    }
+    _hasPcpNonce = true;
+}
+
+void TinyUPnP::setRateLimit(unsigned int actionsPerSecond, unsigned int burst) {
+    _rateLimitPerSecond = actionsPerSecond;
+    _rateLimitBurst = burst > 0 ? burst : 1;
+    _rateLimitTokens = (unsigned long) _rateLimitBurst * 1000UL;
+    _rateLimitRefillTime = millis();
+}
+
+void TinyUPnP::setFleetMode(boolean isEnabled) {
+    if (isEnabled == _isFleetEnabled) {
+        return;
+    }
+    if (!isEnabled) {
+        announceToFleet(false);
+    }
+    _isFleetEnabled = isEnabled;
+    _fleetLeaderIP = ipNull;
+    _hasFleetLeaderState = false;
+    if (isEnabled && (_ssdpListening || connectUDP(true))) {
+        // the members answer with their announcements, so the leader is known within FLEET_SEARCH_RESPONSE_MAX_MS
+        broadcastMSearch(deviceListFleet);
+        announceToFleet();
+    }
+}
+
+boolean TinyUPnP::isFleetLeader() {
+    return !_isFleetEnabled || _fleetLeaderIP == ipNull || millis() - _fleetLeaderSeenTime > FLEET_MEMBER_TIMEOUT_MS
+        || !isIPAddressLower(_fleetLeaderIP, WiFi.localIP());
+}
+
+void TinyUPnP::setAllocator(UPnPAllocator *allocator) {
+    if (_headRuleNode != NULL || _ssdpDeviceCache != NULL) {
+        debugPrintln(F("ERROR: The allocator cannot be changed once rules or SSDP devices were allocated"));
+        return;
+    }
+    _allocator = allocator != NULL ? allocator : &_heapAllocator;
+}
+
+void TinyUPnP::setOperationAllocator(UPnPAllocator *allocator) {
+    if (_operationDepth > 0) {
+        debugPrintln(F("ERROR: The operation allocator cannot be changed during a call"));
+        return;
+    }
+    _operationAllocator = allocator != NULL ? allocator : &_arenaAllocator;
+}
+
+upnpAllocationStats TinyUPnP::getAllocationStats() {
+    return _allocationStats;
+}
+
+void TinyUPnP::resetAllocationStats() {
+    _allocationStats.numOfAllocations = 0;
+    _allocationStats.allocatedBytes = 0;
+    _allocationStats.numOfFailures = 0;
+    _allocationStats.highWaterBytes = _allocationStats.currentBytes;
+}
+
+upnpAllocationStats TinyUPnP::getLastCallAllocationStats() {
+    return _callAllocationStats;
+}
+
+// called by the outermost OperationScope, the objects kept from earlier calls count as the starting high-water mark
+void TinyUPnP::beginCallAllocationStats() {
+    _callAllocationStats.numOfAllocations = 0;
+    _callAllocationStats.allocatedBytes = 0;
+    _callAllocationStats.numOfFailures = 0;
+    _callAllocationStats.currentBytes = _allocationStats.currentBytes;
+    _callAllocationStats.highWaterBytes = _allocationStats.currentBytes;
+}
+
+// both the allocations since resetAllocationStats and those of the current call are counted
+void* TinyUPnP::allocateBytes(UPnPAllocator *allocator, size_t size) {
+    void *ptr = allocator->allocate(size);
+    upnpAllocationStats *statsList[] = {&_allocationStats, &_callAllocationStats};
+    for (upnpAllocationStats *stats : statsList) {
+        if (ptr == NULL) {
+            stats->numOfFailures++;
+            continue;
+        }
+        stats->numOfAllocations++;
+        stats->allocatedBytes += size;
+        stats->currentBytes += size;
+        if (stats->currentBytes > stats->highWaterBytes) {
+            stats->highWaterBytes = stats->currentBytes;
+        }
+    }
+    return ptr;
+}
+
+void TinyUPnP::freeBytes(UPnPAllocator *allocator, void *ptr, size_t size) {
+    _allocationStats.currentBytes -= size;
+    _callAllocationStats.currentBytes -= size;
+    allocator->deallocate(ptr, size);
+}
+
+// called after AddPortMapping failed with ConflictInMappingEntry, tries alternative external ports according to the
+// conflict policy and updates the external port of the rule, returns true if one of them was added
+boolean TinyUPnP::resolvePortConflict(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
+    debugPrint(F("External port ["));
+    debugPrint(String(rule_ptr->externalPort));
+    debugPrintln(F("] is already mapped to another host"));
+
+    if (_conflictPolicy == CONFLICT_POLICY_NONE) {
+        return false;
+    }
+
+    if (_conflictPolicy == CONFLICT_POLICY_ANY_PORT) {
+        // the IGD picks a free port by itself (IGDv2 only)
+        if (deviceInfo->serviceTypeName.indexOf(F(":2")) < 0) {
+            debugPrintln(F("AddAnyPortMapping requires WANIPConnection:2"));
+            return false;
+        }
+        return addPortMappingEntry(deviceInfo, rule_ptr, &SOAPActionAddAnyPortMapping) == SOAP_RESULT_SUCCESS;
+    }
+
+    // deterministic, so the same device gets the same alternative port every time
+    uint32_t hash = 2166136261UL;  // FNV-1a
+    String key = WiFi.macAddress() + rule_ptr->protocol + String(rule_ptr->internalPort);
+    for (unsigned int i = 0; i < key.length(); i++) {
+        hash = (hash ^ (uint8_t) key[i]) * 16777619UL;
+    }
+
+    int minPort = _conflictPolicy == CONFLICT_POLICY_RANGE ? _conflictMinPort : MIN_DYNAMIC_EXTERNAL_PORT;
+    int maxPort = _conflictPolicy == CONFLICT_POLICY_RANGE ? _conflictMaxPort : 65535;
+    if (minPort < 1 || maxPort > 65535 || minPort > maxPort) {
+        debugPrintln(F("ERROR: invalid port range for conflict resolution"));
+        return false;
+    }
+    uint32_t rangeSize = maxPort - minPort + 1;
+
+    for (int attempt = 0; attempt < MAX_PORT_CONFLICT_ATTEMPTS && (uint32_t) attempt < rangeSize; attempt++) {
+        int candidatePort = minPort + (hash + attempt) % rangeSize;
+        if (candidatePort == rule_ptr->externalPort) {
+            continue;
+        }
+        int prevExternalPort = rule_ptr->externalPort;
+        rule_ptr->externalPort = candidatePort;
+        debugPrint(F("Trying alternative external port ["));
+        debugPrint(String(candidatePort));
+        debugPrintln(F("]"));
+
+        soapActionResult addResult = addPortMappingEntry(deviceInfo, rule_ptr, &SOAPActionAddPortMapping);
+        if (addResult == SOAP_RESULT_SUCCESS) {
+            return true;
+        }
+        if (addResult != SOAP_RESULT_CONFLICT) {
+            rule_ptr->externalPort = prevExternalPort;
+            return false;
+        }
+    }
+
+    return false;
+}
+
+// true if a rule lease might expire before the next call to updatePortMappings
+boolean TinyUPnP::isLeaseCloseToExpiry(unsigned long intervalMs) {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (!currNode->upnpRule->isRemoved && isRuleLeaseCloseToExpiry(currNode->upnpRule, intervalMs)) {
+            return true;
+        }
+        currNode = currNode->next;
+    }
+    return false;
+}
+
+boolean TinyUPnP::isRuleLeaseCloseToExpiry(upnpRule *rule_ptr, unsigned long intervalMs) {
+    unsigned long elapsedMs = millis() - rule_ptr->lastCommitTime;
+    int leaseDuration = rule_ptr->grantedLeaseDuration > 0 ? rule_ptr->grantedLeaseDuration : rule_ptr->leaseDuration;
+    // lease duration of 0 means the port mapping is permanent
+    if (leaseDuration > 0 && elapsedMs + intervalMs >= (unsigned long) leaseDuration * 1000UL) {
+        debugPrint(F("Lease of port mapping ["));
+        debugPrint(rule_ptr->devFriendlyName);
+        debugPrintln(F("] is close to expiry"));
+        return true;
+    }
+    return false;
+}
+
+// compares the IGD uptime (or external IP if uptime is not supported) against the values cached by the last commit
+// a reboot of the IGD or a reconnection of its WAN link resets the uptime, in which case the port mappings must be verified
+// with PCP or NAT-PMP the epoch of the server is used the same way, it is queried with a single datagram
+boolean TinyUPnP::isGatewayStateUnchanged(gatewayInfo *deviceInfo) {
+    boolean isPcp = _activeNatProtocol == NAT_PROTOCOL_PCP || _activeNatProtocol == NAT_PROTOCOL_NAT_PMP;
+    if (_lastCommitTime == 0 || (!isPcp && !isGatewayInfoValid(deviceInfo))) {
+        return false;
+    }
+
+    if (_lastCommitLocalIP != WiFi.localIP()) {
+        debugPrintln(F("Local IP changed since the last commit"));
+        return false;
+    }
+
+    if (_routerUptime >= 0) {
+        long expectedUptime = _routerUptime + (long) ((millis() - _routerUptimeTime) / 1000);
+        IPAddress prevExternalIP = _externalIP;
+        boolean isUpdated = isPcp ? updatePcpEpoch(WiFi.gatewayIP()) : updateGatewayStatus(deviceInfo);
+        if (!isUpdated || _routerUptime < 0) {
+            return false;
+        }
+        if (_externalIP != prevExternalIP) {
+            debugPrintln(F("IGD external IP changed"));
+            return false;
+        }
+        if (_routerUptime + ROUTER_UPTIME_SLACK_S < expectedUptime) {
+            debugPrint(F("IGD uptime went back from ["));
+            debugPrint(String(expectedUptime));
+            debugPrint(F("] to ["));
+            debugPrint(String(_routerUptime));
+            debugPrintln(F("]"));
+            return false;
+        }
+        return true;
+    }
+
+    if (isPcp || _externalIP == ipNull) {
+        return false;
+    }
+    IPAddress prevExternalIP = _externalIP;
+    if (!updateExternalIP(deviceInfo)) {
+        return false;
+    }
+    return _externalIP == prevExternalIP;
+}
+
+// isGatewayStateUnchanged of a follower in fleet mode, based on the last check of the leader rather than on a query to the IGD
+// isKnown is set to false if the leader did not check the IGD within intervalMs, the follower has to query it then
+boolean TinyUPnP::isFleetStateUnchanged(unsigned long intervalMs, boolean *isKnown) {
+    *isKnown = false;
+    if (isFleetLeader() || !_hasFleetLeaderState || millis() - _fleetLeaderCheckTime > intervalMs) {
+        return false;
+    }
+    if (_lastCommitTime == 0 || _lastCommitLocalIP != WiFi.localIP()) {
+        return false;
+    }
+
+    // any LAN host can claim to be the leader, so a state that disagrees with what this device saw last is not adopted,
+    // the follower verifies its own rules and checks the IGD by itself instead (see adoptFleetState)
+    if (_externalIP != ipNull && _fleetLeaderExternalIP != _externalIP) {
+        debugPrintln(F("The fleet leader found another external IP"));
+        _isFleetStateDisputed = true;
+        *isKnown = true;
+        return false;
+    }
+
+    if (_fleetLeaderUptime >= 0 && _routerUptime >= 0) {
+        // compared as ages, millis() wraps around after 49 days
+        unsigned long now = millis();
+        unsigned long leaderAgeMs = now - _fleetLeaderCheckTime;
+        unsigned long ownAgeMs = now - _routerUptimeTime;
+        if (ownAgeMs < leaderAgeMs) {
+            return false;  // this device checked the IGD after the leader did
+        }
+        long elapsedS = (long) ((ownAgeMs - leaderAgeMs) / 1000);
+        *isKnown = true;
+        if (_fleetLeaderUptime + ROUTER_UPTIME_SLACK_S < _routerUptime + elapsedS) {
+            debugPrintln(F("The fleet leader found that the IGD uptime went back"));
+            _isFleetStateDisputed = true;
+            return false;
+        }
+        adoptFleetState(intervalMs);
+        return true;
+    }
+
+    if (_fleetLeaderUptime < 0 && _routerUptime < 0 && _externalIP != ipNull) {
+        *isKnown = true;
+        return true;  // the external IPs agree
+    }
+    return false;
+}
+
+// takes the state of the IGD as checked by the fleet leader within maxAgeMs as if this device checked it
+// false if this device is the leader, the leader did not share a recent check or its check disagreed with this device
+boolean TinyUPnP::adoptFleetState(unsigned long maxAgeMs) {
+    if (isFleetLeader() || !_hasFleetLeaderState || _isFleetStateDisputed || millis() - _fleetLeaderCheckTime > maxAgeMs) {
+        return false;
+    }
+    _routerUptime = _fleetLeaderUptime;
+    _routerUptimeTime = _fleetLeaderCheckTime;
+    _externalIP = _fleetLeaderExternalIP;
+    return true;
+}
+
+// updates the cached IGD uptime and connection status using GetStatusInfo, returns false if the uptime is not available
+// the external IP is only queried again if the uptime reset or is not supported by the IGD
+boolean TinyUPnP::updateGatewayStatus(gatewayInfo *deviceInfo) {
+    long prevRouterUptime = _routerUptime;
+    boolean wasWanConnected = _isWanConnected;
+    _routerUptime = -1;
+
+    if (applyAction(&SOAPActionGetStatusInfo, deviceInfo, NULL)) {
+        soapResponse response;
+        boolean isKeepAlive;
+        readHttpResponse(&response, &isKeepAlive);
+        _client->stop();
+
+        boolean isConnected = response.errorCode == 0 && strcmp_P(response.connectionStatus, PSTR("Connected")) == 0;
+        _isWanConnected = isConnected;
+        if (response.errorCode == 0 && response.uptime >= 0) {
+            _routerUptime = response.uptime;
+            _routerUptimeTime = millis();
+        }
+
+        if (!isConnected) {
+            debugPrintln(F("IGD WAN connection is not up"));
+            _routerUptime = -1;
+            return false;
+        }
+    }
+
+    // a reconnect of the WAN (e.g. DHCP or PPPoE) can change the external IP without resetting the uptime of the IGD,
+    // so the IP is also read again once the connection came back and every EXTERNAL_IP_CHECK_INTERVAL_MS
+    if (_routerUptime < 0 || _routerUptime < prevRouterUptime || _externalIP == ipNull || !wasWanConnected
+            || millis() - _externalIPCheckTime >= EXTERNAL_IP_CHECK_INTERVAL_MS) {
+        updateExternalIP(deviceInfo);
+    }
+    return _routerUptime >= 0;
+}
+
+boolean TinyUPnP::updateExternalIP(gatewayInfo *deviceInfo) {
+    if (!applyAction(&SOAPActionGetExternalIPAddress, deviceInfo, NULL)) {
+        return false;
+    }
+
+    soapResponse response;
+    boolean isKeepAlive;
+    readHttpResponse(&response, &isKeepAlive);
+    _client->stop();
+
+    IPAddress externalIP;
+    boolean isSuccess = response.errorCode == 0
+        && parseIPAddress(response.externalIPAddress, strlen(response.externalIPAddress), &externalIP);
+    if (isSuccess) {
+        _externalIP = externalIP;
+        _externalIPCheckTime = millis();
+    }
+
+    debugPrint(F("External IP ["));
+    debugPrint(_externalIP.toString());
+    debugPrintln(F("]"));
 
     return isSuccess;
 }
 
-boolean TinyUPnP::deletePortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-    if (!applyActionOnSpecificPortMapping(&SOAPActionDeletePortMapping ,deviceInfo, rule_ptr)) {
+IPAddress TinyUPnP::getExternalIP() {
+    return _externalIP;
+}
+
+// PCP has no request for the external IP alone, it comes with the mappings so the cached one is returned then
+IPAddress TinyUPnP::queryExternalIP() {
+    OperationScope operation(this);
+    if (_activeNatProtocol == NAT_PROTOCOL_NAT_PMP) {
+        return updatePcpEpoch(WiFi.gatewayIP()) ? _externalIP : ipNull;
+    }
+    if (_activeNatProtocol == NAT_PROTOCOL_PCP) {
+        return _externalIP;
+    }
+
+    if (!isGatewayInfoValid(&_gwInfo) && !getGatewayInfo(&_gwInfo)) {
+        debugPrintln(F("ERROR: Invalid router info, cannot query the external IP"));
+        _client->stop();
+        return ipNull;
+    }
+    boolean isSuccess = updateExternalIP(&_gwInfo);
+    _client->stop();
+    return isSuccess ? _externalIP : ipNull;
+}
+
+boolean TinyUPnP::testConnectivity() {
+    OperationScope operation(this);
+    debugPrint(F("Testing WiFi connection for ["));
+    debugPrint(WiFi.localIP().toString());
+    debugPrint("]");
+    while (WiFi.status() != WL_CONNECTED) {
+        if (_deadline.isExpired()) {
+            debugPrint(F(" ==> Timeout expired while verifying WiFi connection"));
+            _client->stop();
+            return false;
+        }
+        _deadline.sleep(200);
+        debugPrint(".");
+    }
+    debugPrintln(F(" ==> GOOD"));  // \n
+
+    // over WiFi rather than the injected transport, this is not a conversation with the IGD so it is kept out of
+    // captures and a replay does not depend on it
+    debugPrint(F("Testing internet connection"));
+    _wifiClient.connect(connectivityTestIp, 80);
+    UPnPDeadline connectDeadline = _deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS);
+    while (!_wifiClient.connected()) {
+        if (connectDeadline.isExpired()) {
+            debugPrintln(F(" ==> BAD"));
+            _wifiClient.stop();
+            return false;
+        }
+        delay(1);
+    }
+
+    debugPrintln(F(" ==> GOOD"));
+    _wifiClient.stop();
+    return true;
+}
+
+// result (optional) is set to the outcome of GetSpecificPortMappingEntry
+boolean TinyUPnP::verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr, soapActionResult *result) {
+    soapActionResult tmpResult;
+    if (result == NULL) {
+        result = &tmpResult;
+    }
+    if (!isActionSupported(deviceInfo, &SOAPActionGetSpecificPortMappingEntry)) {
+        *result = SOAP_RESULT_NOT_SUPPORTED;
+        return false;
+    }
+    if (!applyAction(&SOAPActionGetSpecificPortMappingEntry, deviceInfo, rule_ptr)) {
+        *result = SOAP_RESULT_NETWORK_ERROR;
         return false;
     }
+    *result = SOAP_RESULT_SUCCESS;
+
+    debugPrintln(F("verifyPortMapping called"));
     
+    // TODO: extract the current lease duration and return it instead of a boolean
     boolean isSuccess = false;
-    while (_wifiClient.available()) {
-        String line = _wifiClient.readStringUntil('\r');
-        debugPrint(line);
-        if (line.indexOf(F("errorCode")) >= 0) {
-            isSuccess = false;
-            // flush response and exit loop
-            while (_wifiClient.available()) {
-                line = _wifiClient.readStringUntil('\r');
-                debugPrint(line);
+    boolean detectedChangedIP = false;
+    soapResponse response;
+    boolean isKeepAlive;
+    if (readHttpResponse(&response, &isKeepAlive) < 0) {
+        *result = SOAP_RESULT_NETWORK_ERROR;
+    } else if (response.errorCode > 0) {
+        *result = classifySoapError(response.errorCode);
+    } else if (response.internalClient[0] != '\0') {
+        IPAddress ipAddressToVerify = (rule_ptr->internalAddr == ipNull) ? WiFi.localIP() : rule_ptr->internalAddr;
+        IPAddress internalClient;
+        if (parseIPAddress(response.internalClient, strlen(response.internalClient), &internalClient) && internalClient == ipAddressToVerify) {
+            isSuccess = true;
+        } else {
+            detectedChangedIP = true;
+        }
+    }
+
+    _client->stop();
+
+    if (isSuccess) {
+        debugPrintln(F("Port mapping found in IGD"));
+    } else if (detectedChangedIP) {
+        debugPrintln(F("Detected a change in IP"));
+        // the port mapping of this rule points to an old IP whether or not this instance added it
+        deletePortMapping(deviceInfo, rule_ptr);
+        rule_ptr->isMapped = false;
+        removeAllPortMappingsFromIGD();
+        *result = SOAP_RESULT_NO_SUCH_ENTRY;  // not anymore
+    } else {
+        debugPrintln(F("Could not find port mapping in IGD"));
+        if (*result == SOAP_RESULT_SUCCESS) {
+            *result = SOAP_RESULT_NO_SUCH_ENTRY;
+        }
+    }
+
+    return isSuccess;
+}
+
+boolean TinyUPnP::deletePortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
+    if (!applyAction(&SOAPActionDeletePortMapping, deviceInfo, rule_ptr)) {
+        return false;
+    }
+    
+    soapResponse response;
+    boolean isKeepAlive;
+    if (readHttpResponse(&response, &isKeepAlive) < 0) {
+        return false;
+    }
+    if (response.errorCode > 0) {
+        // the port mapping is not in the IGD anyway
+        return classifySoapError(response.errorCode) == SOAP_RESULT_NO_SUCH_ENTRY;
+    }
+    return response.isActionResponse;
+}
+
+// sends a SOAP action to the IGD, the action is applied on the port mapping of rule_ptr
+// if rule_ptr is NULL the action is sent without arguments (e.g. GetExternalIPAddress)
+boolean TinyUPnP::applyAction(SOAPAction *soapAction, gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
+    debugPrint(F("Apply action ["));
+    debugPrint(soapAction->name);
+    if (rule_ptr != NULL) {
+        debugPrint(F("] on port mapping ["));
+        debugPrint(rule_ptr->devFriendlyName);
+    }
+    debugPrintln(F("]"));
+
+    if (!isActionSupported(deviceInfo, soapAction)) {
+        debugPrintln(F("Action is not supported by the IGD, skipping"));
+        return false;
+    }
+
+    // waiting for the rate limit comes first, an idle connection might be closed by the IGD meanwhile
+    if (!acquireActionToken()) {
+        _client->stop();
+        return false;
+    }
+
+    // connect to IGD (TCP connection) again, if needed, in case we got disconnected after the previous query
+    UPnPDeadline connectDeadline = _deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS);
+    if (!_client->connected()) {
+        while (!connectToIGD(deviceInfo->host, deviceInfo->actionPort)) {
+            if (connectDeadline.isExpired()) {
+                debugPrintln(F("Timeout expired while trying to connect to the IGD"));
+                _client->stop();
+                return false;
             }
+            connectDeadline.sleep(500);
+        }
+    }
+
+    strcpy_P(_bodyTmp, PSTR("<?xml version=\"1.0\"?>\r\n<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n<s:Body>\r\n<u:"));
+    strcat_P(_bodyTmp, soapAction->name);
+    strcat_P(_bodyTmp, PSTR(" xmlns:u=\""));
+    strcat_P(_bodyTmp, deviceInfo->serviceTypeName.c_str());
+    strcat_P(_bodyTmp, PSTR("\">\r\n"));
+    if (rule_ptr != NULL) {
+        strcat_P(_bodyTmp, PSTR("<NewRemoteHost></NewRemoteHost>\r\n<NewExternalPort>"));
+        sprintf(_integerString, "%d", rule_ptr->externalPort);
+        strcat_P(_bodyTmp, _integerString);
+        strcat_P(_bodyTmp, PSTR("</NewExternalPort>\r\n<NewProtocol>"));
+        strcat_P(_bodyTmp, rule_ptr->protocol.c_str());
+        strcat_P(_bodyTmp, PSTR("</NewProtocol>\r\n"));
+    }
+    strcat_P(_bodyTmp, PSTR("</u:"));
+    strcat_P(_bodyTmp, soapAction->name);
+    strcat_P(_bodyTmp, PSTR(">\r\n</s:Body>\r\n</s:Envelope>\r\n"));
+
+    sprintf(_integerString, "%d", strlen(_bodyTmp));
+
+    _client->print(F("POST "));
+
+    _client->print(deviceInfo->actionPath);
+    _client->println(F(" HTTP/1.1"));
+    _client->println(F("Connection: close"));
+    _client->println(F("Content-Type: text/xml; charset=\"utf-8\""));
+    _client->print(F("Host: "));
+    _client->print(deviceInfo->host);
+    _client->print(':');
+    _client->println(deviceInfo->actionPort);
+    _client->print(F("SOAPAction: \""));
+    _client->print(deviceInfo->serviceTypeName);
+    _client->print(F("#"));
+    _client->print(soapAction->name);
+    _client->println(F("\""));
+    _client->print(F("Content-Length: "));
+    _client->println(_integerString);
+    _client->println();
+
+    _client->println(_bodyTmp);
+    _client->println();
+
+    debugPrintln(_bodyTmp);
+
+    if (!waitForResponse(_deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS))) {
+        debugPrintln(F("TCP connection timeout while applying action"));
+        _client->stop();
+        // TODO: in this case we might not want to add the ports right away
+        // might want to try again or only start adding the ports after we definitely
+        // did not see them in the router list
+        return false;
+    }
+    return true;
+}
+
+// deletes the port mappings of the rules, each is added again on the next commit
+// rules that were never mapped are skipped and removed rules are dropped once their port mapping is deleted
+void TinyUPnP::removeAllPortMappingsFromIGD() {
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        upnpRuleNode *next_ptr = currNode->next;
+        upnpRule *rule_ptr = currNode->upnpRule;
+        if (rule_ptr->isMapped && deletePortMapping(&_gwInfo, rule_ptr)) {
+            rule_ptr->isMapped = false;
+            if (rule_ptr->isRemoved) {
+                removeRuleNode(currNode);
+            }
+        }
+        currNode = next_ptr;
+    }
+    markAllRulesDirty();
+}
+
+// probes the gateway for the protocols allowed by setNatProtocol and sets _activeNatProtocol to the first one it answers
+// false if it answered none of them, UPnP IGD is assumed for a gateway that does not answer PCP
+boolean TinyUPnP::detectNatProtocol(IPAddress gatewayIP) {
+    if (_natProtocol == NAT_PROTOCOL_UPNP_IGD) {
+        _activeNatProtocol = NAT_PROTOCOL_UPNP_IGD;
+        return true;
+    }
+
+    // the nonce is what keeps other hosts from deleting or redirecting the mappings of this device (RFC 6887)
+    generatePcpNonce();
+
+    boolean isAnswered = false;
+    if (_natProtocol != NAT_PROTOCOL_NAT_PMP) {
+        _activeNatProtocol = NAT_PROTOCOL_PCP;
+        if (updatePcpEpoch(gatewayIP, &isAnswered)) {
+            debugPrintln(F("The gateway supports PCP"));
+            return true;
+        }
+    }
+    // a NAT-PMP server answers a PCP request with UNSUPP_VERSION, a gateway that did not answer at all will not answer NAT-PMP either
+    if (_natProtocol == NAT_PROTOCOL_NAT_PMP || (_natProtocol == NAT_PROTOCOL_AUTO && isAnswered)) {
+        _activeNatProtocol = NAT_PROTOCOL_NAT_PMP;
+        if (updatePcpEpoch(gatewayIP)) {
+            debugPrintln(F("The gateway supports NAT-PMP"));
+            return true;
+        }
+    }
+
+    if (_natProtocol == NAT_PROTOCOL_AUTO) {
+        debugPrintln(F("The gateway does not support PCP nor NAT-PMP, using UPnP IGD"));
+        _activeNatProtocol = NAT_PROTOCOL_UPNP_IGD;
+        return true;
+    }
+    _activeNatProtocol = NAT_PROTOCOL_AUTO;
+    return false;
+}
+
+// commitPortMappings for a gateway that supports PCP or NAT-PMP, a single datagram per changed rule
+portMappingResult TinyUPnP::commitPcpPortMappings() {
+    IPAddress gatewayIP = WiFi.gatewayIP();
+    int addedPortMappings = 0;
+    int assignedPort = 0;
+    _pcpUdpClient.begin(PCP_CLIENT_PORT);
+
+    // removed rules go first, the gateway identifies a mapping by its internal port so deleting the old values of an
+    // updated rule afterwards would delete its new mapping too
+    upnpRuleNode *currNode = _headRuleNode;
+    while (currNode != NULL) {
+        if (!currNode->upnpRule->isRemoved) {
+            currNode = currNode->next;
+            continue;
+        }
+        debugPrint(F("Delete port mapping for removed rule ["));
+        debugPrint(currNode->upnpRule->devFriendlyName);
+        debugPrintln(F("]"));
+        upnpRuleNode *del_ptr = currNode;
+        currNode = currNode->next;
+        if (requestPcpMapping(gatewayIP, del_ptr->upnpRule, true, &assignedPort) == SOAP_RESULT_NETWORK_ERROR) {
+            debugPrintln(F("Could not delete the port mapping, will try again on the next commit"));
             continue;
         }
-        if (line.indexOf(F("DeletePortMappingResponse")) >= 0) { 
-            isSuccess = true;
+        removeRuleNode(del_ptr);
+    }
+
+    for (currNode = _headRuleNode; currNode != NULL; currNode = currNode->next) {
+        upnpRule *rule_ptr = currNode->upnpRule;
+        if (rule_ptr->isRemoved || (!rule_ptr->isDirty && !isRuleLeaseCloseToExpiry(rule_ptr, _updateIntervalMs))) {
+            continue;
+        }
+        if (_deadline.isExpired()) {
+            debugPrintln(F("Timeout expired while trying to add a port mapping"));
+            _pcpUdpClient.stop();
+            return TIMEOUT;
+        }
+
+        soapActionResult result = requestPcpMapping(gatewayIP, rule_ptr, false, &assignedPort);
+        if (result == SOAP_RESULT_SUCCESS && assignedPort != rule_ptr->externalPort) {
+            // the gateway picks another external port by itself when the requested one is taken
+            debugPrint(F("The gateway assigned external port ["));
+            debugPrint(String(assignedPort));
+            debugPrintln(F("]"));
+            if (_conflictPolicy == CONFLICT_POLICY_NONE) {
+                int releasedPort;
+                requestPcpMapping(gatewayIP, rule_ptr, true, &releasedPort);
+                result = SOAP_RESULT_CONFLICT;
+            } else {
+                rule_ptr->externalPort = assignedPort;
+            }
+        }
+
+        switch (result) {
+            case SOAP_RESULT_SUCCESS:
+                break;
+            case SOAP_RESULT_NETWORK_ERROR:
+                _pcpUdpClient.stop();
+                return NETWORK_ERROR;
+            case SOAP_RESULT_CONFLICT:
+                _pcpUdpClient.stop();
+                return PORT_CONFLICT;
+            default:
+                _pcpUdpClient.stop();
+                return ACTION_REJECTED;
+        }
+
+        debugPrint(F("Port mapping ["));
+        debugPrint(rule_ptr->devFriendlyName);
+        debugPrintln(F("] was added"));
+        addedPortMappings++;
+        rule_ptr->isDirty = false;
+        rule_ptr->lastCommitTime = millis();
+        rule_ptr->isMapped = true;
+    }
+
+    _pcpUdpClient.stop();
+    _lastCommitTime = millis();
+    _lastCommitLocalIP = WiFi.localIP();
+    _gatewayCheckTime = _lastCommitTime;
+    return addedPortMappings > 0 ? SUCCESS : ALREADY_MAPPED;
+}
+
+// a PCP MAP or NAT-PMP mapping request for a single rule, isDelete releases the mapping (lifetime 0)
+// on success the lifetime granted by the gateway is kept in the rule and the external port it assigned is set in assignedPort
+soapActionResult TinyUPnP::requestPcpMapping(IPAddress gatewayIP, upnpRule *rule_ptr, boolean isDelete, int *assignedPort) {
+    boolean isTcp = rule_ptr->protocol.equalsIgnoreCase(RULE_PROTOCOL_TCP);
+    if (!isTcp && !rule_ptr->protocol.equalsIgnoreCase(RULE_PROTOCOL_UDP)) {
+        debugPrintln(F("ERROR: PCP and NAT-PMP only map TCP and UDP ports"));
+        return SOAP_RESULT_NOT_SUPPORTED;
+    }
+    uint32_t lifetime = 0;
+    if (!isDelete) {
+        lifetime = rule_ptr->leaseDuration > 0 ? rule_ptr->leaseDuration : PCP_DEFAULT_LIFETIME_S;
+    }
+    boolean isThirdParty = rule_ptr->internalAddr != ipNull && rule_ptr->internalAddr != WiFi.localIP();
+    uint8_t *request = (uint8_t *) _bodyTmp;
+    const uint8_t *response = (const uint8_t *) _responseBuffer;
+    int length;
+
+    if (_activeNatProtocol == NAT_PROTOCOL_NAT_PMP) {
+        if (isThirdParty) {
+            debugPrintln(F("ERROR: NAT-PMP cannot map ports to other hosts"));
+            return SOAP_RESULT_NOT_SUPPORTED;
+        }
+        memset(request, 0, NAT_PMP_MAP_REQUEST_SIZE);
+        request[0] = NAT_PMP_VERSION;
+        request[1] = isTcp ? NAT_PMP_OPCODE_MAP_TCP : NAT_PMP_OPCODE_MAP_UDP;
+        writeUint16(request + 4, rule_ptr->internalPort);
+        writeUint16(request + 6, isDelete ? 0 : rule_ptr->externalPort);
+        writeUint32(request + 8, lifetime);
+        length = exchangePcpDatagram(gatewayIP, NAT_PMP_MAP_REQUEST_SIZE, 4, 8, 2);  // matched on the internal port
+        if (length == 0) {
+            return SOAP_RESULT_NETWORK_ERROR;
+        }
+        if (response[0] != NAT_PMP_VERSION || length < NAT_PMP_HEADER_SIZE) {
+            return SOAP_RESULT_NOT_SUPPORTED;
+        }
+        _routerUptime = readUint32(response + 4);
+        _routerUptimeTime = millis();
+        int resultCode = readUint16(response + 2);
+        if (resultCode != 0 || length < NAT_PMP_MAP_RESPONSE_SIZE) {
+            debugPrint(F("NAT-PMP mapping failed with result code ["));
+            debugPrint(String(resultCode));
+            debugPrintln(F("]"));
+            return classifyPcpResult(resultCode, true);
+        }
+        *assignedPort = readUint16(response + 10);
+        rule_ptr->grantedLeaseDuration = readUint32(response + 12);
+        return SOAP_RESULT_SUCCESS;
+    }
+
+    length = buildPcpHeader(PCP_OPCODE_MAP, lifetime);
+    memset(request + length, 0, PCP_MAP_SIZE);
+    memcpy(request + length, _pcpNonce, PCP_NONCE_SIZE);
+    request[length + 12] = isTcp ? 6 : 17;  // IANA protocol number
+    writeUint16(request + length + 16, rule_ptr->internalPort);
+    writeUint16(request + length + 18, isDelete ? 0 : rule_ptr->externalPort);
+    writeIPv4MappedAddress(request + length + 20, ipNull);  // any external address
+    length += PCP_MAP_SIZE;
+    if (isThirdParty) {
+        request[length] = PCP_OPTION_THIRD_PARTY;
+        request[length + 1] = 0;
+        writeUint16(request + length + 2, 16);
+        writeIPv4MappedAddress(request + length + 4, rule_ptr->internalAddr);
+        length += 20;
+    }
+    // matched on the nonce, protocol and internal port
+    length = exchangePcpDatagram(gatewayIP, length, PCP_HEADER_SIZE, PCP_HEADER_SIZE, 18);
+    if (length == 0) {
+        return SOAP_RESULT_NETWORK_ERROR;
+    }
+    if (response[0] != PCP_VERSION || length < PCP_HEADER_SIZE + PCP_MAP_SIZE) {
+        return SOAP_RESULT_NOT_SUPPORTED;
+    }
+    _routerUptime = readUint32(response + 8);
+    _routerUptimeTime = millis();
+    if (response[3] != PCP_RESULT_SUCCESS) {
+        debugPrint(F("PCP MAP failed with result code ["));
+        debugPrint(String(response[3]));
+        debugPrintln(F("]"));
+        return classifyPcpResult(response[3], false);
+    }
+    *assignedPort = readUint16(response + PCP_HEADER_SIZE + 18);
+    rule_ptr->grantedLeaseDuration = readUint32(response + 4);
+    if (!isDelete) {
+        const uint8_t *externalIP = response + PCP_HEADER_SIZE + 32;  // the IPv4 part of the assigned external address
+        _externalIP = IPAddress(externalIP[0], externalIP[1], externalIP[2], externalIP[3]);
+    }
+    return SOAP_RESULT_SUCCESS;
+}
+
+// queries the epoch of the PCP server (ANNOUNCE) or NAT-PMP server (external address request, which also updates the external IP)
+// isAnswered is set if the server sent any response, e.g. UNSUPP_VERSION
+boolean TinyUPnP::updatePcpEpoch(IPAddress gatewayIP, boolean *isAnswered) {
+    uint8_t *request = (uint8_t *) _bodyTmp;
+    const uint8_t *response = (const uint8_t *) _responseBuffer;
+    _routerUptime = -1;
+    _pcpUdpClient.begin(PCP_CLIENT_PORT);
+
+    int length;
+    if (_activeNatProtocol == NAT_PROTOCOL_PCP) {
+        length = exchangePcpDatagram(gatewayIP, buildPcpHeader(PCP_OPCODE_ANNOUNCE, 0), 0, 0, 0);
+        if (length >= PCP_HEADER_SIZE && response[0] == PCP_VERSION && response[3] == PCP_RESULT_SUCCESS) {
+            _routerUptime = readUint32(response + 8);
+            _routerUptimeTime = millis();
+        }
+    } else {
+        request[0] = NAT_PMP_VERSION;
+        request[1] = NAT_PMP_OPCODE_EXTERNAL_ADDRESS;
+        length = exchangePcpDatagram(gatewayIP, 2, 0, 0, 0);
+        if (length >= NAT_PMP_EXTERNAL_ADDRESS_RESPONSE_SIZE && response[0] == NAT_PMP_VERSION && readUint16(response + 2) == 0) {
+            _routerUptime = readUint32(response + 4);
+            _routerUptimeTime = millis();
+            _externalIP = IPAddress(response[8], response[9], response[10], response[11]);
         }
     }
 
-    return isSuccess;
+    _pcpUdpClient.stop();
+    if (isAnswered != NULL) {
+        *isAnswered = length > 0;
+    }
+    return _routerUptime >= 0;
 }
 
-boolean TinyUPnP::applyActionOnSpecificPortMapping(SOAPAction *soapAction, gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-    debugPrint(F("Apply action ["));
-    debugPrint(soapAction->name);
-    debugPrint(F("] on port mapping ["));
-    debugPrint(rule_ptr->devFriendlyName);
-    debugPrintln(F("]"));
+// the common header of PCP requests, written to _bodyTmp, returns its length
+int TinyUPnP::buildPcpHeader(uint8_t opcode, uint32_t lifetime) {
+    uint8_t *request = (uint8_t *) _bodyTmp;
+    memset(request, 0, PCP_HEADER_SIZE);
+    request[0] = PCP_VERSION;
+    request[1] = opcode;
+    writeUint32(request + 4, lifetime);
+    writeIPv4MappedAddress(request + 8, WiFi.localIP());
+    return PCP_HEADER_SIZE;
+}
 
-    // connect to IGD (TCP connection) again, if needed, in case we got disconnected after the previous query
-    unsigned long timeout = millis() + TCP_CONNECTION_TIMEOUT_MS;
-    if (!_wifiClient.connected()) {
-        while (!connectToIGD(deviceInfo->host, deviceInfo->actionPort)) {
-            if (millis() > timeout) {
-                debugPrintln(F("Timeout expired while trying to connect to the IGD"));
-                _wifiClient.stop();
-                return false;
+// sends the request in _bodyTmp to the PCP / NAT-PMP server of the gateway and waits for the response in _responseBuffer,
+// retransmitting with a doubling timeout (RFC 6887 section 8.1.1), returns the length of the response or 0 if there was none
+// a response of another version (UNSUPP_VERSION) is returned as is, otherwise it must match the opcode and the match bytes
+int TinyUPnP::exchangePcpDatagram(IPAddress gatewayIP, int requestLength, int requestMatchOffset, int responseMatchOffset, int matchLength) {
+    const uint8_t *request = (const uint8_t *) _bodyTmp;
+    uint8_t *response = (uint8_t *) _responseBuffer;
+    unsigned long timeoutMs = PCP_INITIAL_TIMEOUT_MS;
+    for (int attempt = 0; attempt < PCP_MAX_ATTEMPTS && !_deadline.isExpired(); attempt++, timeoutMs *= 2) {
+        _pcpUdpClient.beginPacket(gatewayIP, PCP_SERVER_PORT);
+        _pcpUdpClient.write(request, requestLength);
+        _pcpUdpClient.endPacket();
+
+        UPnPDeadline attemptDeadline = _deadline.getPhaseDeadline(timeoutMs);
+        while (!attemptDeadline.isExpired()) {
+            if (_pcpUdpClient.parsePacket() <= 0) {
+                delay(1);
+                continue;
             }
-            delay(500);
-        }
-    }
-
-    strcpy_P(body_tmp, PSTR("<?xml version=\"1.0\"?>\r\n<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n<s:Body>\r\n<u:"));
-    strcat_P(body_tmp, soapAction->name);
-    strcat_P(body_tmp, PSTR(" xmlns:u=\""));
-    strcat_P(body_tmp, deviceInfo->serviceTypeName.c_str());
-    strcat_P(body_tmp, PSTR("\">\r\n<NewRemoteHost></NewRemoteHost>\r\n<NewExternalPort>"));
-    sprintf(integer_string, "%d", rule_ptr->externalPort);
-    strcat_P(body_tmp, integer_string);
-    strcat_P(body_tmp, PSTR("</NewExternalPort>\r\n<NewProtocol>"));
-    strcat_P(body_tmp, rule_ptr->protocol.c_str());
-    strcat_P(body_tmp, PSTR("</NewProtocol>\r\n</u:"));
-    strcat_P(body_tmp, soapAction->name);
-    strcat_P(body_tmp, PSTR(">\r\n</s:Body>\r\n</s:Envelope>\r\n"));
-
-    sprintf(integer_string, "%d", strlen(body_tmp));
-
-    _wifiClient.print(F("POST "));
-
-    _wifiClient.print(deviceInfo->actionPath);
-    _wifiClient.println(F(" HTTP/1.1"));
-    _wifiClient.println(F("Connection: close"));
-    _wifiClient.println(F("Content-Type: text/xml; charset=\"utf-8\""));
-    _wifiClient.println("Host: " + deviceInfo->host.toString() + ":" + String(deviceInfo->actionPort));
-    _wifiClient.print(F("SOAPAction: \""));
-    _wifiClient.print(deviceInfo->serviceTypeName);
-    _wifiClient.print(F("#"));
-    _wifiClient.print(soapAction->name);
-    _wifiClient.println(F("\""));
-    _wifiClient.print(F("Content-Length: "));
-    _wifiClient.println(integer_string);
-    _wifiClient.println();
-
-    _wifiClient.println(body_tmp);
-    _wifiClient.println();
-
-    debugPrintln(body_tmp);
-
-    timeout = millis() + TCP_CONNECTION_TIMEOUT_MS;
-    while (_wifiClient.available() == 0) {
-        if (millis() > timeout) {
-            debugPrintln(F("TCP connection timeout while retrieving port mappings"));
-            _wifiClient.stop();
-            // TODO: in this case we might not want to add the ports right away
-            // might want to try again or only start adding the ports after we definitely
-            // did not see them in the router list
-            return false;
+            int length = _pcpUdpClient.read(response, UPNP_UDP_TX_RESPONSE_MAX_SIZE);
+            if (_pcpUdpClient.remoteIP() != gatewayIP || _pcpUdpClient.remotePort() != PCP_SERVER_PORT || length < 4) {
+                continue;
+            }
+            if (response[0] != request[0]) {
+                return length;
+            }
+            // responses to earlier requests are discarded
+            if (response[1] != (request[1] | 0x80) || length < responseMatchOffset + matchLength
+                || memcmp(response + responseMatchOffset, request + requestMatchOffset, matchLength) != 0) {
+                continue;
+            }
+            return length;
         }
     }
-    return true;
+    debugPrintln(F("No response from the PCP / NAT-PMP server of the gateway"));
+    return 0;
 }
 
-void TinyUPnP::removeAllPortMappingsFromIGD() {
-    upnpRuleNode *currNode = _headRuleNode;
-    while (currNode != NULL) {
-        deletePortMapping(&_gwInfo, currNode->upnpRule);
-        currNode = currNode->next;
+// PCP and NAT-PMP result codes are classified like the UPnP error codes so that commits share the retry policy
+soapActionResult TinyUPnP::classifyPcpResult(int resultCode, boolean isNatPmp) {
+    if (isNatPmp) {
+        switch (resultCode) {
+            case NAT_PMP_RESULT_NOT_AUTHORIZED:
+                return SOAP_RESULT_NOT_AUTHORIZED;
+            case NAT_PMP_RESULT_NETWORK_FAILURE:
+            case NAT_PMP_RESULT_OUT_OF_RESOURCES:
+                return SOAP_RESULT_NETWORK_ERROR;  // transient, e.g. the gateway has no external IP yet
+            case NAT_PMP_RESULT_UNSUPPORTED_VERSION:
+            case NAT_PMP_RESULT_UNSUPPORTED_OPCODE:
+                return SOAP_RESULT_NOT_SUPPORTED;
+            default:
+                return SOAP_RESULT_FAILED;
+        }
+    }
+    switch (resultCode) {
+        case PCP_RESULT_NOT_AUTHORIZED:
+            return SOAP_RESULT_NOT_AUTHORIZED;
+        case PCP_RESULT_NETWORK_FAILURE:
+        case PCP_RESULT_NO_RESOURCES:
+            return SOAP_RESULT_NETWORK_ERROR;
+        case PCP_RESULT_UNSUPP_VERSION:
+        case PCP_RESULT_UNSUPP_OPCODE:
+        case PCP_RESULT_UNSUPP_OPTION:
+        case PCP_RESULT_UNSUPP_PROTOCOL:
+            return SOAP_RESULT_NOT_SUPPORTED;
+        case PCP_RESULT_CANNOT_PROVIDE_EXTERNAL:
+            return SOAP_RESULT_CONFLICT;
+        default:
+            return SOAP_RESULT_FAILED;
     }
 }
 
 // a single try to connect UDP multicast address and port of UPnP (239.255.255.250 and 1900 respectively)
 // this will enable receiving SSDP packets after the M-SEARCH multicast message will be broadcasted
-boolean TinyUPnP::connectUDP() {
+// listenForAnnouncements binds the local SSDP port too so that NOTIFY messages are received (already the case on ESP32)
+boolean TinyUPnP::connectUDP(boolean listenForAnnouncements) {
+    _ssdpListening = false;
 #if defined(ESP8266)
-    if (_udpClient.beginMulticast(WiFi.localIP(), ipMulti, 0)) {
+    if (_udpClient.beginMulticast(WiFi.localIP(), ipMulti, listenForAnnouncements ? UPNP_SSDP_PORT : 0)) {
+        _ssdpListening = listenForAnnouncements;
         return true;
     }
 #else
     if (_udpClient.beginMulticast(ipMulti, UPNP_SSDP_PORT)) {
+        _ssdpListening = listenForAnnouncements;
         return true;
     }
 #endif
@@ -539,7 +1954,7 @@ boolean TinyUPnP::connectUDP() {
 // broadcast an M-SEARCH message to initiate messages from SSDP devices
 // the router should respond to this message by a packet sent to this device's unicast addresss on the
 // same UPnP port (1900)
-void TinyUPnP::broadcastMSearch(bool isSsdpAll /*=false*/) {
+void TinyUPnP::broadcastMSearch(const char * const * deviceList) {
     debugPrint(F("Sending M-SEARCH to ["));
     debugPrint(ipMulti.toString());
     debugPrint(F("] Port ["));
@@ -555,35 +1970,19 @@ void TinyUPnP::broadcastMSearch(bool isSsdpAll /*=false*/) {
     debugPrintln(F("]"));
 #endif
 
-    const char * const * deviceList = deviceListUpnp;
-    if (isSsdpAll) {
-        deviceList = deviceListSsdpAll;
-    }
-
     for (int i = 0; deviceList[i]; i++) {
-        strcpy_P(body_tmp, PSTR("M-SEARCH * HTTP/1.1\r\n"));
-        strcat_P(body_tmp, PSTR("HOST: 239.255.255.250:"));
-        sprintf(integer_string, "%d", UPNP_SSDP_PORT);
-        strcat_P(body_tmp, integer_string);
-        strcat_P(body_tmp, PSTR("\r\n"));
-        strcat_P(body_tmp, PSTR("MAN: \"ssdp:discover\"\r\n"));
-        strcat_P(body_tmp, PSTR("MX: 2\r\n"));  // allowed number of seconds to wait before replying to this M_SEARCH
-        strcat_P(body_tmp, PSTR("ST: "));
-        strcat_P(body_tmp, deviceList[i]);
-        strcat_P(body_tmp, PSTR("\r\n"));
-        strcat_P(body_tmp, PSTR("USER-AGENT: unix/5.1 UPnP/2.0 TinyUPnP/1.0\r\n"));
-        strcat_P(body_tmp, PSTR("\r\n"));
-
-        debugPrintln(body_tmp);
-        size_t len = strlen(body_tmp);
+        buildMSearch(ipMulti, deviceList[i]);
+
+        debugPrintln(_bodyTmp);
+        size_t len = strlen(_bodyTmp);
         debugPrint(F("M-SEARCH packet length is ["));
         debugPrint(String(len));
         debugPrintln(F("]"));
 
 #if defined(ESP8266)
-        _udpClient.write(body_tmp);
+        _udpClient.write(_bodyTmp);
 #else
-        _udpClient.print(body_tmp);
+        _udpClient.print(_bodyTmp);
 #endif
     
         int endPacketRes = _udpClient.endPacket();
@@ -595,96 +1994,627 @@ void TinyUPnP::broadcastMSearch(bool isSsdpAll /*=false*/) {
     debugPrintln(F("M-SEARCH packets sent"));
 }
 
+// send an M-SEARCH message directly to the SSDP port of the gateway, a compliant IGD answers it immediately
+// (there is no MX delay for unicast searches) and the response arrives on the same UDP socket
+void TinyUPnP::unicastMSearch(IPAddress gatewayIP, const char * const * deviceList) {
+    debugPrint(F("Sending unicast M-SEARCH to ["));
+    debugPrint(gatewayIP.toString());
+    debugPrintln(F("]"));
+
+    for (int i = 0; deviceList[i]; i++) {
+        buildMSearch(gatewayIP, deviceList[i]);
+        _udpClient.beginPacket(gatewayIP, UPNP_SSDP_PORT);
+#if defined(ESP8266)
+        _udpClient.write(_bodyTmp);
+#else
+        _udpClient.print(_bodyTmp);
+#endif
+        if (!_udpClient.endPacket()) {
+            debugPrintln(F("ERROR: could not send unicast M-SEARCH"));
+            return;
+        }
+    }
+}
+
+// builds an M-SEARCH message for searchTarget in _bodyTmp, MX is only sent for multicast searches
+void TinyUPnP::buildMSearch(IPAddress destination, const char *searchTarget) {
+    strcpy_P(_bodyTmp, PSTR("M-SEARCH * HTTP/1.1\r\n"));
+    strcat_P(_bodyTmp, PSTR("HOST: "));
+    sprintf(_integerString, "%d.%d.%d.%d", destination[0], destination[1], destination[2], destination[3]);
+    strcat(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR(":"));
+    sprintf(_integerString, "%d", UPNP_SSDP_PORT);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("\r\n"));
+    strcat_P(_bodyTmp, PSTR("MAN: \"ssdp:discover\"\r\n"));
+    if (destination == ipMulti) {
+        strcat_P(_bodyTmp, PSTR("MX: 2\r\n"));  // allowed number of seconds to wait before replying to this M_SEARCH
+    }
+    strcat_P(_bodyTmp, PSTR("ST: "));
+    strcat_P(_bodyTmp, searchTarget);
+    strcat_P(_bodyTmp, PSTR("\r\n"));
+    strcat_P(_bodyTmp, PSTR("USER-AGENT: unix/5.1 UPnP/2.0 TinyUPnP/1.0\r\n"));
+    strcat_P(_bodyTmp, PSTR("\r\n"));
+}
+
+// the returned list is the SSDP device cache, it is owned by TinyUPnP and must not be freed
+// a new M-SEARCH is only sent if the cache is empty or if a device did not refresh its announcement in time
 ssdpDeviceNode* TinyUPnP::listSsdpDevices() {
+    OperationScope operation(this);
+    removeExpiredSsdpDevices();
+    if (_ssdpDeviceCache != NULL && !isSsdpDeviceCacheStale()) {
+        debugPrintln(F("SSDP device cache is up to date"));
+        return _ssdpDeviceCache;
+    }
+
     if (_timeoutMs <= 0) {
         debugPrintln("Timeout must be set when initializing TinyUPnP to use this method, exiting.");
-        return NULL;
+        return _ssdpDeviceCache;
     }
 
-    unsigned long startTime = millis();
     while (!connectUDP()) {
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
+        if (_deadline.isExpired()) {
             debugPrint(F("Timeout expired while connecting UDP"));
             _udpClient.stop();
-            return NULL;
+            return _ssdpDeviceCache;
         }
-        delay(500);
+        _deadline.sleep(500);
         debugPrint(".");
     }
     debugPrintln("");  // \n
     
-    broadcastMSearch(true);
-    IPAddress gatewayIP = WiFi.gatewayIP();
-
-    debugPrint(F("Gateway IP ["));
-    debugPrint(gatewayIP.toString());
-    debugPrintln(F("]"));
+    broadcastMSearch(deviceListSsdpAll);
 
-    ssdpDeviceNode *ssdpDeviceNode_head = NULL;
-    ssdpDeviceNode *ssdpDeviceNode_tail = NULL;
-    ssdpDeviceNode *ssdpDeviceNode_ptr = NULL;
-    ssdpDevice *ssdpDevice_ptr = NULL;
+    ssdpResponse response;
     while (true) {
-        ssdpDevice_ptr = waitForUnicastResponseToMSearch(ipNull);  // NULL will cause finding all SSDP device (not just the IGD)
-        if (_timeoutMs > 0 && (millis() - startTime > _timeoutMs)) {
-            debugPrintln(F("Timeout expired while waiting for the gateway router to respond to M-SEARCH message"));
+        // responses are added to the cache as they arrive
+        if (receiveSsdpResponse(ipNull, &response)) {  // ipNull will cause finding all SSDP device (not just the IGD)
+            updateSsdpDeviceCache(&response);
+        }
+        if (_deadline.isExpired()) {
+            debugPrintln(F("Timeout expired while waiting for SSDP devices to respond to M-SEARCH message"));
+            break;
+        }
+        _deadline.sleep(5);
+    }
+
+    // close the UDP connection
+    _udpClient.stop();
+
+    return _ssdpDeviceCache;
+}
+
+// non blocking, handles the SSDP announcements (NOTIFY) and responses received since the last call
+// call this from the loop to keep the SSDP device cache up to date without sending M-SEARCH messages
+void TinyUPnP::processSsdpAnnouncements() {
+    if (!_ssdpListening && !connectUDP(true)) {
+        return;
+    }
+    ssdpResponse response;
+    for (int i = 0; i < MAX_SSDP_PACKETS_PER_POLL; i++) {
+        if (receiveSsdpResponse(ipNull, &response)) {
+            updateSsdpDeviceCache(&response);
+        }
+    }
+    removeExpiredSsdpDevices();
+    if (_isFleetEnabled && millis() - _fleetAnnounceTime >= _fleetAnnounceDelayMs) {
+        announceToFleet();
+    }
+}
+
+// an announcement (or a search) of another member of the fleet, the leader is the member with the lowest local IP
+void TinyUPnP::processFleetMessage(ssdpResponse *response, IPAddress remoteIP) {
+    IPAddress localIP = WiFi.localIP();
+    if (remoteIP == localIP) {
+        return;  // multicast loopback of this device
+    }
+    if (response->isSearch) {
+        // a new member, the members answer within a random delay rather than all at once
+        _fleetAnnounceTime = millis();
+        _fleetAnnounceDelayMs = random(FLEET_SEARCH_RESPONSE_MAX_MS);
+        return;
+    }
+
+    boolean isLeader = !isFleetLeader() && remoteIP == _fleetLeaderIP;
+    if (response->nts != NULL && response->ntsLength == 11 && strncmp(response->nts, "ssdp:byebye", 11) == 0) {
+        if (isLeader) {
+            debugPrintln(F("The fleet leader left"));
+            _fleetLeaderIP = ipNull;
+            _hasFleetLeaderState = false;
+        }
+        return;
+    }
+    if (!isLeader) {
+        if (!isIPAddressLower(remoteIP, localIP) || (!isFleetLeader() && !isIPAddressLower(remoteIP, _fleetLeaderIP))) {
+            return;  // a follower
+        }
+        debugPrint(F("New fleet leader ["));
+        debugPrint(remoteIP.toString());
+        debugPrintln(F("]"));
+        _fleetLeaderIP = remoteIP;
+        _hasFleetLeaderState = false;
+    }
+    _fleetLeaderSeenTime = millis();
+
+    long uptime;
+    unsigned long ageMs;
+    IPAddress externalIP;
+    if (response->fleetState != NULL && parseFleetState(response->fleetState, response->fleetStateLength, &uptime, &ageMs, &externalIP)) {
+        _hasFleetLeaderState = true;
+        _isFleetStateDisputed = false;  // compared again on the next update
+        _fleetLeaderUptime = uptime;
+        _fleetLeaderExternalIP = externalIP;
+        _fleetLeaderCheckTime = millis() - ageMs;
+    }
+}
+
+// multicasts a NOTIFY for the fleet, the leader adds the state of the IGD as it last checked it
+// e.g. "X-TINYUPNP-FLEET: <uptime at the check or -1> <ms since the check> <external IP>"
+void TinyUPnP::announceToFleet(boolean isAlive) {
+    _fleetAnnounceTime = millis();
+    _fleetAnnounceDelayMs = FLEET_ANNOUNCE_INTERVAL_MS - random(FLEET_ANNOUNCE_INTERVAL_MS / 4);
+    if (!_ssdpListening && !connectUDP(true)) {
+        return;
+    }
+
+    strcpy_P(_bodyTmp, PSTR("NOTIFY * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nCACHE-CONTROL: max-age="));
+    sprintf(_integerString, "%lu", (unsigned long) FLEET_MEMBER_TIMEOUT_MS / 1000);
+    strcat(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("\r\nNT: "));
+    strcat(_bodyTmp, deviceListFleet[0]);
+    strcat_P(_bodyTmp, isAlive ? PSTR("\r\nNTS: ssdp:alive\r\nUSN: uuid:") : PSTR("\r\nNTS: ssdp:byebye\r\nUSN: uuid:"));
+    String mac = WiFi.macAddress();
+    mac.replace(":", "");
+    strcat(_bodyTmp, mac.c_str());
+    strcat_P(_bodyTmp, PSTR("::"));
+    strcat(_bodyTmp, deviceListFleet[0]);
+    strcat_P(_bodyTmp, PSTR("\r\n"));
+    if (isAlive && isFleetLeader() && _gatewayCheckTime != 0 && _externalIP != ipNull) {
+        long uptime = _routerUptime >= 0 ? _routerUptime + (long) (_gatewayCheckTime - _routerUptimeTime) / 1000 : -1;
+        sprintf(_integerString, "%ld %lu ", uptime, millis() - _gatewayCheckTime);
+        strcat_P(_bodyTmp, PSTR("X-TINYUPNP-FLEET: "));
+        strcat(_bodyTmp, _integerString);
+        strcat(_bodyTmp, _externalIP.toString().c_str());
+        strcat_P(_bodyTmp, PSTR("\r\n"));
+    }
+    strcat_P(_bodyTmp, PSTR("\r\n"));
+
+#if defined(ESP8266)
+    _udpClient.beginPacketMulticast(ipMulti, UPNP_SSDP_PORT, WiFi.localIP());
+    _udpClient.write(_bodyTmp);
+#else
+    _udpClient.beginMulticastPacket();
+    _udpClient.print(_bodyTmp);
+#endif
+    if (!_udpClient.endPacket()) {
+        debugPrintln(F("ERROR: could not send the fleet announcement"));
+    }
+}
+
+// streams the devices that respond to an M-SEARCH for searchTarget, without waiting for the timeout to expire
+// callback is called once for each unique device as soon as its response is parsed and may return false to stop the discovery
+// the discovery also stops once maxDevices were found (0 for no limit) or the timeout expired
+// the devices are added to the SSDP device cache, returns the number of devices found
+int TinyUPnP::discoverSsdpDevices(ssdp_device_callback callback, void *arg, int maxDevices, const char *searchTarget) {
+    if (callback == NULL) {
+        return 0;
+    }
+    if (_timeoutMs <= 0 && maxDevices <= 0) {
+        debugPrintln(F("Either a timeout or maxDevices must be set to use this method, exiting."));
+        return 0;  // the discovery would never end
+    }
+
+    OperationScope operation(this);
+    unsigned long startTime = millis();
+    while (!connectUDP()) {
+        if (_deadline.isExpired()) {
+            debugPrint(F("Timeout expired while connecting UDP"));
             _udpClient.stop();
-            delete ssdpDevice_ptr;
+            return 0;
+        }
+        _deadline.sleep(500);
+        debugPrint(".");
+    }
+    debugPrintln("");  // \n
+
+    const char * const searchTargetList[] = {searchTarget, 0};
+    broadcastMSearch(searchTargetList);
+    boolean isSsdpAll = strcmp(searchTarget, deviceListSsdpAll[0]) == 0;
+
+    int numOfDevices = 0;
+    ssdpResponse response;
+    while (maxDevices <= 0 || numOfDevices < maxDevices) {
+        if (_deadline.isExpired()) {
+            debugPrintln(F("Timeout expired while waiting for SSDP devices to respond to M-SEARCH message"));
             break;
         }
 
-        //ssdpDeviceToString(ssdpDevice_ptr);
-        
-        if (ssdpDevice_ptr != NULL) {
-            if (ssdpDeviceNode_head == NULL) {
-                ssdpDeviceNode_head = new ssdpDeviceNode();
-                ssdpDeviceNode_head->ssdpDevice = ssdpDevice_ptr;
-                ssdpDeviceNode_head->next = NULL;
-                ssdpDeviceNode_tail = ssdpDeviceNode_head;
+        if (!receiveSsdpResponse(ipNull, &response)) {
+            _deadline.sleep(5);
+            continue;
+        }
+
+        // announcements of other services may arrive too
+        boolean isMatch = isSsdpAll || (response.st != NULL
+            && response.stLength == (int) strlen(searchTarget) && strncmp(response.st, searchTarget, response.stLength) == 0);
+        boolean isNew = false;
+        ssdpDevice *device_ptr = updateSsdpDeviceCache(&response, startTime, &isNew);
+        if (!isMatch || device_ptr == NULL || !isNew) {
+            continue;
+        }
+
+        numOfDevices++;
+        if (!callback(device_ptr, arg)) {
+            debugPrintln(F("SSDP discovery stopped by the callback"));
+            break;
+        }
+    }
+
+    _udpClient.stop();
+    return numOfDevices;
+}
+
+// fetches the description XML of all the devices in the list, several at a time, and fills the device fields from it
+// the fetches are made in batches on the stack, so a list of any length takes nothing from the allocator
+// returns the number of devices whose description was fetched
+int TinyUPnP::enrichSsdpDevices(ssdpDeviceNode* ssdpDeviceNode_head, int maxConcurrent) {
+    OperationScope operation(this);
+
+    // the root device is described first, so the first occurrence of each tag is the one of the root device
+    auto onLine = [] (descriptionFetch *fetch, const String &line, void * /* arg */) -> boolean {
+        ssdpDevice *device_ptr = (ssdpDevice *) fetch->context;
+        if (device_ptr->deviceType.length() == 0 && line.indexOf(F("<deviceType>")) >= 0) {
+            device_ptr->deviceType = getTagContent(line, PSTR("deviceType"));
+        }
+        if (device_ptr->friendlyName.length() == 0 && line.indexOf(F("<friendlyName>")) >= 0) {
+            device_ptr->friendlyName = getTagContent(line, PSTR("friendlyName"));
+        }
+        if (device_ptr->manufacturer.length() == 0 && line.indexOf(F("<manufacturer>")) >= 0) {
+            device_ptr->manufacturer = getTagContent(line, PSTR("manufacturer"));
+        }
+        if (device_ptr->modelName.length() == 0 && line.indexOf(F("<modelName>")) >= 0) {
+            device_ptr->modelName = getTagContent(line, PSTR("modelName"));
+        }
+        return device_ptr->deviceType.length() == 0 || device_ptr->friendlyName.length() == 0
+            || device_ptr->manufacturer.length() == 0 || device_ptr->modelName.length() == 0;
+    };
+
+    descriptionFetch fetches[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    int numOfFetched = 0;
+    ssdpDeviceNode *curr_ptr = ssdpDeviceNode_head;
+    while (curr_ptr != NULL && !_deadline.isExpired()) {
+        int count = 0;
+        for (; count < MAX_CONCURRENT_DESCRIPTION_FETCHES && curr_ptr != NULL; count++, curr_ptr = curr_ptr->next) {
+            fetches[count].host = curr_ptr->ssdpDevice->host;
+            fetches[count].port = curr_ptr->ssdpDevice->port;
+            fetches[count].path = curr_ptr->ssdpDevice->path;
+            fetches[count].context = curr_ptr->ssdpDevice;
+        }
+        numOfFetched += fetchDescriptions(fetches, count, onLine, NULL, maxConcurrent);
+    }
+    return numOfFetched;
+}
+
+// issues the HTTP GET requests of fetches with up to maxConcurrent connections open at once and passes each
+// line of the responses to onLine, so the total time is close to the one of the slowest fetch rather than the sum
+// returns the number of fetches that received a successful HTTP response
+int TinyUPnP::fetchDescriptions(descriptionFetch *fetches, int count, description_line_callback onLine, void *arg, int maxConcurrent) {
+    if (maxConcurrent > MAX_CONCURRENT_DESCRIPTION_FETCHES) {
+        maxConcurrent = MAX_CONCURRENT_DESCRIPTION_FETCHES;
+    }
+    if (maxConcurrent < 1) {
+        maxConcurrent = 1;
+    }
+
+    // the first connection is the transport of the instance, so that an injected client (e.g. UPnPReplayClient) sees
+    // every fetch, more connections are only opened alongside the default WiFiClient
+    WiFiClient wifiClients[MAX_CONCURRENT_DESCRIPTION_FETCHES - 1];
+    Client *clients[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    clients[0] = _client;
+    for (int slot = 1; slot < MAX_CONCURRENT_DESCRIPTION_FETCHES; slot++) {
+        clients[slot] = &wifiClients[slot - 1];
+    }
+    if (_client != &_wifiClient) {
+        maxConcurrent = 1;
+    }
+    _client->stop();
+    String lines[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    unsigned int lineCapacities[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    int fetchIndexes[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    int lineCounts[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    UPnPDeadline fetchDeadlines[MAX_CONCURRENT_DESCRIPTION_FETCHES];
+    for (int slot = 0; slot < maxConcurrent; slot++) {
+        fetchIndexes[slot] = -1;
+        // the lines are read a character at a time, they grow by doubling (e.g. an XML without line breaks)
+        lineCapacities[slot] = XML_LINE_RESERVE_SIZE;
+        lines[slot].reserve(lineCapacities[slot]);
+    }
+
+    int nextFetch = 0;
+    int numOfSucceeded = 0;
+    while (true) {
+        boolean isActive = false;
+        boolean isProgress = false;
+        for (int slot = 0; slot < maxConcurrent; slot++) {
+            // start the next fetch on a free connection
+            while (fetchIndexes[slot] == -1 && nextFetch < count && !_deadline.isExpired()) {
+                descriptionFetch *fetch = &fetches[nextFetch++];
+                debugPrint(F("Fetching description from ["));
+                debugPrint(fetch->host.toString());
+                debugPrint(F(":"));
+                debugPrint(String(fetch->port));
+                debugPrint(fetch->path);
+                debugPrintln(F("]"));
+                if (!clients[slot]->connect(fetch->host, fetch->port)) {
+                    debugPrintln(F("Could not connect to the device"));
+                    continue;
+                }
+                clients[slot]->print(F("GET "));
+                clients[slot]->print(fetch->path);
+                clients[slot]->println(F(" HTTP/1.1"));
+                clients[slot]->print(F("Host: "));
+                clients[slot]->print(fetch->host);
+                clients[slot]->print(':');
+                clients[slot]->println(fetch->port);
+                clients[slot]->println(F("Connection: close"));
+                clients[slot]->println();
+                fetchIndexes[slot] = fetch - fetches;
+                lineCounts[slot] = 0;
+                lines[slot] = "";
+                fetchDeadlines[slot] = _deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS);
+            }
+
+            if (fetchIndexes[slot] == -1) {
+                continue;
+            }
+            isActive = true;
+
+            // consume what is available without blocking on partial lines
+            boolean isDone = false;
+            while (!isDone && clients[slot]->available()) {
+                isProgress = true;
+                char c = clients[slot]->read();
+                if (c != '\n') {
+                    if (c != '\r') {
+                        if (lines[slot].length() == lineCapacities[slot]) {
+                            lineCapacities[slot] *= 2;
+                            lines[slot].reserve(lineCapacities[slot]);
+                        }
+                        lines[slot] += c;
+                    }
+                    continue;
+                }
+                if (lineCounts[slot]++ == 0) {
+                    // status line, e.g. "HTTP/1.1 200 OK"
+                    if (lines[slot].indexOf(F(" 200")) < 0) {
+                        debugPrint(F("Description fetch failed ["));
+                        debugPrint(lines[slot]);
+                        debugPrintln(F("]"));
+                        isDone = true;
+                        break;
+                    }
+                    numOfSucceeded++;
+                } else if (!onLine(&fetches[fetchIndexes[slot]], lines[slot], arg)) {
+                    isDone = true;
+                }
+                lines[slot] = "";
+            }
+
+            if (!isDone && !clients[slot]->connected() && !clients[slot]->available()) {
+                // the last line might not be terminated
+                if (lineCounts[slot] > 0 && lines[slot].length() > 0) {
+                    onLine(&fetches[fetchIndexes[slot]], lines[slot], arg);
+                }
+                isDone = true;
+            }
+            if (!isDone && fetchDeadlines[slot].isExpired()) {
+                debugPrintln(F("TCP connection timeout while fetching description"));
+                isDone = true;
+            }
+            if (isDone) {
+                clients[slot]->stop();
+                fetchIndexes[slot] = -1;
+                lines[slot] = "";
+                isProgress = true;
+            }
+        }
+
+        if (!isActive && (nextFetch >= count || _deadline.isExpired())) {
+            break;
+        }
+        if (!isProgress) {
+            delay(1);
+        }
+    }
+
+    return numOfSucceeded;
+}
+
+// devices are keyed by the UUID part of their USN (e.g. "uuid:<device-UUID>" out of "uuid:<device-UUID>::upnp:rootdevice")
+// so the several responses of a single device for each of its services are kept as a single entry
+// devices which do not send a USN are keyed by their location
+// isNew (optional) is set if the device was not seen since sinceTime
+ssdpDevice* TinyUPnP::updateSsdpDeviceCache(ssdpResponse *response, unsigned long sinceTime, boolean *isNew) {
+    int usnLength = response->usnLength;
+    for (int i = 0; response->usn != NULL && i + 1 < response->usnLength; i++) {
+        if (response->usn[i] == ':' && response->usn[i + 1] == ':') {
+            usnLength = i;
+            break;
+        }
+    }
+    String usn = urlPartToString(response->usn, usnLength);
+
+    urlParts location;
+    boolean hasLocation = response->location != NULL
+        && parseUrl(response->location, response->locationLength, &location)
+        && location.hostLength > 0;
+    IPAddress host;
+    String path;
+    if (hasLocation) {
+        parseIPAddress(location.host, location.hostLength, &host);
+        path = urlPartToString(location.path, location.pathLength);
+    }
+
+    ssdpDeviceNode *prev_ptr = NULL;
+    ssdpDeviceNode *curr_ptr = _ssdpDeviceCache;
+    while (curr_ptr != NULL) {
+        ssdpDevice *device_ptr = curr_ptr->ssdpDevice;
+        if (usn.length() > 0 ? device_ptr->usn == usn
+            : (hasLocation && device_ptr->host == host && device_ptr->port == location.port && device_ptr->path == path)) {
+            break;
+        }
+        prev_ptr = curr_ptr;
+        curr_ptr = curr_ptr->next;
+    }
+
+    if (response->isNotify && response->nts != NULL && response->ntsLength == 11 && strncmp(response->nts, "ssdp:byebye", 11) == 0) {
+        if (curr_ptr != NULL) {
+            debugPrint(F("SSDP device left ["));
+            debugPrint(usn);
+            debugPrintln(F("]"));
+            if (prev_ptr == NULL) {
+                _ssdpDeviceCache = curr_ptr->next;
             } else {
-                ssdpDeviceNode_ptr = new ssdpDeviceNode();
-                ssdpDeviceNode_ptr->ssdpDevice = ssdpDevice_ptr;
-                ssdpDeviceNode_tail->next = ssdpDeviceNode_ptr;
-                ssdpDeviceNode_tail = ssdpDeviceNode_ptr;
+                prev_ptr->next = curr_ptr->next;
             }
+            freeObject(curr_ptr->ssdpDevice);
+            freeObject(curr_ptr);
         }
+        return NULL;
+    }
 
-        delay(5);
+    if (!hasLocation) {
+        debugPrintln(F("ERROR: could not parse LOCATION param"));
+        return NULL;
     }
 
-    // close the UDP connection
-    _udpClient.stop();
+    boolean isCreated = curr_ptr == NULL;
+    if (isCreated) {
+        curr_ptr = allocateObject<ssdpDeviceNode>();
+        ssdpDevice *newDevice_ptr = allocateObject<ssdpDevice>();
+        if (curr_ptr == NULL || newDevice_ptr == NULL) {
+            debugPrintln(F("ERROR: Out of memory for a new SSDP device"));
+            freeObject(curr_ptr);
+            freeObject(newDevice_ptr);
+            return NULL;
+        }
+        curr_ptr->ssdpDevice = newDevice_ptr;
+        curr_ptr->next = NULL;
+        if (prev_ptr == NULL) {
+            _ssdpDeviceCache = curr_ptr;
+        } else {
+            prev_ptr->next = curr_ptr;
+        }
+    }
+
+    ssdpDevice *device_ptr = curr_ptr->ssdpDevice;
+    if (isNew != NULL) {
+        *isNew = isCreated || millis() - device_ptr->lastSeenTime > millis() - sinceTime;
+    }
+    device_ptr->host = host;
+    device_ptr->port = location.port;
+    device_ptr->path = path;
+    device_ptr->usn = usn;
+    if (response->server != NULL) {
+        device_ptr->server = urlPartToString(response->server, response->serverLength);
+    }
+    device_ptr->maxAge = response->maxAge > 0 ? response->maxAge : SSDP_DEFAULT_MAX_AGE_S;
+    device_ptr->lastSeenTime = millis();
+
+    return device_ptr;
+}
 
-    // dedup SSDP devices fromt the list - O(n^2)
-    ssdpDeviceNode_ptr = ssdpDeviceNode_head;
-    while (ssdpDeviceNode_ptr != NULL) {
-        ssdpDeviceNode *ssdpDeviceNodePrev_ptr = ssdpDeviceNode_ptr;
-        ssdpDeviceNode *ssdpDeviceNodeCurr_ptr = ssdpDeviceNode_ptr->next;
-
-        while (ssdpDeviceNodeCurr_ptr != NULL) {
-            if (ssdpDeviceNodeCurr_ptr->ssdpDevice->host == ssdpDeviceNode_ptr->ssdpDevice->host
-                && ssdpDeviceNodeCurr_ptr->ssdpDevice->port == ssdpDeviceNode_ptr->ssdpDevice->port
-                && ssdpDeviceNodeCurr_ptr->ssdpDevice->path == ssdpDeviceNode_ptr->ssdpDevice->path) {
-                // delete ssdpDeviceNode from the list
-                ssdpDeviceNodePrev_ptr->next = ssdpDeviceNodeCurr_ptr->next;
-                free(ssdpDeviceNodeCurr_ptr->ssdpDevice);
-                free(ssdpDeviceNodeCurr_ptr);
-                ssdpDeviceNodeCurr_ptr = ssdpDeviceNodePrev_ptr->next;
+void TinyUPnP::removeExpiredSsdpDevices() {
+    ssdpDeviceNode *prev_ptr = NULL;
+    ssdpDeviceNode *curr_ptr = _ssdpDeviceCache;
+    while (curr_ptr != NULL) {
+        ssdpDevice *device_ptr = curr_ptr->ssdpDevice;
+        if (millis() - device_ptr->lastSeenTime > (unsigned long) device_ptr->maxAge * 1000UL) {
+            debugPrint(F("SSDP device expired ["));
+            debugPrint(device_ptr->usn);
+            debugPrintln(F("]"));
+            ssdpDeviceNode *del_ptr = curr_ptr;
+            curr_ptr = curr_ptr->next;
+            if (prev_ptr == NULL) {
+                _ssdpDeviceCache = curr_ptr;
             } else {
-                ssdpDeviceNodePrev_ptr = ssdpDeviceNodeCurr_ptr;
-                ssdpDeviceNodeCurr_ptr = ssdpDeviceNodeCurr_ptr->next;
+                prev_ptr->next = curr_ptr;
             }
+            freeObject(del_ptr->ssdpDevice);
+            freeObject(del_ptr);
+        } else {
+            prev_ptr = curr_ptr;
+            curr_ptr = curr_ptr->next;
         }
-        ssdpDeviceNode_ptr = ssdpDeviceNode_ptr->next;
     }
+}
 
-    return ssdpDeviceNode_head;
+// a device is stale once half of its max-age passed without a refresh, as it is about to expire
+boolean TinyUPnP::isSsdpDeviceCacheStale() {
+    ssdpDeviceNode *curr_ptr = _ssdpDeviceCache;
+    while (curr_ptr != NULL) {
+        ssdpDevice *device_ptr = curr_ptr->ssdpDevice;
+        if (millis() - device_ptr->lastSeenTime > (unsigned long) device_ptr->maxAge * 500UL) {
+            return true;
+        }
+        curr_ptr = curr_ptr->next;
+    }
+    return false;
 }
 
 // Assuming an M-SEARCH message was broadcaseted, wait for the response from the IGD (Internet Gateway Device)
 // Note: the response from the IGD is sent back as unicast to this device
 // Note: only gateway defined IGD response will be considered, the rest will be ignored
 ssdpDevice* TinyUPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
+    ssdpResponse response;
+    if (!receiveSsdpResponse(gatewayIP, &response)) {
+        return NULL;
+    }
+
+    // only continue if the packet is a response to M-SEARCH and it originated from a gateway device
+    if (response.isNotify || !isIgdSearchTarget(response.st, response.stLength)) {
+        debugPrintln(F("IGD was not found"));
+        return NULL;
+    }
+    debugPrint(F("IGD of type ["));
+    debugPrint(urlPartToString(response.st, response.stLength));
+    debugPrintln(F("] found"));
+
+    if (response.location == NULL) {
+        debugPrintln(F("ERROR: LOCATION param was not found"));
+        return NULL;
+    }
+
+    urlParts location;
+    if (!parseUrl(response.location, response.locationLength, &location) || location.hostLength == 0) {
+        debugPrintln(F("ERROR: could not parse LOCATION param"));
+        return NULL;
+    }
+    
+    debugPrint(F("Device location found ["));
+    debugPrint(urlPartToString(location.host, location.hostLength));
+    debugPrint(F("] port ["));
+    debugPrint(String(location.port));
+    debugPrint(F("] path ["));
+    debugPrint(urlPartToString(location.path, location.pathLength));
+    debugPrintln(F("]"));
+
+    ssdpDevice *newSsdpDevice_ptr = allocateTemporaryObject<ssdpDevice>();
+    if (newSsdpDevice_ptr == NULL) {
+        debugPrintln(F("ERROR: Out of memory for the gateway"));
+        return NULL;
+    }
+
+    parseIPAddress(location.host, location.hostLength, &newSsdpDevice_ptr->host);
+    newSsdpDevice_ptr->port = location.port;
+    newSsdpDevice_ptr->path = urlPartToString(location.path, location.pathLength);
+
+    return newSsdpDevice_ptr;
+}
+
+// reads a single SSDP packet into _responseBuffer and parses it, false if no valid packet is available
+// packets that did not originate from gatewayIP are discarded, unless gatewayIP is ipNull (SSDP discovery)
+boolean TinyUPnP::receiveSsdpResponse(IPAddress gatewayIP, ssdpResponse *response) {
     // Flush the UDP buffer since otherwise anyone who responded first will be the only one we see
     // and we will not see the response from the gateway router
     _udpClient.flush();
@@ -692,7 +2622,7 @@ ssdpDevice* TinyUPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
 
     // only continue if a packet is available
     if (packetSize <= 0) {
-        return NULL;
+        return false;
     }
 
     IPAddress remoteIP = _udpClient.remoteIP();
@@ -704,7 +2634,7 @@ ssdpDevice* TinyUPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
         debugPrint(F("] remoteIP ["));
         debugPrint(remoteIP.toString());
         debugPrintln(F("]"));
-        return NULL;
+        return false;
     }
 
     debugPrint(F("Received packet of size ["));
@@ -721,16 +2651,19 @@ ssdpDevice* TinyUPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
     debugPrint(String(_udpClient.remotePort()));
     debugPrintln(F("]"));
 
-    // sanity check
-    if (packetSize > UPNP_UDP_TX_RESPONSE_MAX_SIZE) {
+    // sanity check, one byte is kept for the terminating '\0'
+    if (packetSize >= UPNP_UDP_TX_RESPONSE_MAX_SIZE) {
         debugPrint(F("Received packet with size larged than the response buffer, cannot proceed."));
-        return NULL;
+        return false;
     }
   
     int idx = 0;
     while (idx < packetSize) {
-        memset(packetBuffer, 0, UPNP_UDP_TX_PACKET_MAX_SIZE);
-        int len = _udpClient.read(packetBuffer, UPNP_UDP_TX_PACKET_MAX_SIZE);
+        int maxLen = UPNP_UDP_TX_RESPONSE_MAX_SIZE - 1 - idx;
+        if (maxLen > UPNP_UDP_TX_PACKET_MAX_SIZE) {
+            maxLen = UPNP_UDP_TX_PACKET_MAX_SIZE;
+        }
+        int len = _udpClient.read(_responseBuffer + idx, maxLen);
         if (len <= 0) {
             break;
         }
@@ -739,87 +2672,196 @@ ssdpDevice* TinyUPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
         debugPrint(F("] out of ["));
         debugPrint(String(packetSize));
         debugPrintln(F("]"));
-        memcpy(responseBuffer + idx, packetBuffer, len);
         idx += len;
     }
-    responseBuffer[idx] = '\0';
+    _responseBuffer[idx] = '\0';
 
     debugPrintln(F("Gateway packet content:"));
-    debugPrintln(responseBuffer);
+    debugPrintln(_responseBuffer);
 
-    const char * const * deviceList = deviceListUpnp;
-    if (gatewayIP == ipNull) {
-        deviceList = deviceListSsdpAll;
+    // a single pass over the datagram, all the filtering is done on the parsed headers
+    if (!parseSsdpResponse(_responseBuffer, idx, response)) {
+        debugPrintln(F("ERROR: not a valid SSDP message"));
+        return false;
     }
+    // searches of other control points and the announcements of the fleet are not devices
+    int fleetTargetLength = strlen(deviceListFleet[0]);
+    boolean isFleetTarget = response->st != NULL && response->stLength == fleetTargetLength
+        && strncmp(response->st, deviceListFleet[0], fleetTargetLength) == 0;
+    if (response->isSearch || isFleetTarget) {
+        if (_isFleetEnabled && isFleetTarget) {
+            processFleetMessage(response, remoteIP);
+        }
+        return false;
+    }
+    return true;
+}
 
-    // only continue if the packet is a response to M-SEARCH and it originated from a gateway device
-    // for SSDP discovery we continue anyway
-    if (gatewayIP != ipNull) {  // for the use of listSsdpDevices
-        boolean foundIGD = false;
-        for (int i = 0; deviceList[i]; i++) {
-            if (strstr(responseBuffer, deviceList[i]) != NULL) {
-                foundIGD = true;
-                debugPrint(F("IGD of type ["));
-                debugPrint(deviceList[i]);
-                debugPrintln(F("] found"));
-                break;
+// a single pass over an SSDP datagram, the header values point into buffer
+// header names are matched case-insensitively, unknown headers are skipped
+boolean TinyUPnP::parseSsdpResponse(const char *buffer, int length, ssdpResponse *response) {
+    const char *end = buffer + length;
+    response->isNotify = false;
+    response->location = NULL;
+    response->locationLength = 0;
+    response->st = NULL;
+    response->stLength = 0;
+    response->usn = NULL;
+    response->usnLength = 0;
+    response->server = NULL;
+    response->serverLength = 0;
+    response->nts = NULL;
+    response->ntsLength = 0;
+    response->maxAge = -1;
+    response->bootId = -1;
+    response->isSearch = false;
+    response->fleetState = NULL;
+    response->fleetStateLength = 0;
+
+    boolean isFirstLine = true;
+    const char *lineStart = buffer;
+    while (lineStart < end) {
+        const char *lineEnd = lineStart;
+        while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') {
+            lineEnd++;
+        }
+        int lineLength = lineEnd - lineStart;
+
+        if (isFirstLine) {
+            // "HTTP/1.1 200 OK" for a response to M-SEARCH or "NOTIFY * HTTP/1.1" for an announcement
+            if (lineLength >= 9 && strncasecmp(lineStart, "HTTP/1.1 ", 9) == 0) {
+                if (lineLength < 12 || strncmp(lineStart + 9, "200", 3) != 0) {
+                    return false;
+                }
+            } else if (lineLength >= 7 && strncasecmp(lineStart, "NOTIFY ", 7) == 0) {
+                response->isNotify = true;
+            } else if (lineLength >= 9 && strncasecmp(lineStart, "M-SEARCH ", 9) == 0) {
+                response->isSearch = true;
+            } else {
+                return false;
+            }
+            isFirstLine = false;
+        } else if (lineLength == 0) {
+            break;  // end of headers
+        } else {
+            const char *colon = (const char *) memchr(lineStart, ':', lineLength);
+            if (colon != NULL) {
+                int nameLength = colon - lineStart;
+                const char *value = colon + 1;
+                const char *valueEnd = lineEnd;
+                while (value < valueEnd && isspace((unsigned char) *value)) {
+                    value++;
+                }
+                while (valueEnd > value && isspace((unsigned char) *(valueEnd - 1))) {
+                    valueEnd--;
+                }
+                int valueLength = valueEnd - value;
+
+                if (nameLength == 8 && strncasecmp(lineStart, "LOCATION", 8) == 0) {
+                    response->location = value;
+                    response->locationLength = valueLength;
+                } else if (nameLength == 2 && (strncasecmp(lineStart, "ST", 2) == 0 || strncasecmp(lineStart, "NT", 2) == 0)) {
+                    response->st = value;
+                    response->stLength = valueLength;
+                } else if (nameLength == 3 && strncasecmp(lineStart, "USN", 3) == 0) {
+                    response->usn = value;
+                    response->usnLength = valueLength;
+                } else if (nameLength == 6 && strncasecmp(lineStart, "SERVER", 6) == 0) {
+                    response->server = value;
+                    response->serverLength = valueLength;
+                } else if (nameLength == 3 && strncasecmp(lineStart, "NTS", 3) == 0) {
+                    response->nts = value;
+                    response->ntsLength = valueLength;
+                } else if (nameLength == 13 && strncasecmp(lineStart, "CACHE-CONTROL", 13) == 0) {
+                    // e.g. "max-age=1800"
+                    for (const char *p = value; p + 7 <= valueEnd; p++) {
+                        if (strncasecmp(p, "max-age", 7) == 0) {
+                            p += 7;
+                            while (p < valueEnd && (*p == ' ' || *p == '=')) {
+                                p++;
+                            }
+                            response->maxAge = parseDecimal(p, valueEnd - p);
+                            break;
+                        }
+                    }
+                } else if (nameLength == 15 && strncasecmp(lineStart, "BOOTID.UPNP.ORG", 15) == 0) {
+                    response->bootId = parseDecimal(value, valueLength);
+                } else if (nameLength == 16 && strncasecmp(lineStart, "X-TINYUPNP-FLEET", 16) == 0) {
+                    response->fleetState = value;
+                    response->fleetStateLength = valueLength;
+                }
             }
         }
 
-        if (!foundIGD) {
-            debugPrintln(F("IGD was not found"));
-            return NULL;
+        // skip the line terminator, either "\r\n" or a lone '\n'
+        if (lineEnd < end && *lineEnd == '\r') {
+            lineEnd++;
         }
+        if (lineEnd < end && *lineEnd == '\n') {
+            lineEnd++;
+        }
+        lineStart = lineEnd;
     }
 
-    String location = "";
-    char* location_indexStart = strstr(responseBuffer, "location:");
-    if (location_indexStart == NULL) {
-        location_indexStart = strstr(responseBuffer, "Location:");
+    return !isFirstLine;
+}
+
+// true if st is one of deviceListUpnp
+boolean TinyUPnP::isIgdSearchTarget(const char *st, int length) {
+    if (st == NULL) {
+        return false;
     }
-    if (location_indexStart == NULL) {
-        location_indexStart = strstr(responseBuffer, "LOCATION:");
+    for (int i = 0; deviceListUpnp[i]; i++) {
+        if ((int) strlen(deviceListUpnp[i]) == length && strncmp(st, deviceListUpnp[i], length) == 0) {
+            return true;
+        }
     }
-    if (location_indexStart != NULL) {
-        location_indexStart += 9;  // "location:".length()
-        char* location_indexEnd = strstr(location_indexStart, "\r\n");
-        if (location_indexEnd != NULL) {
-            int urlLength = location_indexEnd - location_indexStart;
-            int arrLength = urlLength + 1;  // + 1 for '\0'
-            // converting the start index to be inside the packetBuffer rather than responseBuffer
-            char locationCharArr[arrLength];
-            memcpy(locationCharArr, location_indexStart, urlLength);
-            locationCharArr[arrLength - 1] = '\0';
-            location = String(locationCharArr);
-            location.trim();
-        } else {
-            debugPrintln(F("ERROR: could not extract value from LOCATION param"));
-            return NULL;
+    return false;
+}
+
+// "<uptime or -1> <ms since the check> <external IP>" as sent by announceToFleet
+// -1 is the only negative uptime and the external IP is never 0.0.0.0
+boolean TinyUPnP::parseFleetState(const char *str, int length, long *uptime, unsigned long *ageMs, IPAddress *externalIP) {
+    const char *end = str + length;
+    const char *field = str;
+    if (field < end && *field == '-') {
+        if (end - field < 2 || field[1] != '1' || (end - field > 2 && field[2] != ' ')) {
+            return false;
         }
+        *uptime = -1;
     } else {
-        debugPrintln(F("ERROR: LOCATION param was not found"));
-        return NULL;
+        *uptime = parseDecimal(field, end - field);
+        if (*uptime < 0) {
+            return false;
+        }
+    }
+    while (field < end && *field != ' ') {
+        field++;
     }
-    
-    debugPrint(F("Device location found ["));
-    debugPrint(location);
-    debugPrintln(F("]"));
-  
-    IPAddress host = getHost(location);
-    int port = getPort(location);
-    String path = getPath(location);
-
-    ssdpDevice *newSsdpDevice_ptr = new ssdpDevice();
-    
-    newSsdpDevice_ptr->host = host;
-    newSsdpDevice_ptr->port = port;
-    newSsdpDevice_ptr->path = path;
-    
-    // debugPrintln(host.toString());
-    // debugPrintln(String(port));
-    // debugPrintln(path);
+    while (field < end && *field == ' ') {
+        field++;
+    }
+    long age = parseDecimal(field, end - field);
+    if (age < 0) {
+        return false;
+    }
+    *ageMs = age;
+    while (field < end && *field != ' ') {
+        field++;
+    }
+    while (field < end && *field == ' ') {
+        field++;
+    }
+    return parseIPAddress(field, end - field, externalIP) && *externalIP != ipNull;
+}
 
-    return newSsdpDevice_ptr;
+// parses the leading digits of str, -1 if there are none
+long TinyUPnP::parseDecimal(const char *str, int length) {
+    long result = -1;
+    for (int i = 0; i < length && isdigit((unsigned char) str[i]) && result < LONG_MAX / 10 - 10; i++) {
+        result = (result < 0 ? 0 : result * 10) + (str[i] - '0');
+    }
+    return result;
 }
 
 // a single trial to connect to the IGD (with TCP)
@@ -829,7 +2871,7 @@ boolean TinyUPnP::connectToIGD(IPAddress host, int port) {
     debugPrint(F("] port ["));
     debugPrint(String(port));
     debugPrintln(F("]"));
-    if (_wifiClient.connect(host, port)) {
+    if (_client->connect(host, port)) {
         debugPrintln(F("Connected to IGD"));
         return true;
     }
@@ -846,51 +2888,58 @@ boolean TinyUPnP::getIGDEventURLs(gatewayInfo *deviceInfo) {
     debugPrintln(F("]"));
 
     // make an HTTP request
-    _wifiClient.print(F("GET "));
-    _wifiClient.print(deviceInfo->path);
-    _wifiClient.println(F(" HTTP/1.1"));
-    _wifiClient.println(F("Content-Type: text/xml; charset=\"utf-8\""));
-    //_wifiClient.println(F("Connection: close"));
-    _wifiClient.println("Host: " + deviceInfo->host.toString() + ":" + String(deviceInfo->actionPort));
-    _wifiClient.println(F("Content-Length: 0"));
-    _wifiClient.println();
+    _client->print(F("GET "));
+    _client->print(deviceInfo->path);
+    _client->println(F(" HTTP/1.1"));
+    _client->println(F("Content-Type: text/xml; charset=\"utf-8\""));
+    //_client->println(F("Connection: close"));
+    _client->print(F("Host: "));
+    _client->print(deviceInfo->host);
+    _client->print(':');
+    _client->println(deviceInfo->actionPort);
+    _client->println(F("Content-Length: 0"));
+    _client->println();
     
     // wait for the response
-    unsigned long timeout = millis();
-    while (_wifiClient.available() == 0) {
-        if (millis() - timeout > TCP_CONNECTION_TIMEOUT_MS) {
-            debugPrintln(F("TCP connection timeout while executing getIGDEventURLs"));
-            _wifiClient.stop();
-            return false;
-        }
+    if (!waitForResponse(_deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS))) {
+        debugPrintln(F("TCP connection timeout while executing getIGDEventURLs"));
+        _client->stop();
+        return false;
     }
     
     // read all the lines of the reply from server
     boolean upnpServiceFound = false;
     boolean urlBaseFound = false;
-    while (_wifiClient.available()) {
-        String line = _wifiClient.readStringUntil('\r');
+    boolean controlURLFound = false;
+    boolean scpdURLFound = false;
+    String basePath = deviceInfo->path;  // relative URLs are resolved against URLBase if given or else against LOCATION
+    int basePort = deviceInfo->actionPort;
+    while (_client->available()) {
+        String line = _client->readStringUntil('\r');
         int index_in_line = 0;
         debugPrint(line);
         if (!urlBaseFound && line.indexOf(F("<URLBase>")) >= 0) {
             // e.g. <URLBase>http://192.168.1.1:5432/</URLBase>
             // Note: assuming URL path will only be found in a specific action under the 'controlURL' xml tag
-            String baseUrl = getTagContent(line, "URLBase");
+            String baseUrl = getTagContent(line, PSTR("URLBase"));
             if (baseUrl.length() > 0) {
-                baseUrl.trim();
-                IPAddress host = getHost(baseUrl);  // this is ignored, assuming router host IP will not change
-                int port = getPort(baseUrl);
-                deviceInfo->actionPort = port;
-
-                debugPrint(F("URLBase tag found ["));
-                debugPrint(baseUrl);
-                debugPrintln(F("]"));
-                debugPrint(F("Translated to base host ["));
-                debugPrint(host.toString());
-                debugPrint(F("] and base port ["));
-                debugPrint(String(port));
-                debugPrintln(F("]"));
-                urlBaseFound = true;
+                urlParts baseUrlParts;
+                // the host is ignored, assuming router host IP will not change
+                if (parseUrl(baseUrl.c_str(), baseUrl.length(), &baseUrlParts) && baseUrlParts.port > 0) {
+                    deviceInfo->actionPort = baseUrlParts.port;
+                    basePort = baseUrlParts.port;
+                    basePath = urlPartToString(baseUrlParts.path, baseUrlParts.pathLength);
+
+                    debugPrint(F("URLBase tag found ["));
+                    debugPrint(baseUrl);
+                    debugPrintln(F("]"));
+                    debugPrint(F("Translated to base host ["));
+                    debugPrint(urlPartToString(baseUrlParts.host, baseUrlParts.hostLength));
+                    debugPrint(F("] and base port ["));
+                    debugPrint(String(baseUrlParts.port));
+                    debugPrintln(F("]"));
+                    urlBaseFound = true;
+                }
             }
         }
 
@@ -898,7 +2947,11 @@ boolean TinyUPnP::getIGDEventURLs(gatewayInfo *deviceInfo) {
         int service_type_index_start = 0;
         
         for (int i = 0; deviceListUpnp[i]; i++) {
-            int service_type_index = line.indexOf(UPNP_SERVICE_TYPE_TAG_START + deviceListUpnp[i]);
+            // e.g. "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1", built on the stack
+            char serviceTypeTag[UPNP_SERVICE_TYPE_TAG_MAX_SIZE];
+            snprintf(serviceTypeTag, sizeof(serviceTypeTag), "%s%s", UPNP_SERVICE_TYPE_TAG_START.c_str(), deviceListUpnp[i]);
+            const char *serviceType = strstr(line.c_str(), serviceTypeTag);
+            int service_type_index = serviceType != NULL ? serviceType - line.c_str() : -1;
             if (service_type_index >= 0) {
                 debugPrint(F("["));
                 debugPrint(deviceInfo->serviceTypeName);
@@ -911,7 +2964,7 @@ boolean TinyUPnP::getIGDEventURLs(gatewayInfo *deviceInfo) {
             if (!upnpServiceFound && service_type_index >= 0) {
                 index_in_line += service_type_index;
                 upnpServiceFound = true;
-                deviceInfo->serviceTypeName = getTagContent(line.substring(service_type_index_start), UPNP_SERVICE_TYPE_TAG_NAME);
+                deviceInfo->serviceTypeName = getTagContent(line, UPNP_SERVICE_TYPE_TAG_NAME.c_str(), service_type_index_start);
                 debugPrint(F("["));
                 debugPrint(deviceInfo->serviceTypeName);
                 debugPrint(F("] service found! deviceType ["));
@@ -921,45 +2974,176 @@ boolean TinyUPnP::getIGDEventURLs(gatewayInfo *deviceInfo) {
             }
         }
         
-        if (upnpServiceFound && (index_in_line = line.indexOf("<controlURL>", index_in_line)) >= 0) {
-            String controlURLContent = getTagContent(line.substring(index_in_line), "controlURL");
-            if (controlURLContent.length() > 0) {
-                deviceInfo->actionPath = controlURLContent;
+        if (!upnpServiceFound) {
+            continue;
+        }
 
+        // the tags of the service may come in any order, only the ones before </service> belong to it
+        int service_end_index = line.indexOf(F("</service>"), index_in_line);
+        int control_url_index = line.indexOf(F("<controlURL>"), index_in_line);
+        if (!controlURLFound && control_url_index >= 0 && (service_end_index < 0 || control_url_index < service_end_index)) {
+            String controlURLContent = getTagContent(line, PSTR("controlURL"), control_url_index);
+            if (controlURLContent.length() > 0 && resolveUrlPath(controlURLContent, basePath, &deviceInfo->actionPath, &deviceInfo->actionPort)) {
+                controlURLFound = true;
                 debugPrint(F("controlURL tag found! setting actionPath to ["));
-                debugPrint(controlURLContent);
+                debugPrint(deviceInfo->actionPath);
+                debugPrint(F("] actionPort ["));
+                debugPrint(String(deviceInfo->actionPort));
+                debugPrintln(F("]"));
+            }
+        }
+
+        int scpd_url_index = line.indexOf(F("<SCPDURL>"), index_in_line);
+        if (!scpdURLFound && scpd_url_index >= 0 && (service_end_index < 0 || scpd_url_index < service_end_index)) {
+            String scpdURLContent = getTagContent(line, PSTR("SCPDURL"), scpd_url_index);
+            deviceInfo->scpdPort = basePort;
+            if (scpdURLContent.length() > 0 && resolveUrlPath(scpdURLContent, basePath, &deviceInfo->scpdPath, &deviceInfo->scpdPort)) {
+                scpdURLFound = true;
+                debugPrint(F("SCPDURL tag found! setting scpdPath to ["));
+                debugPrint(deviceInfo->scpdPath);
+                debugPrint(F("] scpdPort ["));
+                debugPrint(String(deviceInfo->scpdPort));
                 debugPrintln(F("]"));
-                
-                // clear buffer
-                debugPrintln(F("Flushing the rest of the response"));
-                while (_wifiClient.available()) {
-                    _wifiClient.read();
+            }
+        }
+
+        if (controlURLFound && (scpdURLFound || service_end_index >= 0)) {
+            // clear buffer
+            debugPrintln(F("Flushing the rest of the response"));
+            while (_client->available()) {
+                _client->read();
+            }
+            
+            // now we have (upnpServiceFound && controlURLFound)
+            return true;
+        }
+    }
+
+    return controlURLFound;
+}
+
+// resolves url against basePath, path and port are only changed if url is absolute
+// e.g. "http://192.168.1.1:5432/ctl/IPConn", "/ctl/IPConn" or "ctl/IPConn"
+boolean TinyUPnP::resolveUrlPath(const String &url, const String &basePath, String *path, int *port) {
+    urlParts parts;
+    if (!parseUrl(url.c_str(), url.length(), &parts)) {
+        return false;
+    }
+    if (parts.port > 0) {
+        *port = parts.port;
+        *path = urlPartToString(parts.path, parts.pathLength);
+    } else if (parts.pathLength > 0 && parts.path[0] == '/') {
+        *path = urlPartToString(parts.path, parts.pathLength);
+    } else {
+        // relative to the directory of the base path
+        int lastSlashIndex = basePath.lastIndexOf('/');
+        *path = (lastSlashIndex >= 0 ? basePath.substring(0, lastSlashIndex + 1) : String("/"))
+            + urlPartToString(parts.path, parts.pathLength);
+    }
+    return true;
+}
+
+// fetches the SCPD of the IGD service and fills deviceInfo->supportedActions with the actions listed in it
+// this is done once per IGD, so that actions the IGD does not support are never sent to it
+boolean TinyUPnP::getSupportedActions(gatewayInfo *deviceInfo) {
+    deviceInfo->supportedActions = 0;
+    if (deviceInfo->scpdPath.length() == 0 || deviceInfo->scpdPort == 0) {
+        debugPrintln(F("SCPDURL is unknown, assuming all actions are supported"));
+        return false;
+    }
+
+    descriptionFetch fetch;
+    fetch.host = deviceInfo->host;
+    fetch.port = deviceInfo->scpdPort;
+    fetch.path = deviceInfo->scpdPath;
+    fetch.context = deviceInfo;
+
+    // e.g. <action><name>AddPortMapping</name><argumentList><argument><name>NewRemoteHost</name>...
+    // only the first <name> after <action> is the name of the action, the rest are names of its arguments
+    boolean isActionNamePending = false;
+    auto onLine = [] (descriptionFetch *fetch, const String &line, void *arg) -> boolean {
+        gatewayInfo *deviceInfo = (gatewayInfo *) fetch->context;
+        boolean *isActionNamePending = (boolean *) arg;
+        int index = 0;
+        while (true) {
+            if (*isActionNamePending) {
+                index = line.indexOf(F("<name>"), index);
+                if (index < 0) {
+                    break;
+                }
+                String name = getTagContent(line, PSTR("name"), index);
+                for (int i = 0; SOAPActions[i]; i++) {
+                    if (name == SOAPActions[i]->name) {
+                        deviceInfo->supportedActions |= 1 << SOAPActions[i]->id;
+                        break;
+                    }
+                }
+                *isActionNamePending = false;
+                index += 6;  // "<name>".length()
+            } else {
+                index = line.indexOf(F("<action>"), index);
+                if (index < 0) {
+                    break;
                 }
-                
-                // now we have (upnpServiceFound && controlURLFound)
-                return true;
+                *isActionNamePending = true;
+                index += 8;  // "<action>".length()
             }
         }
+        return true;
+    };
+
+    if (fetchDescriptions(&fetch, 1, onLine, &isActionNamePending, 1) == 0 || deviceInfo->supportedActions == 0) {
+        debugPrintln(F("Could not read the SCPD, assuming all actions are supported"));
+        deviceInfo->supportedActions = 0;
+        return false;
     }
 
-    return false;
+    debugPrint(F("IGD supported actions ["));
+    for (int i = 0; SOAPActions[i]; i++) {
+        if (isActionSupported(deviceInfo, SOAPActions[i])) {
+            debugPrint(SOAPActions[i]->name);
+            debugPrint(F(" "));
+        }
+    }
+    debugPrintln(F("]"));
+    return true;
+}
+
+// true if the IGD listed the action in its SCPD or if the SCPD is unknown
+boolean TinyUPnP::isActionSupported(gatewayInfo *deviceInfo, SOAPAction *soapAction) {
+    return deviceInfo->supportedActions == 0 || (deviceInfo->supportedActions & (1 << soapAction->id)) != 0;
 }
 
+
 // assuming a connection to the IGD has been formed
 // will add the port mapping to the IGD
-boolean TinyUPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-    debugPrintln(F("called addPortMappingEntry"));
+// soapAction is either AddPortMapping or AddAnyPortMapping (IGDv2), in which case the external port of the rule
+// is updated to the one reserved by the IGD
+soapActionResult TinyUPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr, SOAPAction *soapAction) {
+    debugPrint(F("called addPortMappingEntry ["));
+    debugPrint(soapAction->name);
+    debugPrintln(F("]"));
+
+    if (!isActionSupported(deviceInfo, soapAction)) {
+        debugPrintln(F("Action is not supported by the IGD"));
+        return SOAP_RESULT_NOT_SUPPORTED;
+    }
+
+    if (!acquireActionToken()) {
+        _client->stop();
+        return SOAP_RESULT_NETWORK_ERROR;
+    }
 
     // connect to IGD (TCP connection) again, if needed, in case we got disconnected after the previous query
-    unsigned long timeout = millis() + TCP_CONNECTION_TIMEOUT_MS;
-    if (!_wifiClient.connected()) {
+    UPnPDeadline connectDeadline = _deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS);
+    if (!_client->connected()) {
         while (!connectToIGD(_gwInfo.host, _gwInfo.actionPort)) {
-            if (millis() > timeout) {
+            if (connectDeadline.isExpired()) {
                 debugPrintln(F("Timeout expired while trying to connect to the IGD"));
-                _wifiClient.stop();
-                return false;
+                _client->stop();
+                return SOAP_RESULT_NETWORK_ERROR;
             }
-            delay(500);
+            connectDeadline.sleep(500);
         }
     }
 
@@ -971,224 +3155,629 @@ boolean TinyUPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_pt
     debugPrint(deviceInfo->serviceTypeName);
     debugPrintln(F("]"));
 
-    strcpy_P(body_tmp, PSTR("<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body><u:AddPortMapping xmlns:u=\""));
-    strcat_P(body_tmp, deviceInfo->serviceTypeName.c_str());
-    strcat_P(body_tmp, PSTR("\"><NewRemoteHost></NewRemoteHost><NewExternalPort>"));
-    sprintf(integer_string, "%d", rule_ptr->externalPort);
-    strcat_P(body_tmp, integer_string);
-    strcat_P(body_tmp, PSTR("</NewExternalPort><NewProtocol>"));
-    strcat_P(body_tmp, rule_ptr->protocol.c_str());
-    strcat_P(body_tmp, PSTR("</NewProtocol><NewInternalPort>"));
-    sprintf(integer_string, "%d", rule_ptr->internalPort);
-    strcat_P(body_tmp, integer_string);
-    strcat_P(body_tmp, PSTR("</NewInternalPort><NewInternalClient>"));
+    strcpy_P(_bodyTmp, PSTR("<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body><u:"));
+    strcat_P(_bodyTmp, soapAction->name);
+    strcat_P(_bodyTmp, PSTR(" xmlns:u=\""));
+    strcat_P(_bodyTmp, deviceInfo->serviceTypeName.c_str());
+    strcat_P(_bodyTmp, PSTR("\"><NewRemoteHost></NewRemoteHost><NewExternalPort>"));
+    sprintf(_integerString, "%d", rule_ptr->externalPort);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("</NewExternalPort><NewProtocol>"));
+    strcat_P(_bodyTmp, rule_ptr->protocol.c_str());
+    strcat_P(_bodyTmp, PSTR("</NewProtocol><NewInternalPort>"));
+    sprintf(_integerString, "%d", rule_ptr->internalPort);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("</NewInternalPort><NewInternalClient>"));
     IPAddress ipAddress = (rule_ptr->internalAddr == ipNull) ? WiFi.localIP() : rule_ptr->internalAddr;
-    strcat_P(body_tmp, ipAddress.toString().c_str());
-    strcat_P(body_tmp, PSTR("</NewInternalClient><NewEnabled>1</NewEnabled><NewPortMappingDescription>"));
-    strcat_P(body_tmp, rule_ptr->devFriendlyName.c_str());
-    strcat_P(body_tmp, PSTR("</NewPortMappingDescription><NewLeaseDuration>"));
-    sprintf(integer_string, "%d", rule_ptr->leaseDuration);
-    strcat_P(body_tmp, integer_string);
-    strcat_P(body_tmp, PSTR("</NewLeaseDuration></u:AddPortMapping></s:Body></s:Envelope>"));
-
-    sprintf(integer_string, "%d", strlen(body_tmp));
+    sprintf(_integerString, "%d.%d.%d.%d", ipAddress[0], ipAddress[1], ipAddress[2], ipAddress[3]);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("</NewInternalClient><NewEnabled>1</NewEnabled><NewPortMappingDescription>"));
+    strcat_P(_bodyTmp, rule_ptr->devFriendlyName.c_str());
+    strcat_P(_bodyTmp, PSTR("</NewPortMappingDescription><NewLeaseDuration>"));
+    sprintf(_integerString, "%d", rule_ptr->leaseDuration);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("</NewLeaseDuration></u:"));
+    strcat_P(_bodyTmp, soapAction->name);
+    strcat_P(_bodyTmp, PSTR("></s:Body></s:Envelope>"));
+
+    sprintf(_integerString, "%d", strlen(_bodyTmp));
     
-    _wifiClient.print(F("POST "));
-    _wifiClient.print(deviceInfo->actionPath);
-    _wifiClient.println(F(" HTTP/1.1"));
-    //_wifiClient.println(F("Connection: close"));
-    _wifiClient.println(F("Content-Type: text/xml; charset=\"utf-8\""));
-    _wifiClient.println("Host: " + deviceInfo->host.toString() + ":" + String(deviceInfo->actionPort));
-    //_wifiClient.println(F("Accept: */*"));
-    //_wifiClient.println(F("Content-Type: application/x-www-form-urlencoded"));
-    _wifiClient.print(F("SOAPAction: \""));
-    _wifiClient.print(deviceInfo->serviceTypeName);
-    _wifiClient.println(F("#AddPortMapping\""));
-
-    _wifiClient.print(F("Content-Length: "));
-    _wifiClient.println(integer_string);
-    _wifiClient.println();
-
-    _wifiClient.println(body_tmp);
-    _wifiClient.println();
+    _client->print(F("POST "));
+    _client->print(deviceInfo->actionPath);
+    _client->println(F(" HTTP/1.1"));
+    //_client->println(F("Connection: close"));
+    _client->println(F("Content-Type: text/xml; charset=\"utf-8\""));
+    _client->print(F("Host: "));
+    _client->print(deviceInfo->host);
+    _client->print(':');
+    _client->println(deviceInfo->actionPort);
+    //_client->println(F("Accept: */*"));
+    //_client->println(F("Content-Type: application/x-www-form-urlencoded"));
+    _client->print(F("SOAPAction: \""));
+    _client->print(deviceInfo->serviceTypeName);
+    _client->print(F("#"));
+    _client->print(soapAction->name);
+    _client->println(F("\""));
+
+    _client->print(F("Content-Length: "));
+    _client->println(_integerString);
+    _client->println();
+
+    _client->println(_bodyTmp);
+    _client->println();
     
     debugPrint(F("Content-Length was: "));
-    debugPrintln(integer_string);
+    debugPrintln(_integerString);
     
-    debugPrintln(body_tmp);
+    debugPrintln(_bodyTmp);
   
-    timeout = millis();
-    while (_wifiClient.available() == 0) {
-        if (millis() - timeout > TCP_CONNECTION_TIMEOUT_MS) {
-            debugPrintln(F("TCP connection timeout while adding a port mapping"));
-            _wifiClient.stop();
-            return false;
-        }
+    if (!waitForResponse(_deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS))) {
+        debugPrintln(F("TCP connection timeout while adding a port mapping"));
+        _client->stop();
+        return SOAP_RESULT_NETWORK_ERROR;
+    }
+
+    soapResponse response;
+    boolean isKeepAlive;
+    int status = readHttpResponse(&response, &isKeepAlive);
+    soapActionResult result = SOAP_RESULT_SUCCESS;
+    if (status < 0) {
+        result = SOAP_RESULT_NETWORK_ERROR;
+    } else if (response.errorCode > 0) {
+        result = classifySoapError(response.errorCode);
+    } else if (status != 200) {
+        result = SOAP_RESULT_FAILED;
+    } else if (response.reservedPort > 0) {
+        rule_ptr->externalPort = response.reservedPort;
+    }
+    
+    if (result != SOAP_RESULT_SUCCESS) {
+        _client->stop();
     }
 
-    // TODO: verify success
-    boolean isSuccess = true;
-    while (_wifiClient.available()) {
-        String line = _wifiClient.readStringUntil('\r');
-        if (line.indexOf(F("errorCode")) >= 0) {
-            isSuccess = false;
-        }
-        debugPrintln(line);
+    return result;
+}
+
+// maps the UPnP error code of a SOAP fault to the way the library handles it
+soapActionResult TinyUPnP::classifySoapError(int errorCode) {
+    switch (errorCode) {
+        case UPNP_ERROR_SPECIFIED_ARRAY_INDEX_INVALID:
+        case UPNP_ERROR_NO_SUCH_ENTRY_IN_ARRAY:
+            return SOAP_RESULT_NO_SUCH_ENTRY;
+        case UPNP_ERROR_CONFLICT_IN_MAPPING_ENTRY:
+            return SOAP_RESULT_CONFLICT;
+        case UPNP_ERROR_ONLY_PERMANENT_LEASES_SUPPORTED:
+            return SOAP_RESULT_ONLY_PERMANENT_LEASES;
+        case UPNP_ERROR_ACTION_NOT_AUTHORIZED:
+            return SOAP_RESULT_NOT_AUTHORIZED;
+        case UPNP_ERROR_INVALID_ACTION:
+        case UPNP_ERROR_OPTIONAL_ACTION_NOT_IMPLEMENTED:
+            return SOAP_RESULT_NOT_SUPPORTED;
+        default:
+            return SOAP_RESULT_FAILED;
     }
-    debugPrintln("");  // \n
-    
-    if (!isSuccess) {
-        _wifiClient.stop();
+}
+
+// states of soapDecoder
+enum {
+    SOAP_DECODER_TEXT,
+    SOAP_DECODER_TAG_NAME,
+    SOAP_DECODER_TAG_REST,  // attributes, until '>'
+    SOAP_DECODER_SKIP  // XML declaration or comment
+};
+
+void TinyUPnP::beginSoapDecoder(soapDecoder *decoder, soapResponse *response) {
+    response->httpStatus = -1;
+    response->errorCode = 0;
+    response->isActionResponse = false;
+    response->internalClient[0] = '\0';
+    response->externalIPAddress[0] = '\0';
+    response->protocol[0] = '\0';
+    response->connectionStatus[0] = '\0';
+    response->description[0] = '\0';
+    response->internalPort = -1;
+    response->externalPort = -1;
+    response->leaseDuration = -1;
+    response->reservedPort = -1;
+    response->uptime = -1;
+    decoder->response = response;
+    decoder->state = SOAP_DECODER_TEXT;
+    decoder->isEndTag = false;
+    decoder->nameLength = 0;
+    decoder->element[0] = '\0';
+    decoder->textLength = 0;
+}
+
+// a single pass over the SOAP body, one byte at a time so that it can be fed straight from the connection
+// the text of an element is kept until its end tag, elements of interest are then copied to the response
+void TinyUPnP::decodeSoapByte(soapDecoder *decoder, char c) {
+    switch (decoder->state) {
+        case SOAP_DECODER_TEXT:
+            if (c == '<') {
+                decoder->state = SOAP_DECODER_TAG_NAME;
+                decoder->isEndTag = false;
+                decoder->nameLength = 0;
+            } else if (decoder->textLength < SOAP_VALUE_MAX_SIZE - 1) {
+                decoder->text[decoder->textLength++] = c;
+            }
+            return;
+        case SOAP_DECODER_TAG_NAME:
+            if (decoder->nameLength == 0 && !decoder->isEndTag && c == '/') {
+                decoder->isEndTag = true;
+                return;
+            }
+            if (decoder->nameLength == 0 && (c == '?' || c == '!')) {
+                decoder->state = SOAP_DECODER_SKIP;
+                return;
+            }
+            if (c == ':') {
+                decoder->nameLength = 0;  // drop the namespace prefix, e.g. "u:" or "s:"
+                return;
+            }
+            if (c != '>' && c != '/' && !isspace((unsigned char) c)) {
+                if (decoder->nameLength < (int) sizeof(decoder->name) - 1) {
+                    decoder->name[decoder->nameLength] = c;
+                }
+                decoder->nameLength++;
+                return;
+            }
+            // names too long to be of interest are dropped
+            decoder->name[decoder->nameLength < (int) sizeof(decoder->name) - 1 ? decoder->nameLength : 0] = '\0';
+            decoder->state = SOAP_DECODER_TAG_REST;
+            // fall through
+        case SOAP_DECODER_TAG_REST:
+            if (c != '>') {
+                return;
+            }
+            if (decoder->isEndTag) {
+                if (strcmp(decoder->name, decoder->element) == 0) {
+                    endSoapElement(decoder);
+                }
+                decoder->element[0] = '\0';
+            } else {
+                strcpy(decoder->element, decoder->name);
+                decoder->textLength = 0;
+                int nameLength = strlen(decoder->name);
+                if (nameLength > 8 && strcmp_P(decoder->name + nameLength - 8, PSTR("Response")) == 0) {
+                    decoder->response->isActionResponse = true;  // e.g. DeletePortMappingResponse
+                }
+            }
+            decoder->state = SOAP_DECODER_TEXT;
+            return;
+        case SOAP_DECODER_SKIP:
+            if (c == '>') {
+                decoder->state = SOAP_DECODER_TEXT;
+            }
+            return;
     }
+}
 
-    return isSuccess;
+// copies the text of the element that just ended to its field in the response, if it is one of the out-arguments
+void TinyUPnP::endSoapElement(soapDecoder *decoder) {
+    soapResponse *response = decoder->response;
+    const char *name = decoder->element;
+    char *text = decoder->text;
+    int textLength = decoder->textLength;
+    while (textLength > 0 && isspace((unsigned char) text[textLength - 1])) {
+        textLength--;
+    }
+    text[textLength] = '\0';
+    while (isspace((unsigned char) *text)) {
+        text++;
+        textLength--;
+    }
+
+    char *field = NULL;
+    size_t fieldSize = 0;
+    long *number = NULL;
+    if (strcmp_P(name, PSTR("errorCode")) == 0) {
+        long errorCode = parseDecimal(text, textLength);
+        response->errorCode = errorCode > 0 && errorCode <= INT_MAX ? (int) errorCode : 0;  // long is wider than int on a PC
+    } else if (strcmp_P(name, PSTR("NewInternalClient")) == 0) {
+        field = response->internalClient;
+        fieldSize = sizeof(response->internalClient);
+    } else if (strcmp_P(name, PSTR("NewExternalIPAddress")) == 0) {
+        field = response->externalIPAddress;
+        fieldSize = sizeof(response->externalIPAddress);
+    } else if (strcmp_P(name, PSTR("NewProtocol")) == 0) {
+        field = response->protocol;
+        fieldSize = sizeof(response->protocol);
+    } else if (strcmp_P(name, PSTR("NewConnectionStatus")) == 0) {
+        field = response->connectionStatus;
+        fieldSize = sizeof(response->connectionStatus);
+    } else if (strcmp_P(name, PSTR("NewPortMappingDescription")) == 0) {
+        field = response->description;
+        fieldSize = sizeof(response->description);
+    } else if (strcmp_P(name, PSTR("NewInternalPort")) == 0) {
+        number = &response->internalPort;
+    } else if (strcmp_P(name, PSTR("NewExternalPort")) == 0) {
+        number = &response->externalPort;
+    } else if (strcmp_P(name, PSTR("NewLeaseDuration")) == 0) {
+        number = &response->leaseDuration;
+    } else if (strcmp_P(name, PSTR("NewReservedPort")) == 0) {
+        number = &response->reservedPort;
+    } else if (strcmp_P(name, PSTR("NewUptime")) == 0) {
+        number = &response->uptime;
+    }
+
+    if (field != NULL) {
+        strncpy(field, text, fieldSize - 1);
+        field[fieldSize - 1] = '\0';
+    }
+    if (number != NULL) {
+        *number = parseDecimal(text, textLength);
+    }
 }
 
 boolean TinyUPnP::printAllPortMappings() {
-    // verify gateway information is valid
-    // TODO: use this _gwInfo to skip the UDP part completely if it is not empty
+    debugPrintln(F("IGD current port mappings:"));
+    auto printEntry = [] (upnpRule *rule_ptr, void *arg) -> boolean {
+        ((TinyUPnP *) arg)->upnpRuleToString(rule_ptr);
+        return true;
+    };
+    int count = enumeratePortMappings(printEntry, this);
+    debugPrintln("");  // \n
+    return count >= 0;
+}
+
+// fills entries with up to maxEntries port mappings of the IGD, returns the number of entries or -1 on error
+int TinyUPnP::getPortMappings(upnpRule *entries, int maxEntries) {
+    struct {
+        upnpRule *entries;
+        int maxEntries;
+        int count;
+    } snapshot = {entries, maxEntries, 0};
+    auto copyEntry = [] (upnpRule *rule_ptr, void *arg) -> boolean {
+        auto snapshot_ptr = (decltype(snapshot) *) arg;
+        if (snapshot_ptr->count >= snapshot_ptr->maxEntries) {
+            return false;
+        }
+        snapshot_ptr->entries[snapshot_ptr->count++] = *rule_ptr;
+        return snapshot_ptr->count < snapshot_ptr->maxEntries;
+    };
+    if (maxEntries <= 0 || enumeratePortMappings(copyEntry, &snapshot) < 0) {
+        return maxEntries <= 0 ? 0 : -1;
+    }
+    return snapshot.count;
+}
+
+// passes each port mapping of the IGD to callback, in index order, until the end of the table or until callback returns false
+// the connection is reused while the IGD keeps it alive, once a reused connection has answered a second request up to
+// MAX_PIPELINED_SOAP_REQUESTS requests are kept in flight on it, if a reused connection fails every request gets its own
+// returns the number of entries passed to callback or -1 on error
+int TinyUPnP::enumeratePortMappings(port_mapping_callback callback, void *arg) {
+    OperationScope operation(this);
     if (!isGatewayInfoValid(&_gwInfo)) {
         debugPrintln(F("Invalid router info, cannot continue"));
-        return false;
+        return -1;
     }
-    
-    upnpRuleNode *ruleNodeHead_ptr = NULL;
-    upnpRuleNode *ruleNodeTail_ptr = NULL;
-    auto cleanup_rule_nodes_fn = [&ruleNodeHead_ptr] () {
-        upnpRuleNode *curr_ptr = ruleNodeHead_ptr;
-        while (curr_ptr != NULL) {
-            upnpRuleNode *del_prt = curr_ptr;
-            curr_ptr = curr_ptr->next;
-            delete del_prt->upnpRule;
-            delete del_prt;
-        }
-    };
 
-    unsigned long startTime = millis();
+    if (!isActionSupported(&_gwInfo, &SOAPActionGetGenericPortMappingEntry)) {
+        debugPrintln(F("GetGenericPortMappingEntry is not supported by the IGD, cannot continue"));
+        return -1;
+    }
+
+    int nextRequestIndex = 0;  // next index to send a request for
+    int nextResponseIndex = 0;  // index of the next response, responses arrive in the order of the requests
+    int maxInFlight = 1;
+    int responsesOnConnection = 0;  // answered on the current connection, more than one proves it is reused
+    boolean isReuseFailed = false;
+    int count = 0;
     boolean reachedEnd = false;
-    int index = 0;
+    _client->stop();
     while (!reachedEnd) {
-        // connect to IGD (TCP connection) again, if needed, in case we got disconnected after the previous query
-        unsigned long timeout = millis() + TCP_CONNECTION_TIMEOUT_MS;
-        if (!_wifiClient.connected()) {
+        if (_deadline.isExpired()) {
+            debugPrintln(F("Timeout expired while retrieving port mappings"));
+            _client->stop();
+            return -1;
+        }
+
+        if (!_client->connected()) {
+            // requests still in flight on a closed connection are lost, send them again
+            nextRequestIndex = nextResponseIndex;
+            UPnPDeadline connectDeadline = _deadline.getPhaseDeadline(TCP_CONNECTION_TIMEOUT_MS);
             while (!connectToIGD(_gwInfo.host, _gwInfo.actionPort)) {
-                if (millis() > timeout) {
-                    debugPrint(F("Timeout expired while trying to connect to the IGD"));
-                    _wifiClient.stop();
-                    cleanup_rule_nodes_fn();
-                    return false;
+                if (connectDeadline.isExpired()) {
+                    debugPrintln(F("Timeout expired while trying to connect to the IGD"));
+                    _client->stop();
+                    return -1;
                 }
-                delay(1000);
+                connectDeadline.sleep(500);
             }
+            responsesOnConnection = 0;
         }
-        
-        debugPrint(F("Sending query for index ["));
-        debugPrint(String(index));
-        debugPrintln(F("]"));
 
-        strcpy_P(body_tmp, PSTR("<?xml version=\"1.0\"?>"
-            "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-            "<s:Body>"
-            "<u:GetGenericPortMappingEntry xmlns:u=\""));
-        strcat_P(body_tmp, _gwInfo.serviceTypeName.c_str());
-        strcat_P(body_tmp, PSTR("\">"
-            "  <NewPortMappingIndex>"));
-
-        sprintf(integer_string, "%d", index);
-        strcat_P(body_tmp, integer_string);
-        strcat_P(body_tmp, PSTR("</NewPortMappingIndex>"
-            "</u:GetGenericPortMappingEntry>"
-            "</s:Body>"
-            "</s:Envelope>"));
-        
-        sprintf(integer_string, "%d", strlen(body_tmp));
-        
-        _wifiClient.print(F("POST "));
-        _wifiClient.print(_gwInfo.actionPath);
-        _wifiClient.println(F(" HTTP/1.1"));
-        _wifiClient.println(F("Connection: keep-alive"));
-        _wifiClient.println(F("Content-Type: text/xml; charset=\"utf-8\""));
-        _wifiClient.println("Host: " + _gwInfo.host.toString() + ":" + String(_gwInfo.actionPort));
-        _wifiClient.print(F("SOAPAction: \""));
-        _wifiClient.print(_gwInfo.serviceTypeName);
-        _wifiClient.println(F("#GetGenericPortMappingEntry\""));
-
-        _wifiClient.print(F("Content-Length: "));
-        _wifiClient.println(integer_string);
-        _wifiClient.println();
-
-        _wifiClient.println(body_tmp);
-        _wifiClient.println();
-  
-        timeout = millis() + TCP_CONNECTION_TIMEOUT_MS;
-        while (_wifiClient.available() == 0) {
-            if (millis() > timeout) {
-                debugPrintln(F("TCP connection timeout while retrieving port mappings"));
-                _wifiClient.stop();
-                cleanup_rule_nodes_fn();
-                return false;
+        while (nextRequestIndex - nextResponseIndex < maxInFlight) {
+            if (!acquireActionToken()) {
+                _client->stop();
+                return -1;
             }
+            sendGetGenericPortMappingEntry(nextRequestIndex++);
         }
-        
-        while (_wifiClient.available()) {
-            String line = _wifiClient.readStringUntil('\r');
-            debugPrint(line);
-            if (line.indexOf(PORT_MAPPING_INVALID_INDEX) >= 0) {
-                reachedEnd = true;
-            } else if (line.indexOf(PORT_MAPPING_INVALID_ACTION) >= 0) {
-                debugPrint(F("Invalid action while reading port mappings"));
-                reachedEnd = true;
-            } else if (line.indexOf(F("HTTP/1.1 500 ")) >= 0) {
-                debugPrint(F("Internal server error, likely because we have shown all the mappings"));
-                reachedEnd = true;
-            } else if (line.indexOf(F("GetGenericPortMappingEntryResponse")) >= 0) {
-                upnpRule *rule_ptr = new upnpRule();
-                rule_ptr->index = index;
-                rule_ptr->devFriendlyName = getTagContent(line, "NewPortMappingDescription");
-                String newInternalClient = getTagContent(line, "NewInternalClient");
-                if (newInternalClient == "") {
-                    delete rule_ptr;
-                    continue;
+
+        soapResponse response;
+        boolean isKeepAlive = false;
+        int status = readHttpResponse(&response, &isKeepAlive);
+        if (status < 0) {
+            if (responsesOnConnection > 0) {
+                // the IGD might not keep connections alive after all (or dropped the pipelined requests), go back to
+                // one request per connection
+                debugPrintln(F("Reused connection lost, retrying with a connection per request"));
+                isReuseFailed = true;
+                maxInFlight = 1;
+                _client->stop();
+                continue;
+            }
+            debugPrintln(F("TCP connection timeout while retrieving port mappings"));
+            _client->stop();
+            return -1;
+        }
+
+        if (status == 200) {
+            upnpRule rule;
+            if (parsePortMappingEntry(&response, nextResponseIndex, &rule)) {
+                count++;
+                if (!callback(&rule, arg)) {
+                    reachedEnd = true;
+                }
+            }
+        } else {
+            // SpecifiedArrayIndexInvalid (713) marks the end of the table, some IGDs answer any error (or a bare 500) instead
+            int errorCode = response.errorCode;
+            if (classifySoapError(errorCode) != SOAP_RESULT_NO_SUCH_ENTRY) {
+                debugPrint(F("Stopped reading port mappings on HTTP status ["));
+                debugPrint(String(status));
+                debugPrint(F("] error code ["));
+                debugPrint(String(errorCode));
+                debugPrintln(F("]"));
+            }
+            reachedEnd = true;
+        }
+        nextResponseIndex++;
+        responsesOnConnection++;
+
+        if (isKeepAlive && !isReuseFailed) {
+            if (responsesOnConnection > 1) {
+                maxInFlight = MAX_PIPELINED_SOAP_REQUESTS;  // the connection was actually reused
+            }
+        } else {
+            _client->stop();
+        }
+    }
+
+    // discards the responses to requests past the end of the table
+    _client->stop();
+    return count;
+}
+
+void TinyUPnP::sendGetGenericPortMappingEntry(int index) {
+    debugPrint(F("Sending query for index ["));
+    debugPrint(String(index));
+    debugPrintln(F("]"));
+
+    strcpy_P(_bodyTmp, PSTR("<?xml version=\"1.0\"?>"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+        "<s:Body>"
+        "<u:GetGenericPortMappingEntry xmlns:u=\""));
+    strcat_P(_bodyTmp, _gwInfo.serviceTypeName.c_str());
+    strcat_P(_bodyTmp, PSTR("\">"
+        "  <NewPortMappingIndex>"));
+
+    sprintf(_integerString, "%d", index);
+    strcat_P(_bodyTmp, _integerString);
+    strcat_P(_bodyTmp, PSTR("</NewPortMappingIndex>"
+        "</u:GetGenericPortMappingEntry>"
+        "</s:Body>"
+        "</s:Envelope>"));
+
+    sprintf(_integerString, "%d", strlen(_bodyTmp));
+
+    _client->print(F("POST "));
+    _client->print(_gwInfo.actionPath);
+    _client->println(F(" HTTP/1.1"));
+    _client->println(F("Connection: keep-alive"));
+    _client->println(F("Content-Type: text/xml; charset=\"utf-8\""));
+    _client->print(F("Host: "));
+    _client->print(_gwInfo.host);
+    _client->print(':');
+    _client->println(_gwInfo.actionPort);
+    _client->print(F("SOAPAction: \""));
+    _client->print(_gwInfo.serviceTypeName);
+    _client->println(F("#GetGenericPortMappingEntry\""));
+
+    _client->print(F("Content-Length: "));
+    _client->println(_integerString);
+    _client->println();
+
+    // the body is sent without a trailing line break so that it matches Content-Length exactly
+    _client->print(_bodyTmp);
+}
+
+// reads a single HTTP response, framed by Content-Length (or chunked encoding, or the end of the connection)
+// the body is decoded on the fly into response, nothing is buffered
+// returns the HTTP status, or -1 if the connection was closed or timed out before the response was complete
+int TinyUPnP::readHttpResponse(soapResponse *response, boolean *isKeepAlive) {
+    unsigned long lastByteTime = millis();
+    char line[HTTP_HEADER_LINE_MAX_SIZE];
+    int lineLength = 0;
+    int status = -1;
+    long contentLength = -1;
+    boolean isChunked = false;
+    soapDecoder decoder;
+    beginSoapDecoder(&decoder, response);
+    *isKeepAlive = false;
+
+    // status line and headers
+    while (true) {
+        int c = readByteWithTimeout(&lastByteTime);
+        if (c < 0) {
+            return -1;
+        }
+        if (c != '\n') {
+            if (c != '\r' && lineLength < HTTP_HEADER_LINE_MAX_SIZE - 1) {
+                line[lineLength++] = (char) c;
+            }
+            continue;
+        }
+        line[lineLength] = '\0';
+        if (status < 0) {
+            // e.g. "HTTP/1.1 200 OK", HTTP/1.1 connections are persistent unless told otherwise
+            const char *space = strchr(line, ' ');
+            if (strncmp_P(line, PSTR("HTTP/"), 5) != 0 || space == NULL) {
+                return -1;
+            }
+            status = atoi(space + 1);
+            response->httpStatus = status;
+            *isKeepAlive = strncmp_P(line, PSTR("HTTP/1.1"), 8) == 0;
+        } else if (lineLength == 0) {
+            break;  // end of headers
+        } else if (strncasecmp_P(line, PSTR("content-length:"), 15) == 0) {
+            contentLength = atol(line + 15);
+        } else if (strncasecmp_P(line, PSTR("transfer-encoding:"), 18) == 0) {
+            isChunked = strstr(line + 18, "chunked") != NULL;
+        } else if (strncasecmp_P(line, PSTR("connection:"), 11) == 0) {
+            for (char *c = line + 11; *c != '\0'; c++) {
+                *c = tolower((unsigned char) *c);  // the tokens of the header are case-insensitive
+            }
+            *isKeepAlive = strstr(line + 11, "keep-alive") != NULL;
+        }
+        lineLength = 0;
+    }
+
+    // body
+    if (isChunked) {
+        while (true) {
+            lineLength = 0;
+            int c;
+            while ((c = readByteWithTimeout(&lastByteTime)) != '\n') {
+                if (c < 0) {
+                    return -1;
+                }
+                if (lineLength < HTTP_HEADER_LINE_MAX_SIZE - 1) {
+                    line[lineLength++] = (char) c;
                 }
-                rule_ptr->internalAddr.fromString(newInternalClient);
-                rule_ptr->internalPort = getTagContent(line, "NewInternalPort").toInt();
-                rule_ptr->externalPort = getTagContent(line, "NewExternalPort").toInt();
-                rule_ptr->protocol = getTagContent(line, "NewProtocol");
-                rule_ptr->leaseDuration = getTagContent(line, "NewLeaseDuration").toInt();
-                        
-                upnpRuleNode *currRuleNode_ptr = new upnpRuleNode();
-                currRuleNode_ptr->upnpRule = rule_ptr;
-                currRuleNode_ptr->next = NULL;
-                if (ruleNodeHead_ptr == NULL) {
-                    ruleNodeHead_ptr = currRuleNode_ptr;
-                    ruleNodeTail_ptr = currRuleNode_ptr;
-                } else {
-                    ruleNodeTail_ptr->next = currRuleNode_ptr;
-                    ruleNodeTail_ptr = currRuleNode_ptr;
+            }
+            line[lineLength] = '\0';
+            long chunkLength = strtol(line, NULL, 16);
+            if (chunkLength <= 0) {
+                // skip the trailer
+                do {
+                    lineLength = 0;
+                    while ((c = readByteWithTimeout(&lastByteTime)) != '\n') {
+                        if (c < 0) {
+                            return status;  // the body is complete anyway
+                        }
+                        if (c != '\r') {
+                            lineLength++;
+                        }
+                    }
+                } while (lineLength > 0);
+                return status;
+            }
+            for (long i = 0; i < chunkLength + 2; i++) {  // including the CRLF after the chunk
+                c = readByteWithTimeout(&lastByteTime);
+                if (c < 0) {
+                    return -1;
+                }
+                if (i < chunkLength) {
+                    decodeSoapByte(&decoder, (char) c);
                 }
             }
         }
-        
-        index++;
-        delay(250);
     }
-    
-    // print nicely and free heap memory
-    debugPrintln(F("IGD current port mappings:"));
-    upnpRuleNode *curr_ptr = ruleNodeHead_ptr;
-    upnpRuleNode *del_prt = ruleNodeHead_ptr;
-    while (curr_ptr != NULL) {
-        upnpRuleToString(curr_ptr->upnpRule);
-        del_prt = curr_ptr;
-        curr_ptr = curr_ptr->next;
-        delete del_prt->upnpRule;
-        delete del_prt;
+
+    if (contentLength < 0) {
+        // the body ends with the connection
+        *isKeepAlive = false;
+        int c;
+        while ((c = readByteWithTimeout(&lastByteTime)) >= 0) {
+            decodeSoapByte(&decoder, (char) c);
+        }
+        return status;
     }
-    
-    debugPrintln("");  // \n
 
-    _wifiClient.stop();
-    
+    for (long i = 0; i < contentLength; i++) {
+        int c = readByteWithTimeout(&lastByteTime);
+        if (c < 0) {
+            return -1;
+        }
+        decodeSoapByte(&decoder, (char) c);
+    }
+    return status;
+}
+
+// waits until the rate limit allows another SOAP action, false if the deadline of the operation expired first
+boolean TinyUPnP::acquireActionToken() {
+    if (_rateLimitPerSecond == 0) {
+        return true;
+    }
+    unsigned long maxTokens = (unsigned long) _rateLimitBurst * 1000UL;
+    while (true) {
+        unsigned long now = millis();
+        unsigned long elapsedMs = now - _rateLimitRefillTime;
+        _rateLimitRefillTime = now;
+        if (elapsedMs >= maxTokens / _rateLimitPerSecond) {
+            _rateLimitTokens = maxTokens;  // also keeps elapsedMs * _rateLimitPerSecond from overflowing
+        } else {
+            _rateLimitTokens += elapsedMs * _rateLimitPerSecond;
+            if (_rateLimitTokens > maxTokens) {
+                _rateLimitTokens = maxTokens;
+            }
+        }
+        if (_rateLimitTokens >= 1000) {
+            _rateLimitTokens -= 1000;
+            return true;
+        }
+        if (_deadline.isExpired()) {
+            debugPrintln(F("Timeout expired while waiting for the rate limit"));
+            _isRateLimitExceeded = true;
+            return false;
+        }
+        _deadline.sleep((1000 - _rateLimitTokens + _rateLimitPerSecond - 1) / _rateLimitPerSecond);
+    }
+}
+
+// waits for the first byte of a response without spinning, false if the deadline expired or the connection was closed
+boolean TinyUPnP::waitForResponse(const UPnPDeadline &deadline) {
+    while (_client->available() == 0) {
+        if (deadline.isExpired() || !_client->connected()) {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+// -1 if the connection was closed, if no byte arrived for TCP_CONNECTION_TIMEOUT_MS or if the deadline of the operation expired
+int TinyUPnP::readByteWithTimeout(unsigned long *lastByteTime) {
+    while (_client->available() == 0) {
+        if (!_client->connected() || millis() - *lastByteTime > TCP_CONNECTION_TIMEOUT_MS || _deadline.isExpired()) {
+            return -1;
+        }
+        delay(1);
+    }
+    *lastByteTime = millis();
+    return _client->read();
+}
+
+// fills rule_ptr from a GetGenericPortMappingEntry response, false if it has no entry
+boolean TinyUPnP::parsePortMappingEntry(const soapResponse *response, int index, upnpRule *rule_ptr) {
+    if (response->internalClient[0] == '\0') {
+        return false;
+    }
+    rule_ptr->index = index;
+    rule_ptr->devFriendlyName = response->description;
+    rule_ptr->internalAddr = ipNull;
+    parseIPAddress(response->internalClient, strlen(response->internalClient), &rule_ptr->internalAddr);
+    rule_ptr->internalPort = response->internalPort;
+    rule_ptr->externalPort = response->externalPort;
+    rule_ptr->protocol = response->protocol;
+    rule_ptr->leaseDuration = response->leaseDuration > 0 ? response->leaseDuration : 0;
+    rule_ptr->grantedLeaseDuration = 0;
+    rule_ptr->isDirty = false;
+    rule_ptr->isRemoved = false;
+    rule_ptr->lastCommitTime = 0;
+    rule_ptr->isMapped = false;
     return true;
 }
 
@@ -1196,7 +3785,9 @@ void TinyUPnP::printPortMappingConfig() {
     debugPrintln(F("TinyUPnP configured port mappings:"));
     upnpRuleNode *currRuleNode = _headRuleNode;
     while (currRuleNode != NULL) {
-        upnpRuleToString(currRuleNode->upnpRule);
+        if (!currRuleNode->upnpRule->isRemoved) {
+            upnpRuleToString(currRuleNode->upnpRule);
+        }
         currRuleNode = currRuleNode->next;
     }
 
@@ -1253,6 +3844,20 @@ void TinyUPnP::ssdpDeviceToString(ssdpDevice* ssdpDevice) {
     debugPrint(String(ssdpDevice->port));
     debugPrint(F("] path ["));
     debugPrint(ssdpDevice->path);
+    debugPrint(F("] usn ["));
+    debugPrint(ssdpDevice->usn);
+    debugPrint(F("] server ["));
+    debugPrint(ssdpDevice->server);
+    if (ssdpDevice->friendlyName.length() > 0) {
+        debugPrint(F("] friendlyName ["));
+        debugPrint(ssdpDevice->friendlyName);
+        debugPrint(F("] manufacturer ["));
+        debugPrint(ssdpDevice->manufacturer);
+        debugPrint(F("] modelName ["));
+        debugPrint(ssdpDevice->modelName);
+        debugPrint(F("] deviceType ["));
+        debugPrint(ssdpDevice->deviceType);
+    }
     debugPrintln(F("]"));
 }
 
@@ -1275,85 +3880,150 @@ char* TinyUPnP::ipAddressToCharArr(IPAddress ipAddress) {
     return s;
 }*/
 
-IPAddress TinyUPnP::getHost(String url) {
-    IPAddress result(0,0,0,0);
-    if (url.indexOf(F("https://")) != -1) {
-        url.replace("https://", "");
-    }
-    if (url.indexOf(F("http://")) != -1) {
-        url.replace("http://", "");
-    }
-    int endIndex = url.indexOf('/');
-    if (endIndex != -1) {
-        url = url.substring(0, endIndex);
-    }
-    int colonsIndex = url.indexOf(':');
-    if (colonsIndex != -1) {
-        url = url.substring(0, colonsIndex);
+// single pass over url, the parts point into url so nothing is copied or allocated
+// e.g. "http://192.168.1.1:5000/rootDesc.xml" yields scheme "http", host "192.168.1.1", port 5000 and path "/rootDesc.xml"
+// relative URLs (no scheme) such as "/ctl/IPConn" only fill the path, in which case the port is 0
+boolean TinyUPnP::parseUrl(const char *url, int length, urlParts *parts) {
+    const char *end = url + length;
+    while (url < end && isspace((unsigned char) *url)) {
+        url++;
+    }
+    while (end > url && isspace((unsigned char) *(end - 1))) {
+        end--;
+    }
+
+    parts->scheme = url;
+    parts->schemeLength = 0;
+    parts->host = url;
+    parts->hostLength = 0;
+    parts->port = 0;
+
+    const char *p = url;
+    while (p < end && isalpha((unsigned char) *p)) {
+        p++;
+    }
+    if (p > url && end - p >= 3 && p[0] == ':' && p[1] == '/' && p[2] == '/') {
+        parts->schemeLength = p - url;
+        p += 3;
+        parts->host = p;
+        while (p < end && *p != ':' && *p != '/') {
+            p++;
+        }
+        parts->hostLength = p - parts->host;
+        if (parts->hostLength == 0) {
+            return false;
+        }
+        if (p < end && *p == ':') {
+            const char *portStart = ++p;
+            long port = 0;
+            while (p < end && isdigit((unsigned char) *p)) {
+                port = port * 10 + (*p - '0');
+                if (port > 65535) {
+                    return false;
+                }
+                p++;
+            }
+            if (p == portStart || port == 0 || (p < end && *p != '/')) {
+                return false;
+            }
+            parts->port = port;
+        } else if (parts->schemeLength == 5 && strncasecmp(parts->scheme, "https", 5) == 0) {
+            parts->port = 443;
+        } else {
+            parts->port = 80;
+        }
+    } else {
+        p = url;  // relative URL
     }
-    result.fromString(url);
-    return result;
+
+    parts->path = p;
+    parts->pathLength = end - p;
+    return true;
 }
 
-int TinyUPnP::getPort(String url) {
-    int port = -1;
-    if (url.indexOf(F("https://")) != -1) {
-        url.replace("https://", "");
-    }
-    if (url.indexOf(F("http://")) != -1) {
-        url.replace("http://", "");
-    }
-    int portEndIndex = url.indexOf("/");
-    if (portEndIndex == -1) {
-        portEndIndex = url.length();
-    }
-    url = url.substring(0, portEndIndex);
-    int colonsIndex = url.indexOf(":");
-    if (colonsIndex != -1) {
-        url = url.substring(colonsIndex + 1, portEndIndex);
-        port = url.toInt();
-    } else {
-        port = 80;
+// compares the addresses as numbers, e.g. 192.168.1.9 is lower than 192.168.1.10
+boolean TinyUPnP::isIPAddressLower(IPAddress a, IPAddress b) {
+    for (int i = 0; i < 4; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i];
+        }
     }
-    return port;
+    return false;
 }
 
-String TinyUPnP::getPath(String url) {
-    if (url.indexOf(F("https://")) != -1) {
-        url.replace("https://", "");
+// dotted decimal IPv4 parser working on a view, returns false for host names
+boolean TinyUPnP::parseIPAddress(const char *str, int length, IPAddress *ip) {
+    const char *end = str + length;
+    IPAddress result(0, 0, 0, 0);
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            if (str >= end || *str != '.') {
+                return false;
+            }
+            str++;
+        }
+        const char *octetStart = str;
+        int octet = 0;
+        while (str < end && isdigit((unsigned char) *str) && str - octetStart < 3) {
+            octet = octet * 10 + (*str - '0');
+            str++;
+        }
+        if (str == octetStart || octet > 255) {
+            return false;
+        }
+        result[i] = octet;
     }
-    if (url.indexOf(F("http://")) != -1) {
-        url.replace("http://", "");
+    if (str != end) {
+        return false;
     }
-    int firstSlashIndex = url.indexOf("/");
-    if (firstSlashIndex == -1) {
-        debugPrint(F("ERROR: Cannot find path in url ["));
-        debugPrint(url);
-        debugPrintln(F("]"));
-        return "";
+    *ip = result;
+    return true;
+}
+
+String TinyUPnP::urlPartToString(const char *str, int length) {
+    String result;
+    result.reserve(length);
+    for (int i = 0; i < length; i++) {
+        result += str[i];
     }
-    return url.substring(firstSlashIndex, url.length());
+    return result;
 }
 
-String TinyUPnP::getTagContent(const String &line, String tagName) {
-    int startIndex = line.indexOf("<" + tagName + ">");
-    if (startIndex == -1) {
+String TinyUPnP::getTagContent(const String &line, const char *tagName, int fromIndex) {
+    // "<tagName>" and "</tagName>" are built on the stack rather than as Strings
+    char startTag[XML_TAG_MAX_SIZE];
+    char endTag[XML_TAG_MAX_SIZE];
+    size_t tagNameLength = strlen_P(tagName);
+    if (tagNameLength + 4 > sizeof(endTag) || fromIndex < 0 || (unsigned int) fromIndex > line.length()) {
+        return "";
+    }
+    startTag[0] = '<';
+    memcpy_P(startTag + 1, tagName, tagNameLength);
+    startTag[tagNameLength + 1] = '>';
+    startTag[tagNameLength + 2] = '\0';
+    endTag[0] = '<';
+    endTag[1] = '/';
+    strcpy(endTag + 2, startTag + 1);
+
+    const char *str = line.c_str();
+    const char *start = strstr(str + fromIndex, startTag);
+    if (start == NULL) {
         debugPrint(F("ERROR: Cannot find tag content in line ["));
         debugPrint(line);
-        debugPrint(F("] for start tag [<"));
-        debugPrint(tagName);
-        debugPrintln(F(">]"));
+        debugPrint(F("] for start tag ["));
+        debugPrint(startTag);
+        debugPrintln(F("]"));
         return "";
     }
-    startIndex += tagName.length() + 2;
-    int endIndex = line.indexOf("</" + tagName + ">", startIndex);
-    if (endIndex == -1) {
+    start += tagNameLength + 2;
+    const char *end = strstr(start, endTag);
+    if (end == NULL) {
         debugPrint(F("ERROR: Cannot find tag content in line ["));
         debugPrint(line);
-        debugPrint(F("] for end tag [</"));
-        debugPrint(tagName);
-        debugPrintln(F(">]"));
+        debugPrint(F("] for end tag ["));
+        debugPrint(endTag);
+        debugPrintln(F("]"));
         return "";
     }
-    return line.substring(startIndex, endIndex);
+    return line.substring(start - str, end - str);
 }
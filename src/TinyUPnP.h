@@ -8,15 +8,21 @@
 #define TinyUPnP_h
 
 #include <Arduino.h>
+#if defined(ESP8266)
+    #include <ESP8266WiFi.h>
+#else
+    #include <WiFi.h>
+#endif
 #include <WiFiUdp.h>
 #include <WiFiClient.h>
 #include <limits.h>
+#include <new>
+#include "TinyUPnPAllocator.h"
 
 //#define UPNP_DEBUG // uncomment to enable debug and TinyUPnP::print<...>() outputs
 #define UPNP_SSDP_PORT 1900
 #define TCP_CONNECTION_TIMEOUT_MS 6000
-#define PORT_MAPPING_INVALID_INDEX "<errorDescription>SpecifiedArrayIndexInvalid</errorDescription>"
-#define PORT_MAPPING_INVALID_ACTION "<errorDescription>Invalid Action</errorDescription>"
+#define UPNP_RULE_INVALID_HANDLE -1
 
 static const char * const deviceListUpnp[] = {
     "urn:schemas-upnp-org:device:InternetGatewayDevice:1",
@@ -33,42 +39,121 @@ static const char * const deviceListSsdpAll[] = {
     0
 };
 
+// fleet mode, the instances behind a router announce themselves with this NT, see TinyUPnP::setFleetMode
+static const char * const deviceListFleet[] = {
+    "urn:schemas-tinyupnp-org:service:Fleet:1",
+    0
+};
+
 #define RULE_PROTOCOL_TCP "TCP"
 #define RULE_PROTOCOL_UDP "UDP"
 
 #define MAX_NUM_OF_UPDATES_WITH_NO_EFFECT 6  // after 6 tries of updatePortMappings we will execute the more extensive addPortMapping
+#define MAX_PORT_CONFLICT_ATTEMPTS 4  // max number of alternative external ports tried in a single commit
+#define MIN_DYNAMIC_EXTERNAL_PORT 1024  // lowest external port picked by CONFLICT_POLICY_HASH
+#define UPDATE_RETRY_BACKOFF_MIN_MS 5000  // first retry after a transient failure of updatePortMappings, doubled on each failure
+#define ROUTER_UPTIME_SLACK_S 30  // allowed drift [s] between the expected and the reported IGD uptime before assuming it rebooted
+#define EXTERNAL_IP_CHECK_INTERVAL_MS 3600000  // the fast path of updatePortMappings reads the external IP at least this often
+
+#define SSDP_DEFAULT_MAX_AGE_S 1800  // used when CACHE-CONTROL is missing, the minimum recommended by the UPnP spec
+#define MAX_SSDP_PACKETS_PER_POLL 8  // max number of SSDP packets handled on each call to processSsdpAnnouncements
+
+#define FLEET_ANNOUNCE_INTERVAL_MS 30000  // each member of the fleet announces itself this often, less a random jitter of up to a quarter
+#define FLEET_MEMBER_TIMEOUT_MS 100000  // a leader that was not heard of for this long is assumed gone
+#define FLEET_SEARCH_RESPONSE_MAX_MS 2000  // the members answer the M-SEARCH of a new member within a random delay (like MX)
+#define FLEET_UPDATE_JITTER_DIVISOR 8  // in fleet mode an update runs up to 1/8 of the interval early, so the members drift apart
+
+#define MAX_CONCURRENT_DESCRIPTION_FETCHES 4  // max number of TCP connections opened at once when fetching description XML files
+#define SSDP_GATEWAY_RESPONSE_WAIT_MS 3000  // wait for the gateway to answer M-SEARCH before probing descriptionLocationsIgd
 
 #define UPNP_UDP_TX_PACKET_MAX_SIZE 1000  // reduce max UDP packet size to conserve memory (by default UDP_TX_PACKET_MAX_SIZE=8192)
 #define UPNP_UDP_TX_RESPONSE_MAX_SIZE 8192
+#define UPNP_SOAP_BODY_MAX_SIZE 1200
+#define UPNP_OPERATION_ARENA_SIZE (2 * sizeof(ssdpDevice))  // the temporary objects of a public call, an ssdpDevice at most
+#define XML_TAG_MAX_SIZE 40  // "</" + the longest tag name getTagContent looks for + ">"
+#define UPNP_SERVICE_TYPE_TAG_MAX_SIZE 72  // "<serviceType>" + the longest entry of deviceListUpnp
+#define XML_LINE_RESERVE_SIZE 160  // initial capacity of the line Strings of a description fetch
+#define SOAP_VALUE_MAX_SIZE 64  // longer out-arguments (e.g. NewPortMappingDescription) are truncated
+#define HTTP_HEADER_LINE_MAX_SIZE 64  // longer header lines are truncated, only the framing headers are of interest
+#define MAX_PIPELINED_SOAP_REQUESTS 4  // max number of GetGenericPortMappingEntry requests in flight on a keep-alive connection
 
 const String UPNP_SERVICE_TYPE_TAG_NAME = "serviceType";
 const String UPNP_SERVICE_TYPE_TAG_START = "<serviceType>";
 const String UPNP_SERVICE_TYPE_TAG_END = "</serviceType>";
 
-// TODO: idealy the SOAP actions should be verified as supported by the IGD before they are used
-// 		 a struct can be created for each action and filled when the XML descriptor file is read
-/*const String SOAPActions [] = {
-    "AddPortMapping",
-    "GetSpecificPortMappingEntry",
-    "DeletePortMapping",
-    "GetGenericPortMappingEntry",
-    "GetExternalIPAddress"
-};*/
+// UPnP error codes returned by the IGD in a SOAP fault, see TinyUPnP::classifySoapError
+#define UPNP_ERROR_INVALID_ACTION 401
+#define UPNP_ERROR_INVALID_ARGS 402
+#define UPNP_ERROR_ACTION_FAILED 501
+#define UPNP_ERROR_OPTIONAL_ACTION_NOT_IMPLEMENTED 602
+#define UPNP_ERROR_ACTION_NOT_AUTHORIZED 606
+#define UPNP_ERROR_SPECIFIED_ARRAY_INDEX_INVALID 713
+#define UPNP_ERROR_NO_SUCH_ENTRY_IN_ARRAY 714
+#define UPNP_ERROR_CONFLICT_IN_MAPPING_ENTRY 718
+#define UPNP_ERROR_ONLY_PERMANENT_LEASES_SUPPORTED 725
 
-/*
-#define SOAP_ERROR_TAG "errorDescription";
-const String SOAPErrors [] = {
-    "SpecifiedArrayIndexInvalid",
-    "Invalid Action"
-};*/
+// PCP (RFC 6887) and NAT-PMP (RFC 6886), a single datagram to the gateway per port mapping
+#define PCP_SERVER_PORT 5351
+#define PCP_CLIENT_PORT 0  // any free local port
+#define PCP_INITIAL_TIMEOUT_MS 250  // doubled on each retransmission
+#define PCP_MAX_ATTEMPTS 3  // a gateway that did not answer within 1.75s is assumed to speak neither
+#define PCP_DEFAULT_LIFETIME_S 7200  // requested for rules with a lease duration of 0, there are no permanent mappings
+#define PCP_VERSION 2
+#define PCP_OPCODE_ANNOUNCE 0
+#define PCP_OPCODE_MAP 1
+#define PCP_OPTION_THIRD_PARTY 1
+#define PCP_HEADER_SIZE 24
+#define PCP_MAP_SIZE 36
+#define PCP_NONCE_SIZE 12
+#define PCP_RESULT_SUCCESS 0
+#define PCP_RESULT_UNSUPP_VERSION 1
+#define PCP_RESULT_NOT_AUTHORIZED 2
+#define PCP_RESULT_UNSUPP_OPCODE 4
+#define PCP_RESULT_UNSUPP_OPTION 5
+#define PCP_RESULT_NETWORK_FAILURE 7
+#define PCP_RESULT_NO_RESOURCES 8
+#define PCP_RESULT_UNSUPP_PROTOCOL 9
+#define PCP_RESULT_CANNOT_PROVIDE_EXTERNAL 11
+#define NAT_PMP_VERSION 0
+#define NAT_PMP_OPCODE_EXTERNAL_ADDRESS 0
+#define NAT_PMP_OPCODE_MAP_UDP 1
+#define NAT_PMP_OPCODE_MAP_TCP 2
+#define NAT_PMP_HEADER_SIZE 8
+#define NAT_PMP_MAP_REQUEST_SIZE 12
+#define NAT_PMP_MAP_RESPONSE_SIZE 16
+#define NAT_PMP_EXTERNAL_ADDRESS_RESPONSE_SIZE 12
+#define NAT_PMP_RESULT_UNSUPPORTED_VERSION 1
+#define NAT_PMP_RESULT_NOT_AUTHORIZED 2
+#define NAT_PMP_RESULT_NETWORK_FAILURE 3
+#define NAT_PMP_RESULT_OUT_OF_RESOURCES 4
+#define NAT_PMP_RESULT_UNSUPPORTED_OPCODE 5
 
-/*
+// the outcome of a SOAP action (or of a PCP / NAT-PMP request), each fault class has its own retry policy
 enum soapActionResult {
-// TODO
-}*/
+    SOAP_RESULT_SUCCESS,
+    SOAP_RESULT_NETWORK_ERROR,  // no response from the IGD, transient so it is retried with backoff
+    SOAP_RESULT_NO_SUCH_ENTRY,  // 713, 714 - the port mapping does not exist
+    SOAP_RESULT_CONFLICT,  // 718 - the external port is mapped to another host, see portConflictPolicy
+    SOAP_RESULT_ONLY_PERMANENT_LEASES,  // 725 - retried at once with a lease duration of 0
+    SOAP_RESULT_NOT_AUTHORIZED,  // 606 - never retried, the IGD does not allow changes (e.g. UPnP is read only)
+    SOAP_RESULT_NOT_SUPPORTED,  // 401, 602 or missing from the SCPD - never retried
+    SOAP_RESULT_FAILED  // any other fault (e.g. 402, 501), not retried before the next update
+};
+
+// the SOAP actions used by the library, the id is the bit of the action in gatewayInfo::supportedActions
+enum soapActionId {
+    SOAP_ACTION_ADD_PORT_MAPPING,
+    SOAP_ACTION_GET_SPECIFIC_PORT_MAPPING_ENTRY,
+    SOAP_ACTION_DELETE_PORT_MAPPING,
+    SOAP_ACTION_GET_GENERIC_PORT_MAPPING_ENTRY,
+    SOAP_ACTION_GET_EXTERNAL_IP_ADDRESS,
+    SOAP_ACTION_GET_STATUS_INFO,
+    SOAP_ACTION_ADD_ANY_PORT_MAPPING
+};
 
 typedef struct _SOAPAction {
     const char *name;
+    soapActionId id;
 } SOAPAction;
 
 typedef void (*callback_function)(void);
@@ -83,6 +168,9 @@ typedef struct _gatewayInfo {
     int actionPort;  // this port is used when performing SOAP API actions
     String actionPath;  // this is the path used to perform SOAP API actions
     String serviceTypeName;  // i.e "WANPPPConnection:1" or "WANIPConnection:1"
+    int scpdPort;  // the SCPD may be served on another port than the actions if its URL is absolute
+    String scpdPath;  // path of the service description (SCPD) which lists the supported actions
+    uint16_t supportedActions;  // bit per soapActionId as read from the SCPD, 0 if unknown (all actions are assumed supported)
 } gatewayInfo;
 
 typedef struct _upnpRule {
@@ -93,17 +181,95 @@ typedef struct _upnpRule {
     int externalPort;
     String protocol;
     int leaseDuration;
+    boolean isDirty;  // changed since it was last committed to the IGD
+    boolean isRemoved;  // removed by the application, will be deleted from the IGD (and freed) on the next commit
+    unsigned long lastCommitTime;  // millis() when the rule was last verified or added in the IGD, 0 if never
+    boolean isMapped;  // the current values were verified or added in the IGD, a rule that never was is deleted from nowhere
+    int grantedLeaseDuration;  // [s] the lifetime granted by a PCP or NAT-PMP gateway (may be shorter), 0 for UPnP IGD
 } upnpRule;
 
+typedef boolean (*port_mapping_callback)(upnpRule *entry, void *arg);  // return false to stop the enumeration
+
 typedef struct _upnpRuleNode {
     _upnpRule *upnpRule;
     _upnpRuleNode *next;
 } upnpRuleNode;
 
+// views into a URL string, see TinyUPnP::parseUrl
+typedef struct _urlParts {
+    const char *scheme;
+    int schemeLength;
+    const char *host;
+    int hostLength;
+    int port;  // 0 for relative URLs
+    const char *path;
+    int pathLength;
+} urlParts;
+
+// headers of an SSDP response to M-SEARCH or of a NOTIFY announcement, see TinyUPnP::parseSsdpResponse
+// the values point into the received datagram and are NULL if the header is missing
+typedef struct _ssdpResponse {
+    boolean isNotify;
+    const char *location;
+    int locationLength;
+    const char *st;  // ST of a response or NT of a NOTIFY
+    int stLength;
+    const char *usn;
+    int usnLength;
+    const char *server;
+    int serverLength;
+    const char *nts;  // NOTIFY only, e.g. "ssdp:alive" or "ssdp:byebye"
+    int ntsLength;
+    long maxAge;  // from CACHE-CONTROL, -1 if missing
+    long bootId;  // from BOOTID.UPNP.ORG, -1 if missing
+    boolean isSearch;  // an M-SEARCH of another control point (e.g. a new member of the fleet)
+    const char *fleetState;  // X-TINYUPNP-FLEET, the state of the IGD as checked by the leader of the fleet
+    int fleetStateLength;
+} ssdpResponse;
+
+// the out-arguments of a SOAP response, see TinyUPnP::readHttpResponse
+// texts are empty and numbers are -1 if the response did not include them
+typedef struct _soapResponse {
+    int httpStatus;
+    int errorCode;  // UPnP error code of a SOAP fault, 0 if none
+    boolean isActionResponse;  // an element named <action>Response was found
+    char internalClient[16];  // NewInternalClient
+    char externalIPAddress[16];  // NewExternalIPAddress
+    char protocol[4];  // NewProtocol
+    char connectionStatus[16];  // NewConnectionStatus
+    char description[SOAP_VALUE_MAX_SIZE];  // NewPortMappingDescription
+    long internalPort;  // NewInternalPort
+    long externalPort;  // NewExternalPort
+    long leaseDuration;  // NewLeaseDuration
+    long reservedPort;  // NewReservedPort of AddAnyPortMapping
+    long uptime;  // NewUptime
+} soapResponse;
+
+// state of the single pass over a SOAP body, see TinyUPnP::decodeSoapByte
+typedef struct _soapDecoder {
+    soapResponse *response;
+    uint8_t state;
+    boolean isEndTag;
+    char name[48];  // local name (without the namespace prefix) of the tag being read
+    int nameLength;
+    char element[48];  // the last start tag, its text is kept until the matching end tag
+    char text[SOAP_VALUE_MAX_SIZE];
+    int textLength;
+} soapDecoder;
+
 typedef struct _ssdpDevice {
     IPAddress host;
     int port;  // this port is used when getting router capabilities and xml files
     String path;  // this is the path that is used to retrieve router information from xml files
+    String usn;  // unique device name, i.e. "uuid:<device-UUID>"
+    String server;
+    long maxAge;  // [s] the device is removed from the cache if it does not refresh its announcement in time
+    unsigned long lastSeenTime;
+    // filled from the description XML of the device by enrichSsdpDevices
+    String deviceType;  // e.g. "urn:schemas-upnp-org:device:InternetGatewayDevice:1"
+    String friendlyName;
+    String manufacturer;
+    String modelName;
 } ssdpDevice;
 
 typedef struct _ssdpDeviceNode {
@@ -111,6 +277,33 @@ typedef struct _ssdpDeviceNode {
     _ssdpDeviceNode *next;
 } ssdpDeviceNode;
 
+typedef boolean (*ssdp_device_callback)(ssdpDevice *device, void *arg);  // return false to stop the discovery
+
+// a single HTTP GET of a description XML, see TinyUPnP::fetchDescriptions
+typedef struct _descriptionFetch {
+    IPAddress host;
+    int port;
+    String path;
+    void *context;  // passed back to the line callback
+} descriptionFetch;
+
+// a location where IGDs commonly serve their description XML, probed when the gateway does not answer M-SEARCH
+typedef struct _descriptionLocation {
+    int port;
+    const char *path;
+} descriptionLocation;
+
+static const descriptionLocation descriptionLocationsIgd[] = {
+    {5000, "/rootDesc.xml"},  // miniupnpd
+    {1900, "/igd.xml"},
+    {49000, "/igddesc.xml"},
+    {49152, "/description.xml"},
+    {52869, "/picsdesc.xml"},
+    {0, 0}
+};
+
+typedef boolean (*description_line_callback)(descriptionFetch *fetch, const String &line, void *arg);  // return false once done with the fetch
+
 enum portMappingResult {
     UNKNOWN,
     SUCCESS,  // port mapping was added
@@ -119,13 +312,74 @@ enum portMappingResult {
     NETWORK_ERROR,
     TIMEOUT,
     VERIFICATION_FAILED,
-    NOP  // the check is delayed
+    NOP,  // the check is delayed
+    PORT_CONFLICT,  // the external port is mapped to another host and the conflict policy could not resolve it
+    ACTION_REJECTED  // the IGD refused the port mapping for a reason retrying will not fix (e.g. not authorized)
+};
+
+// the protocol used to create the port mappings in the gateway, see TinyUPnP::setNatProtocol
+enum natProtocol {
+    NAT_PROTOCOL_AUTO,  // PCP, then NAT-PMP, then UPnP IGD, whichever the gateway supports
+    NAT_PROTOCOL_UPNP_IGD,
+    NAT_PROTOCOL_PCP,
+    NAT_PROTOCOL_NAT_PMP
+};
+
+// what to do when AddPortMapping fails since the external port is already mapped to another host (ConflictInMappingEntry)
+enum portConflictPolicy {
+    CONFLICT_POLICY_NONE,  // give up, commitPortMappings returns PORT_CONFLICT
+    CONFLICT_POLICY_RANGE,  // try other external ports out of a configured range
+    CONFLICT_POLICY_HASH,  // try external ports derived from a hash of the device and the rule
+    CONFLICT_POLICY_ANY_PORT  // let the IGD pick a free external port using AddAnyPortMapping (IGDv2 only)
+};
+
+// the point in time an operation (or a single phase of it) must end by
+// compared by the elapsed time rather than by an absolute millis() so it is not affected by the wraparound every ~49.7 days
+class UPnPDeadline
+{
+    public:
+        UPnPDeadline() {  // never expires
+            _startTime = millis();
+            _durationMs = 0;
+            _isUnlimited = true;
+        }
+        UPnPDeadline(unsigned long durationMs) {
+            _startTime = millis();
+            _durationMs = durationMs;
+            _isUnlimited = false;
+        }
+        boolean isExpired() const {
+            return !_isUnlimited && millis() - _startTime >= _durationMs;
+        }
+        unsigned long getRemainingMs() const {  // ULONG_MAX if unlimited
+            if (_isUnlimited) {
+                return ULONG_MAX;
+            }
+            unsigned long elapsedMs = millis() - _startTime;
+            return elapsedMs < _durationMs ? _durationMs - elapsedMs : 0;
+        }
+        // a deadline for a single phase (e.g. waiting for a TCP response) that never ends after this one
+        UPnPDeadline getPhaseDeadline(unsigned long durationMs) const {
+            unsigned long remainingMs = getRemainingMs();
+            return UPnPDeadline(durationMs < remainingMs ? durationMs : remainingMs);
+        }
+        // delay() that returns early once the deadline expired, delay() lets the other tasks (and the WiFi stack) run
+        void sleep(unsigned long ms) const {
+            unsigned long remainingMs = getRemainingMs();
+            delay(ms < remainingMs ? ms : remainingMs);
+        }
+    private:
+        unsigned long _startTime;
+        unsigned long _durationMs;
+        boolean _isUnlimited;
 };
 
 class TinyUPnP
 {
     public:
         TinyUPnP(unsigned long timeoutMs);
+        // client - the TCP transport to the IGD (e.g. an EthernetClient, or UPnPReplayClient to replay a captured router)
+        TinyUPnP(unsigned long timeoutMs, Client *client);
         ~TinyUPnP();
         // when the ruleIP is set to the current device IP, the IP of the rule will change if the device changes its IP
         // this makes sure the traffic will be directed to the device even if the IP chnages
@@ -133,43 +387,269 @@ class TinyUPnP
         void addPortMappingConfig(IPAddress ruleIP /* can be NULL */, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName);
         portMappingResult commitPortMappings();
         portMappingResult updatePortMappings(unsigned long intervalMs, callback_function fallback = NULL /* optional */);
+        // next-deadline polling - rather than calling updatePortMappings on every iteration, sleep for getNextTimeoutMs
+        // and then call onTimer, which blocks like updatePortMappings (there are no socket hooks)
+        void setUpdateInterval(unsigned long intervalMs, callback_function fallback = NULL /* optional */);
+        unsigned long getNextTimeoutMs();  // ULONG_MAX if no update is scheduled
+        portMappingResult onTimer();
         boolean printAllPortMappings();
+        // snapshot of the port mapping table of the IGD, returns the number of entries or -1 on error
+        int getPortMappings(upnpRule *entries, int maxEntries);
+        int enumeratePortMappings(port_mapping_callback callback, void *arg = NULL);
         void printPortMappingConfig();  // prints all the port mappings that were added using `addPortMappingConfig`
-        boolean testConnectivity(unsigned long startTime = 0);
+        boolean testConnectivity();  // bound by the timeout of the instance
+        IPAddress getExternalIP();  // the external IP of the IGD as cached by the last commit or update (0.0.0.0 if unknown)
+        IPAddress queryExternalIP();  // asks the IGD (discovering it if needed) and updates the cache, 0.0.0.0 on error
+        // runtime changes to the port mappings, only the changed rules are sent to the IGD on the next commit
+        // the handle of a rule is its index, rules added by addPortMappingConfig get handles 0, 1, 2...
+        // the newest rule for an external port and protocol wins, the handle of an older one becomes invalid
+        int addRule(IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName);
+        boolean updateRule(int ruleHandle, IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, String ruleProtocol, int ruleLeaseDuration, String ruleFriendlyName);
+        boolean removeRule(int ruleHandle);
+        boolean hasRules();  // false once every rule was removed and deleted from the IGD
+        void setPortConflictPolicy(portConflictPolicy policy, int minPort = 0, int maxPort = 0);
+        // the description locations probed on the gateway when it does not answer M-SEARCH (e.g. multicast is filtered)
+        // terminated by an entry with a NULL path, NULL disables probing, descriptionLocationsIgd by default
+        void setDescriptionLocations(const descriptionLocation *locations);
+        int getExternalPort(int ruleHandle);  // the external port actually assigned, see setPortConflictPolicy
+        // NAT_PROTOCOL_UPNP_IGD by default, NAT_PROTOCOL_AUTO is opt-in since a gateway that does not answer PCP delays
+        // the first commit by almost 2 seconds, the gateway is probed again after a change
+        void setNatProtocol(natProtocol protocol);
+        natProtocol getNatProtocol();  // the protocol the gateway was found to support, NAT_PROTOCOL_AUTO if not known yet
+        // the PCP nonce proves to the gateway that a mapping belongs to this device, it is random (from the hardware RNG)
+        // and made on first use, an application that wants to renew or delete its mappings after a reboot stores it
+        // (e.g. in NVS or EEPROM) and restores it with setPcpNonce before the first commit
+        void getPcpNonce(uint8_t nonce[PCP_NONCE_SIZE]);
+        void setPcpNonce(const uint8_t nonce[PCP_NONCE_SIZE]);
+        // at most actionsPerSecond SOAP actions are sent to the IGD, after a burst of up to burst actions (token bucket)
+        // actions wait for their turn within the timeout of the call, 0 disables the limit (default)
+        void setRateLimit(unsigned int actionsPerSecond, unsigned int burst = 1);
+        // fleet mode - the instances behind the same router announce themselves over SSDP and elect the one with the lowest
+        // local IP as the leader, only the leader queries the state of the IGD on updates and shares it with the others
+        // which then only send the actions for their own rules, processSsdpAnnouncements must be called from the loop
+        // the announcements are not authenticated, the LAN is trusted: a host that claims a lower IP is followed, though a
+        // follower whose own last check disagrees with the shared state verifies its rules rather than adopt it
+        void setFleetMode(boolean isEnabled);
+        boolean isFleetLeader();  // true if not in fleet mode, every instance checks the IGD by itself then
+        // the allocator of the rules and the SSDP device cache, UPnPHeapAllocator by default
+        // must be set before the first rule is added and outlive this instance
+        void setAllocator(UPnPAllocator *allocator);
+        // the allocator of the temporary objects of a public call, reset when the call returns, a UPnPArenaAllocator of
+        // UPNP_OPERATION_ARENA_SIZE bytes by default, cannot be changed during a call (e.g. from a callback)
+        void setOperationAllocator(UPnPAllocator *allocator);
+        upnpAllocationStats getAllocationStats();  // since the last resetAllocationStats
+        void resetAllocationStats();
+        upnpAllocationStats getLastCallAllocationStats();  // of the last public call (or the one in progress)
         /* API extensions - additional methods to the UPnP API */
-        ssdpDeviceNode* listSsdpDevices();  // will create an object with all SSDP devices on the network
+        ssdpDeviceNode* listSsdpDevices();  // all SSDP devices on the network, owned by TinyUPnP (do not free)
+        // returns 0 at once if neither the timeout of the instance nor maxDevices is set, since nothing would end the discovery
+        int discoverSsdpDevices(ssdp_device_callback callback, void *arg = NULL, int maxDevices = 0 /* no limit */, const char *searchTarget = "ssdp:all");
+        void processSsdpAnnouncements();  // non blocking, call from the loop to keep the SSDP device cache up to date
+        int enrichSsdpDevices(ssdpDeviceNode* ssdpDeviceNode_head, int maxConcurrent = MAX_CONCURRENT_DESCRIPTION_FETCHES);  // fetches the description of each device
         void printSsdpDevices(ssdpDeviceNode* ssdpDeviceNode);  // will print all SSDP devices in teh list
     private:
-        boolean connectUDP();
-        void broadcastMSearch(bool isSsdpAll = false);
+        friend struct TinyUPnPTestAccess;  // the host tests in test/ reach the parsers through it
+        boolean connectUDP(boolean listenForAnnouncements = false);
+        void broadcastMSearch(const char * const * deviceList = deviceListUpnp);
+        void unicastMSearch(IPAddress gatewayIP, const char * const * deviceList = deviceListUpnp);
+        void buildMSearch(IPAddress destination, const char *searchTarget);
         ssdpDevice* waitForUnicastResponseToMSearch(IPAddress gatewayIP);
-        boolean getGatewayInfo(gatewayInfo *deviceInfo, long startTime);
+        boolean receiveSsdpResponse(IPAddress gatewayIP, ssdpResponse *response);
+        ssdpDevice* updateSsdpDeviceCache(ssdpResponse *response, unsigned long sinceTime = 0, boolean *isNew = NULL);
+        void removeExpiredSsdpDevices();
+        boolean isSsdpDeviceCacheStale();
+        int fetchDescriptions(descriptionFetch *fetches, int count, description_line_callback onLine, void *arg, int maxConcurrent);
+        boolean getGatewayInfo(gatewayInfo *deviceInfo);
+        boolean probeDescriptionLocations(gatewayInfo *deviceInfo, IPAddress gatewayIP);
         boolean isGatewayInfoValid(gatewayInfo *deviceInfo);
         void clearGatewayInfo(gatewayInfo *deviceInfo);
         boolean connectToIGD(IPAddress host, int port);
         boolean getIGDEventURLs(gatewayInfo *deviceInfo);
-        boolean addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
-        boolean verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
+        static boolean resolveUrlPath(const String &url, const String &basePath, String *path, int *port);
+        boolean getSupportedActions(gatewayInfo *deviceInfo);
+        boolean isActionSupported(gatewayInfo *deviceInfo, SOAPAction *soapAction);
+        boolean detectNatProtocol(IPAddress gatewayIP);
+        void generatePcpNonce();
+        portMappingResult commitPcpPortMappings();
+        soapActionResult requestPcpMapping(IPAddress gatewayIP, upnpRule *rule_ptr, boolean isDelete, int *assignedPort);
+        boolean updatePcpEpoch(IPAddress gatewayIP, boolean *isAnswered = NULL);
+        int buildPcpHeader(uint8_t opcode, uint32_t lifetime);
+        int exchangePcpDatagram(IPAddress gatewayIP, int requestLength, int requestMatchOffset, int responseMatchOffset, int matchLength);
+        static soapActionResult classifyPcpResult(int resultCode, boolean isNatPmp);
+        soapActionResult addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr, SOAPAction *soapAction);
+        boolean resolvePortConflict(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
+        boolean verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr, soapActionResult *result = NULL);
         boolean deletePortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
-        boolean applyActionOnSpecificPortMapping(SOAPAction *soapAction, gatewayInfo *deviceInfo, upnpRule *rule_ptr);
+        boolean applyAction(SOAPAction *soapAction, gatewayInfo *deviceInfo, upnpRule *rule_ptr /* can be NULL */);
+        boolean updateGatewayStatus(gatewayInfo *deviceInfo);
+        boolean updateExternalIP(gatewayInfo *deviceInfo);
+        boolean isGatewayStateUnchanged(gatewayInfo *deviceInfo);
+        boolean isFleetStateUnchanged(unsigned long intervalMs, boolean *isKnown);
+        boolean adoptFleetState(unsigned long maxAgeMs);
+        void processFleetMessage(ssdpResponse *response, IPAddress remoteIP);
+        void announceToFleet(boolean isAlive = true);
+        unsigned long getUpdateJitterMs(unsigned long intervalMs);
+        boolean isLeaseCloseToExpiry(unsigned long intervalMs);
+        boolean isRuleLeaseCloseToExpiry(upnpRule *rule_ptr, unsigned long intervalMs);
+        upnpRuleNode* findRuleNode(int ruleHandle);
+        boolean insertRuleNode(upnpRule *rule_ptr);
+        void coalescePendingActions(upnpRule *rule_ptr);
+        void removeRuleNode(upnpRuleNode *node_ptr);
+        void freeRuleNode(upnpRuleNode *node_ptr);
+        boolean hasDirtyRules();
+        void markAllRulesDirty();
+        void markLocalRulesDirty();
+        void subscribeNetworkEvents();
+        boolean isNetworkChanged();
+        void handleNetworkChange();
         void removeAllPortMappingsFromIGD();
+        void sendGetGenericPortMappingEntry(int index);
+        boolean acquireActionToken();
+        boolean waitForResponse(const UPnPDeadline &deadline);
+        int readHttpResponse(soapResponse *response, boolean *isKeepAlive);
+        int readByteWithTimeout(unsigned long *lastByteTime);
+        static boolean parsePortMappingEntry(const soapResponse *response, int index, upnpRule *rule_ptr);
         //char* ipAddressToCharArr(IPAddress ipAddress);  // ?? not sure this is needed
         void upnpRuleToString(upnpRule *rule_ptr);
         String getSpacesString(int num);
-        IPAddress getHost(String url);
-        int getPort(String url);
-        String getPath(String url);
-        String getTagContent(const String &line, String tagName);
+        // parsers of untrusted router input, these are stateless so they can be exercised without a network
+        static boolean parseUrl(const char *url, int length, urlParts *parts);
+        static boolean parseIPAddress(const char *str, int length, IPAddress *ip);
+        static String urlPartToString(const char *str, int length);
+        static boolean parseSsdpResponse(const char *buffer, int length, ssdpResponse *response);
+        static boolean isIgdSearchTarget(const char *st, int length);
+        static boolean parseFleetState(const char *str, int length, long *uptime, unsigned long *ageMs, IPAddress *externalIP);
+        static boolean isIPAddressLower(IPAddress a, IPAddress b);
+        static long parseDecimal(const char *str, int length);
+        static String getTagContent(const String &line, const char *tagName, int fromIndex = 0);  // tagName may be in PROGMEM
+        static soapActionResult classifySoapError(int errorCode);
+        static void beginSoapDecoder(soapDecoder *decoder, soapResponse *response);
+        static void decodeSoapByte(soapDecoder *decoder, char c);
+        static void endSoapElement(soapDecoder *decoder);
         void ssdpDeviceToString(ssdpDevice* ssdpDevice);
+        // sets _deadline on entry to a public method that talks to the network, the methods it calls share that deadline
+        // (e.g. updatePortMappings -> commitPortMappings) so the whole call is bound by _timeoutMs
+        // the allocations are accounted per call, and its temporary objects are taken back at once when it returns
+        class OperationScope
+        {
+            public:
+                OperationScope(TinyUPnP *tinyUPnP) {
+                    _tinyUPnP = tinyUPnP;
+                    if (_tinyUPnP->_operationDepth++ == 0) {
+                        _tinyUPnP->_deadline = _tinyUPnP->_timeoutMs > 0 ? UPnPDeadline(_tinyUPnP->_timeoutMs) : UPnPDeadline();
+                        _tinyUPnP->beginCallAllocationStats();
+                    }
+                }
+                ~OperationScope() {
+                    if (--_tinyUPnP->_operationDepth == 0) {
+                        _tinyUPnP->_deadline = UPnPDeadline();
+                        _tinyUPnP->_operationAllocator->reset();
+                    }
+                }
+            private:
+                TinyUPnP *_tinyUPnP;
+        };
+        void beginCallAllocationStats();
+        void* allocateBytes(UPnPAllocator *allocator, size_t size);
+        void freeBytes(UPnPAllocator *allocator, void *ptr, size_t size);
+        // objects are constructed in memory taken from _allocator, NULL if it is out of memory
+        template <typename T> T* allocateObject() {
+            void *ptr = allocateBytes(_allocator, sizeof(T));
+            return ptr != NULL ? new (ptr) T() : NULL;
+        }
+        template <typename T> T* allocateObject(const T &other) {
+            void *ptr = allocateBytes(_allocator, sizeof(T));
+            return ptr != NULL ? new (ptr) T(other) : NULL;
+        }
+        template <typename T> void freeObject(T *ptr) {
+            if (ptr != NULL) {
+                ptr->~T();
+                freeBytes(_allocator, ptr, sizeof(T));
+            }
+        }
+        // the same for the temporary objects of a public call, taken from _operationAllocator
+        // they must be freed before the call returns, the reset of the allocator does not run their destructors
+        template <typename T> T* allocateTemporaryObject() {
+            void *ptr = allocateBytes(_operationAllocator, sizeof(T));
+            return ptr != NULL ? new (ptr) T() : NULL;
+        }
+        template <typename T> void freeTemporaryObject(T *ptr) {
+            if (ptr != NULL) {
+                ptr->~T();
+                freeBytes(_operationAllocator, ptr, sizeof(T));
+            }
+        }
 
         /* members */
+        // all the mutable state is kept per instance so that several instances (e.g. one per network interface) can run in parallel
+        char _responseBuffer[UPNP_UDP_TX_RESPONSE_MAX_SIZE];  // holds the incoming SSDP packet
+        char _bodyTmp[UPNP_SOAP_BODY_MAX_SIZE];  // holds the outgoing M-SEARCH or SOAP body
+        char _integerString[32];
         upnpRuleNode *_headRuleNode;
+        int _nextRuleIndex;
+        ssdpDeviceNode *_ssdpDeviceCache;
+        boolean _ssdpListening;  // true while the UDP socket is bound for receiving NOTIFY messages
         unsigned long _lastUpdateTime;
+        unsigned long _updateIntervalMs;  // as given to updatePortMappings or setUpdateInterval, 0 if not set
+        callback_function _fallback;
         long _timeoutMs;  // 0 for blocking operation
+        UPnPDeadline _deadline;  // of the public call in progress, see OperationScope
+        int _operationDepth;
+        unsigned int _rateLimitPerSecond;  // 0 if not limited
+        unsigned int _rateLimitBurst;
+        unsigned long _rateLimitTokens;  // in thousandths of an action
+        unsigned long _rateLimitRefillTime;  // millis() when _rateLimitTokens was last refilled
+        boolean _isRateLimitExceeded;  // the last commit ran out of time waiting for the rate limit
+        unsigned long _gatewayCheckTime;  // millis() when this device last confirmed the state of the IGD by itself, 0 if never
+        // fleet mode, the leader is the member with the lowest local IP that was heard of lately
+        boolean _isFleetEnabled;
+        IPAddress _fleetLeaderIP;  // ipNull if no member with a lower IP is known
+        unsigned long _fleetLeaderSeenTime;
+        boolean _hasFleetLeaderState;  // the leader shared its last check of the IGD
+        boolean _isFleetStateDisputed;  // the shared check disagreed with this device, which checks the IGD by itself then
+        long _fleetLeaderUptime;  // at _fleetLeaderCheckTime, -1 if not supported by the IGD
+        IPAddress _fleetLeaderExternalIP;
+        unsigned long _fleetLeaderCheckTime;  // millis() of this device when the leader checked the IGD
+        unsigned long _fleetAnnounceTime;
+        unsigned long _fleetAnnounceDelayMs;  // until the next announcement
         WiFiUDP _udpClient;
-        WiFiClient _wifiClient;
+        WiFiClient _wifiClient;  // the default TCP transport
+        Client *_client;  // the TCP transport used for all the requests to the IGD
         gatewayInfo _gwInfo;
         unsigned long _consequtiveFails;
+        unsigned long _lastCommitTime;  // last time the rules were committed to the IGD, 0 if never
+        IPAddress _lastCommitLocalIP;  // local IP of this device at _lastCommitTime
+        IPAddress _externalIP;
+        unsigned long _externalIPCheckTime;  // millis() when _externalIP was last read from the IGD
+        boolean _isWanConnected;  // the connection status of the last GetStatusInfo was Connected
+        long _routerUptime;  // as reported by GetStatusInfo (or the epoch of a PCP / NAT-PMP server), -1 if not supported by the IGD
+        unsigned long _routerUptimeTime;  // millis() when _routerUptime was received
+        portConflictPolicy _conflictPolicy;
+        int _conflictMinPort;
+        int _conflictMaxPort;
+        const descriptionLocation *_descriptionLocations;
+        natProtocol _natProtocol;  // as set by setNatProtocol
+        natProtocol _activeNatProtocol;  // as detected, NAT_PROTOCOL_AUTO until the gateway was probed
+        WiFiUDP _pcpUdpClient;  // kept apart from _udpClient which may be listening for SSDP announcements
+        uint8_t _pcpNonce[PCP_NONCE_SIZE];
+        boolean _hasPcpNonce;  // false until the nonce was generated or set
+        UPnPHeapAllocator _heapAllocator;
+        UPnPAllocator *_allocator;
+        UPnPArenaAllocator<UPNP_OPERATION_ARENA_SIZE> _arenaAllocator;
+        UPnPAllocator *_operationAllocator;
+        upnpAllocationStats _allocationStats;
+        upnpAllocationStats _callAllocationStats;  // of the last public call, see OperationScope
+        // network change detection, the event handlers only count link losses since they run on the WiFi event task
+        boolean _isSubscribedToNetworkEvents;
+        volatile uint32_t _linkLossCount;
+        uint32_t _handledLinkLossCount;
+        IPAddress _lastGatewayIP;  // as seen by the last call to handleNetworkChange
+        IPAddress _lastLocalIP;
+#if defined(ESP8266)
+        WiFiEventHandler _disconnectedHandler;  // unsubscribed when destroyed
+#else
+        wifi_event_id_t _disconnectedEventId;
+#endif
 };
 
 #endif
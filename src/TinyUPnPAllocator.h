@@ -0,0 +1,124 @@
+/*
+ * TinyUPnPAllocator.h - Allocators for the objects of TinyUPnP.
+ * The objects kept between calls (rules, SSDP devices) come from one allocator, a device that runs for months can keep
+ * them out of the general heap using UPnPPoolAllocator, so they never fragment it.
+ * The temporary objects of a public call come from a UPnPArenaAllocator that is reset when the call returns.
+ * The Strings inside these objects still allocate their characters from the heap.
+*/
+
+#ifndef TinyUPnPAllocator_h
+#define TinyUPnPAllocator_h
+
+#include <Arduino.h>
+#include <stdlib.h>
+
+class UPnPAllocator
+{
+    public:
+        virtual ~UPnPAllocator() {}
+        virtual void* allocate(size_t size) = 0;  // NULL if out of memory
+        virtual void deallocate(void *ptr, size_t size) = 0;  // size - as given to allocate
+        virtual void reset() {}  // called when a public call returns, only on the allocator of its temporary objects
+};
+
+// the default, malloc and free
+class UPnPHeapAllocator : public UPnPAllocator
+{
+    public:
+        void* allocate(size_t size) {
+            return malloc(size);
+        }
+        void deallocate(void *ptr, size_t /* size */) {
+            free(ptr);
+        }
+};
+
+// NumOfBlocks fixed size blocks out of a static buffer, allocations larger than BlockSize fail
+// e.g. UPnPPoolAllocator<sizeof(ssdpDevice), 16>, the largest object TinyUPnP allocates is an ssdpDevice
+template <size_t BlockSize, size_t NumOfBlocks>
+class UPnPPoolAllocator : public UPnPAllocator
+{
+    public:
+        UPnPPoolAllocator() {
+            _freeList = NULL;
+            for (size_t i = 0; i < NumOfBlocks; i++) {
+                _blocks[i].next = _freeList;
+                _freeList = &_blocks[i];
+            }
+        }
+        void* allocate(size_t size) {
+            if (size > BlockSize || _freeList == NULL) {
+                return NULL;
+            }
+            poolBlock *block_ptr = _freeList;
+            _freeList = block_ptr->next;
+            return block_ptr->data;
+        }
+        void deallocate(void *ptr, size_t size) {
+            poolBlock *block_ptr = (poolBlock *) ptr;
+            block_ptr->next = _freeList;
+            _freeList = block_ptr;
+        }
+    private:
+        union poolBlock {
+            poolBlock *next;  // while the block is free
+            uint8_t data[BlockSize];
+            long double align;
+        };
+
+        /* members */
+        poolBlock _blocks[NumOfBlocks];
+        poolBlock *_freeList;
+};
+
+// the default for the temporary objects of a public call, bumps a pointer through Size bytes of a static buffer
+// deallocate only takes back the last allocation, everything else is taken back at once by reset when the call returns
+template <size_t Size>
+class UPnPArenaAllocator : public UPnPAllocator
+{
+    public:
+        UPnPArenaAllocator() {
+            _usedBytes = 0;
+        }
+        void* allocate(size_t size) {
+            size = alignSize(size);
+            if (size > Size - _usedBytes) {
+                return NULL;
+            }
+            void *ptr = _buffer.data + _usedBytes;
+            _usedBytes += size;
+            return ptr;
+        }
+        void deallocate(void *ptr, size_t size) {
+            size = alignSize(size);
+            if ((uint8_t *) ptr + size == _buffer.data + _usedBytes) {
+                _usedBytes -= size;
+            }
+        }
+        void reset() {
+            _usedBytes = 0;
+        }
+    private:
+        static size_t alignSize(size_t size) {
+            return (size + alignof(arenaBuffer) - 1) / alignof(arenaBuffer) * alignof(arenaBuffer);
+        }
+        union arenaBuffer {
+            uint8_t data[Size];
+            long double align;
+        };
+
+        /* members */
+        arenaBuffer _buffer;
+        size_t _usedBytes;
+};
+
+// allocation accounting of a TinyUPnP instance, see TinyUPnP::getAllocationStats
+typedef struct _upnpAllocationStats {
+    unsigned long numOfAllocations;  // since the last reset
+    unsigned long allocatedBytes;  // since the last reset
+    unsigned long numOfFailures;  // since the last reset
+    unsigned long currentBytes;  // allocated and not freed yet
+    unsigned long highWaterBytes;  // max currentBytes since the last reset
+} upnpAllocationStats;
+
+#endif
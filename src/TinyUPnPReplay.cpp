@@ -0,0 +1,258 @@
+/*
+ * TinyUPnPReplay.cpp - Capture and replay of the TCP conversations between TinyUPnP and a router.
+*/
+
+#include "TinyUPnPReplay.h"
+
+UPnPCaptureClient::UPnPCaptureClient(Client *client, Print *out) {
+    _client = client;
+    _out = out;
+    _connectTime = 0;
+    _chunkTime = 0;
+    _chunkLength = 0;
+}
+
+int UPnPCaptureClient::connect(IPAddress ip, uint16_t port) {
+    beginConnection(ip.toString() + ":" + String(port));
+    return _client->connect(ip, port);
+}
+
+int UPnPCaptureClient::connect(const char *host, uint16_t port) {
+    beginConnection(String(host) + ":" + String(port));
+    return _client->connect(host, port);
+}
+
+size_t UPnPCaptureClient::write(uint8_t b) {
+    return _client->write(b);
+}
+
+size_t UPnPCaptureClient::write(const uint8_t *buf, size_t size) {
+    return _client->write(buf, size);
+}
+
+int UPnPCaptureClient::available() {
+    int available = _client->available();
+    if (available == 0) {
+        flushChunk();  // a gap in the data, the next bytes will get their own timestamp
+    }
+    return available;
+}
+
+int UPnPCaptureClient::read() {
+    int c = _client->read();
+    if (c >= 0) {
+        captureByte((uint8_t) c);
+    }
+    return c;
+}
+
+int UPnPCaptureClient::read(uint8_t *buf, size_t size) {
+    int length = _client->read(buf, size);
+    for (int i = 0; i < length; i++) {
+        captureByte(buf[i]);
+    }
+    return length;
+}
+
+int UPnPCaptureClient::peek() {
+    return _client->peek();
+}
+
+void UPnPCaptureClient::flush() {
+    _client->flush();
+}
+
+void UPnPCaptureClient::stop() {
+    flushChunk();
+    _client->stop();
+}
+
+uint8_t UPnPCaptureClient::connected() {
+    return _client->connected();
+}
+
+UPnPCaptureClient::operator bool() {
+    return (bool) *_client;
+}
+
+void UPnPCaptureClient::beginConnection(const String &address) {
+    flushChunk();
+    _connectTime = millis();
+    _out->print(F("C "));
+    _out->print(String(_connectTime));
+    _out->print(F(" "));
+    _out->println(address);
+}
+
+void UPnPCaptureClient::captureByte(uint8_t b) {
+    if (_chunkLength == 0) {
+        _chunkTime = millis() - _connectTime;
+    }
+    _chunk[_chunkLength++] = b;
+    if (_chunkLength == UPNP_CAPTURE_CHUNK_MAX_SIZE) {
+        flushChunk();
+    }
+}
+
+void UPnPCaptureClient::flushChunk() {
+    if (_chunkLength == 0) {
+        return;
+    }
+    _out->print(F("R "));
+    _out->print(String(_chunkTime));
+    _out->print(F(" "));
+    _out->println(String((unsigned long) _chunkLength));
+    _out->write(_chunk, _chunkLength);
+    _out->println();
+    _chunkLength = 0;
+}
+
+UPnPReplayClient::UPnPReplayClient(const char *capture) {
+    _pos = capture;
+    _end = capture + strlen(capture);
+    _chunk = NULL;
+    _chunkRemaining = 0;
+    _isConnected = false;
+    _connectTime = 0;
+    _connectCount = 0;
+    _bytesWritten = 0;
+    _bytesRead = 0;
+}
+
+// the address is not checked, connections are replayed in the order they were captured
+int UPnPReplayClient::connect(IPAddress /* ip */, uint16_t port) {
+    return connect((const char *) NULL, port);
+}
+
+int UPnPReplayClient::connect(const char * /* host */, uint16_t /* port */) {
+    stop();
+    if (*_pos != 'C') {
+        return 0;  // end of the capture
+    }
+    const char *lineEnd = strchr(_pos, '\n');
+    _pos = lineEnd != NULL ? lineEnd + 1 : _end;
+    _isConnected = true;
+    _connectTime = millis();
+    _connectCount++;
+    return 1;
+}
+
+size_t UPnPReplayClient::write(uint8_t /* b */) {
+    _bytesWritten++;
+    return 1;
+}
+
+size_t UPnPReplayClient::write(const uint8_t * /* buf */, size_t size) {
+    _bytesWritten += size;
+    return size;
+}
+
+int UPnPReplayClient::available() {
+    return loadNextChunk() ? _chunkRemaining : 0;
+}
+
+int UPnPReplayClient::read() {
+    if (!loadNextChunk()) {
+        return -1;
+    }
+    _chunkRemaining--;
+    _bytesRead++;
+    return (uint8_t) *_chunk++;
+}
+
+int UPnPReplayClient::read(uint8_t *buf, size_t size) {
+    size_t length = 0;
+    while (length < size && loadNextChunk()) {
+        buf[length++] = (uint8_t) *_chunk++;
+        _chunkRemaining--;
+        _bytesRead++;
+    }
+    return length;
+}
+
+int UPnPReplayClient::peek() {
+    if (!loadNextChunk()) {
+        return -1;
+    }
+    return (uint8_t) *_chunk;
+}
+
+void UPnPReplayClient::flush() {
+}
+
+void UPnPReplayClient::stop() {
+    _isConnected = false;
+    _chunkRemaining = 0;
+    _pos = skipConnection(_pos);
+}
+
+// the router closes the connection once everything it sent was read
+uint8_t UPnPReplayClient::connected() {
+    return _isConnected && (_chunkRemaining > 0 || *_pos == 'R');
+}
+
+UPnPReplayClient::operator bool() {
+    return _isConnected;
+}
+
+unsigned int UPnPReplayClient::getConnectCount() {
+    return _connectCount;
+}
+
+unsigned long UPnPReplayClient::getBytesWritten() {
+    return _bytesWritten;
+}
+
+unsigned long UPnPReplayClient::getBytesRead() {
+    return _bytesRead;
+}
+
+// false if no data of the current connection is due yet
+boolean UPnPReplayClient::loadNextChunk() {
+    if (_chunkRemaining > 0) {
+        return true;
+    }
+    if (!_isConnected || *_pos != 'R') {
+        return false;
+    }
+    char *end;
+    unsigned long chunkTime = strtoul(_pos + 2, &end, 10);
+    if (millis() - _connectTime < chunkTime) {
+        return false;  // keep the timing of the router
+    }
+    size_t chunkLength = strtoul(end, &end, 10);
+    const char *lineEnd = strchr(end, '\n');
+    if (lineEnd == NULL || (size_t) (_end - lineEnd - 1) < chunkLength) {
+        _pos = _end;  // truncated capture
+        return false;
+    }
+    _chunk = lineEnd + 1;
+    _chunkRemaining = chunkLength;
+    _pos = _chunk + chunkLength;
+    if (*_pos == '\n') {
+        _pos++;
+    }
+    return _chunkRemaining > 0 || loadNextChunk();
+}
+
+// returns the next C record (or the end of the capture), the payloads of R and U records are skipped
+const char* UPnPReplayClient::skipConnection(const char *pos) {
+    while (*pos != '\0' && *pos != 'C') {
+        const char *lineEnd = strchr(pos, '\n');
+        if (lineEnd == NULL) {
+            return _end;
+        }
+        if (*pos == 'R' || *pos == 'U') {
+            char *end;
+            strtoul(pos + 2, &end, 10);
+            size_t chunkLength = strtoul(end, &end, 10);
+            size_t remaining = _end - lineEnd - 1;
+            lineEnd += remaining < chunkLength ? remaining : chunkLength;
+            if (lineEnd[1] == '\n') {
+                lineEnd++;
+            }
+        }
+        pos = lineEnd + 1;
+    }
+    return pos;
+}
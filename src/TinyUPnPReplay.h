@@ -0,0 +1,88 @@
+/*
+ * TinyUPnPReplay.h - Capture and replay of the TCP conversations between TinyUPnP and a router.
+ * UPnPCaptureClient wraps the real client and prints everything the router sends in the capture format,
+ * UPnPReplayClient plays such a capture back (with the original timing) so a router can be reproduced offline.
+ *
+ * Capture format, one record per line followed by the payload for received data:
+ *   C <ms> <host>:<port>     a connection was opened
+ *   R <ms> <len>\n<payload>  len bytes were received, ms is relative to the opening of the connection
+ *   U <ms> <len>\n<payload>  a datagram was received (e.g. the answer to an M-SEARCH), ms is relative to the search
+ * U records are taken from a packet capture, UPnPReplayClient skips them and leaves them to the UDP of the test.
+*/
+
+#ifndef TinyUPnPReplay_h
+#define TinyUPnPReplay_h
+
+#include <Arduino.h>
+#include <Client.h>
+
+#define UPNP_CAPTURE_CHUNK_MAX_SIZE 256
+
+class UPnPCaptureClient : public Client
+{
+    public:
+        UPnPCaptureClient(Client *client, Print *out);
+        int connect(IPAddress ip, uint16_t port);
+        int connect(const char *host, uint16_t port);
+        size_t write(uint8_t b);
+        size_t write(const uint8_t *buf, size_t size);
+        int available();
+        int read();
+        int read(uint8_t *buf, size_t size);
+        int peek();
+        void flush();
+        void stop();
+        uint8_t connected();
+        operator bool();
+    private:
+        void beginConnection(const String &address);
+        void captureByte(uint8_t b);
+        void flushChunk();
+
+        /* members */
+        Client *_client;
+        Print *_out;
+        unsigned long _connectTime;
+        unsigned long _chunkTime;
+        uint8_t _chunk[UPNP_CAPTURE_CHUNK_MAX_SIZE];
+        size_t _chunkLength;
+};
+
+class UPnPReplayClient : public Client
+{
+    public:
+        // capture - the text of a capture, must outlive the client
+        UPnPReplayClient(const char *capture);
+        int connect(IPAddress ip, uint16_t port);
+        int connect(const char *host, uint16_t port);
+        size_t write(uint8_t b);
+        size_t write(const uint8_t *buf, size_t size);
+        int available();
+        int read();
+        int read(uint8_t *buf, size_t size);
+        int peek();
+        void flush();
+        void stop();
+        uint8_t connected();
+        operator bool();
+        // counters for checking the cost of an operation against a captured router
+        unsigned int getConnectCount();  // TCP round trips
+        unsigned long getBytesWritten();
+        unsigned long getBytesRead();
+    private:
+        boolean loadNextChunk();
+        const char* skipConnection(const char *pos);
+
+        /* members */
+        const char *_pos;  // the next record
+        const char *_end;  // the end of the capture, measured once so that each chunk is loaded in constant time
+        const char *_chunk;  // the payload of the current R record
+        size_t _chunkRemaining;
+        boolean _isConnected;
+        unsigned long _connectTime;
+        unsigned int _connectCount;
+        unsigned long _bytesWritten;
+        unsigned long _bytesRead;
+};
+
+#endif
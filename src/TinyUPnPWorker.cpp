@@ -0,0 +1,208 @@
+/*
+ * TinyUPnPWorker.cpp - Runs TinyUPnP in a background FreeRTOS task (ESP32 only).
+*/
+
+#if defined(ESP32)
+
+#include "TinyUPnPWorker.h"
+
+#ifdef UPNP_DEBUG
+#define debugPrint(...) Serial.print( __VA_ARGS__ )
+#define debugPrintln(...) Serial.println( __VA_ARGS__ )
+#else
+#define debugPrint(...)
+#define debugPrintln(...)
+#endif
+
+// timeoutMs - timeout in milli seconds for the operations of TinyUPnP, see TinyUPnP::TinyUPnP
+// updateIntervalMs - interval in milli seconds between port mapping updates, see TinyUPnP::updatePortMappings
+TinyUPnPWorker::TinyUPnPWorker(unsigned long timeoutMs, unsigned long updateIntervalMs) : _tinyUPnP(timeoutMs) {
+    _task = NULL;
+    _updateIntervalMs = updateIntervalMs;
+    _nextCommandId = 1;
+}
+
+boolean TinyUPnPWorker::begin(int core, uint32_t stackSize, UBaseType_t priority) {
+    if (_task != NULL) {
+        return true;
+    }
+    if (core < 0) {
+        core = xPortGetCoreID() == 0 ? 1 : 0;
+    }
+    if (xTaskCreatePinnedToCore(&TinyUPnPWorker::taskMain, "TinyUPnP", stackSize, this, priority, &_task, core) != pdPASS) {
+        debugPrintln(F("ERROR: could not create the TinyUPnP task"));
+        _task = NULL;
+        return false;
+    }
+    debugPrint(F("TinyUPnP task started on core ["));
+    debugPrint(String(core));
+    debugPrintln(F("]"));
+    return true;
+}
+
+uint32_t TinyUPnPWorker::addPortMappingConfig(IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, const char *ruleProtocol, int ruleLeaseDuration, const char *ruleFriendlyName) {
+    upnpCommand command;
+    command.type = UPNP_COMMAND_ADD_RULE;
+    command.ruleIP = ruleIP;
+    command.ruleInternalPort = ruleInternalPort;
+    command.ruleExternalPort = ruleExternalPort;
+    strncpy(command.ruleProtocol, ruleProtocol, sizeof(command.ruleProtocol) - 1);
+    command.ruleProtocol[sizeof(command.ruleProtocol) - 1] = '\0';
+    command.ruleLeaseDuration = ruleLeaseDuration;
+    strncpy(command.ruleFriendlyName, ruleFriendlyName, sizeof(command.ruleFriendlyName) - 1);
+    command.ruleFriendlyName[sizeof(command.ruleFriendlyName) - 1] = '\0';
+    return postCommand(&command);
+}
+
+uint32_t TinyUPnPWorker::removeRule(int ruleHandle) {
+    upnpCommand command;
+    command.type = UPNP_COMMAND_REMOVE_RULE;
+    command.ruleHandle = ruleHandle;
+    return postCommand(&command);
+}
+
+uint32_t TinyUPnPWorker::commitPortMappings() {
+    upnpCommand command;
+    command.type = UPNP_COMMAND_COMMIT;
+    return postCommand(&command);
+}
+
+uint32_t TinyUPnPWorker::getPortMappings(upnpPortMapping *entries, int maxEntries) {
+    upnpCommand command;
+    command.type = UPNP_COMMAND_GET_PORT_MAPPINGS;
+    command.entries = entries;
+    command.maxEntries = maxEntries;
+    return postCommand(&command);
+}
+
+uint32_t TinyUPnPWorker::getExternalIP() {
+    upnpCommand command;
+    command.type = UPNP_COMMAND_GET_EXTERNAL_IP;
+    return postCommand(&command);
+}
+
+boolean TinyUPnPWorker::pollResult(upnpCommandResult *result) {
+    return _results.pop(result);
+}
+
+uint32_t TinyUPnPWorker::postCommand(upnpCommand *command) {
+    command->id = _nextCommandId++;
+    if (_nextCommandId == 0) {
+        _nextCommandId = 1;  // 0 is reserved for periodic updates
+    }
+    if (!_commands.push(*command)) {
+        debugPrintln(F("ERROR: TinyUPnP command queue is full"));
+        return 0;
+    }
+    return command->id;
+}
+
+void TinyUPnPWorker::postResult(upnpCommandResult *result) {
+    if (!_results.push(*result)) {
+        debugPrintln(F("ERROR: TinyUPnP result queue is full, result dropped"));
+    }
+}
+
+// runs on the task, the port mappings are copied straight into the reply slot as they are read from the IGD
+// (the same enumeration that TinyUPnP::getPortMappings uses) so no String is kept per entry
+// returns the number of entries or -1 on error
+int TinyUPnPWorker::readPortMappings(upnpPortMapping *entries, int maxEntries) {
+    struct {
+        upnpPortMapping *entries;
+        int maxEntries;
+        int count;
+    } snapshot = {entries, maxEntries, 0};
+    auto copyEntry = [] (upnpRule *rule_ptr, void *arg) -> boolean {
+        auto snapshot_ptr = (decltype(snapshot) *) arg;
+        upnpPortMapping *entry = &snapshot_ptr->entries[snapshot_ptr->count++];
+        entry->internalAddr = rule_ptr->internalAddr;
+        entry->internalPort = rule_ptr->internalPort;
+        entry->externalPort = rule_ptr->externalPort;
+        strncpy(entry->protocol, rule_ptr->protocol.c_str(), sizeof(entry->protocol) - 1);
+        entry->protocol[sizeof(entry->protocol) - 1] = '\0';
+        entry->leaseDuration = rule_ptr->leaseDuration;
+        strncpy(entry->friendlyName, rule_ptr->devFriendlyName.c_str(), sizeof(entry->friendlyName) - 1);
+        entry->friendlyName[sizeof(entry->friendlyName) - 1] = '\0';
+        return snapshot_ptr->count < snapshot_ptr->maxEntries;
+    };
+    if (entries == NULL || maxEntries <= 0) {
+        return 0;
+    }
+    if (_tinyUPnP.enumeratePortMappings(copyEntry, &snapshot) < 0) {
+        return -1;
+    }
+    return snapshot.count;
+}
+
+void TinyUPnPWorker::taskMain(void *arg) {
+    ((TinyUPnPWorker *) arg)->run();
+}
+
+void TinyUPnPWorker::run() {
+    while (true) {
+        boolean isIdle = true;
+        upnpCommand command;
+        while (_commands.pop(&command)) {
+            isIdle = false;
+            upnpCommandResult result;
+            result.type = command.type;
+            result.id = command.id;
+            result.result = UNKNOWN;
+            result.isSuccess = true;
+            result.ruleHandle = UPNP_RULE_INVALID_HANDLE;
+            result.externalIP = _tinyUPnP.getExternalIP();
+            result.numOfEntries = 0;
+
+            switch (command.type) {
+                case UPNP_COMMAND_ADD_RULE:
+                    result.ruleHandle = _tinyUPnP.addRule(command.ruleIP, command.ruleInternalPort, command.ruleExternalPort,
+                        command.ruleProtocol, command.ruleLeaseDuration, command.ruleFriendlyName);
+                    result.isSuccess = result.ruleHandle != UPNP_RULE_INVALID_HANDLE;
+                    break;
+                case UPNP_COMMAND_REMOVE_RULE:
+                    result.isSuccess = _tinyUPnP.removeRule(command.ruleHandle);
+                    break;
+                case UPNP_COMMAND_COMMIT:
+                    result.result = _tinyUPnP.commitPortMappings();
+                    result.isSuccess = result.result == SUCCESS || result.result == ALREADY_MAPPED;
+                    result.externalIP = _tinyUPnP.getExternalIP();
+                    break;
+                case UPNP_COMMAND_GET_PORT_MAPPINGS:
+                    result.numOfEntries = readPortMappings(command.entries, command.maxEntries);
+                    result.isSuccess = result.numOfEntries >= 0;
+                    break;
+                case UPNP_COMMAND_GET_EXTERNAL_IP:
+                    result.externalIP = _tinyUPnP.queryExternalIP();
+                    result.isSuccess = result.externalIP != IPAddress(0, 0, 0, 0);
+                    break;
+                default:
+                    result.isSuccess = false;
+                    break;
+            }
+            postResult(&result);
+        }
+
+        // the updates stop once the last rule was removed (and deleted from the IGD)
+        if (_tinyUPnP.hasRules()) {
+            portMappingResult updateResult = _tinyUPnP.updatePortMappings(_updateIntervalMs);
+            if (updateResult != NOP) {
+                isIdle = false;
+                upnpCommandResult result;
+                result.type = UPNP_COMMAND_UPDATE;
+                result.id = 0;
+                result.result = updateResult;
+                result.ruleHandle = UPNP_RULE_INVALID_HANDLE;
+                result.isSuccess = updateResult == SUCCESS || updateResult == ALREADY_MAPPED;
+                result.externalIP = _tinyUPnP.getExternalIP();
+                result.numOfEntries = 0;
+                postResult(&result);
+            }
+        }
+
+        if (isIdle) {
+            vTaskDelay(pdMS_TO_TICKS(UPNP_WORKER_IDLE_DELAY_MS));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * TinyUPnPWorker.h - Runs TinyUPnP in a background FreeRTOS task (ESP32 only).
+ * The application talks to the task through lock-free single producer single consumer queues
+ * so that the core running the application never blocks on router I/O.
+*/
+
+#ifndef TinyUPnPWorker_h
+#define TinyUPnPWorker_h
+
+#if defined(ESP32)
+
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "TinyUPnP.h"
+
+#define UPNP_WORKER_QUEUE_SIZE 8
+#define UPNP_WORKER_STACK_SIZE 8192
+#define UPNP_WORKER_IDLE_DELAY_MS 10
+#define UPNP_WORKER_FRIENDLY_NAME_MAX_SIZE 32
+
+// a lock-free queue for exactly one producer task and one consumer task
+// one slot is kept empty to tell a full queue from an empty one
+template <typename T, size_t N>
+class SpscQueue
+{
+    public:
+        SpscQueue() : _head(0), _tail(0) {}
+
+        // called by the producer only, false if the queue is full
+        boolean push(const T &item) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            size_t next = (head + 1) % N;
+            if (next == _tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            _items[head] = item;
+            _head.store(next, std::memory_order_release);
+            return true;
+        }
+
+        // called by the consumer only, false if the queue is empty
+        boolean pop(T *item) {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            *item = _items[tail];
+            _tail.store((tail + 1) % N, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        T _items[N];
+        std::atomic<size_t> _head;  // next slot to write, only written by the producer
+        std::atomic<size_t> _tail;  // next slot to read, only written by the consumer
+};
+
+enum upnpCommandType {
+    UPNP_COMMAND_ADD_RULE,
+    UPNP_COMMAND_REMOVE_RULE,
+    UPNP_COMMAND_COMMIT,
+    UPNP_COMMAND_GET_PORT_MAPPINGS,
+    UPNP_COMMAND_GET_EXTERNAL_IP,
+    UPNP_COMMAND_UPDATE  // only used for results, posted when the periodic update did something
+};
+
+// an entry of the port mapping table of the IGD, see TinyUPnPWorker::getPortMappings
+typedef struct _upnpPortMapping {
+    IPAddress internalAddr;
+    int internalPort;
+    int externalPort;
+    char protocol[4];
+    int leaseDuration;
+    char friendlyName[UPNP_WORKER_FRIENDLY_NAME_MAX_SIZE];
+} upnpPortMapping;
+
+// fixed size fields so no heap memory changes hands between the tasks
+typedef struct _upnpCommand {
+    upnpCommandType type;
+    uint32_t id;
+    int ruleHandle;  // UPNP_COMMAND_REMOVE_RULE
+    IPAddress ruleIP;
+    int ruleInternalPort;
+    int ruleExternalPort;
+    char ruleProtocol[4];
+    int ruleLeaseDuration;
+    char ruleFriendlyName[UPNP_WORKER_FRIENDLY_NAME_MAX_SIZE];
+    upnpPortMapping *entries;  // UPNP_COMMAND_GET_PORT_MAPPINGS, the reply slot owned by the application
+    int maxEntries;
+} upnpCommand;
+
+typedef struct _upnpCommandResult {
+    upnpCommandType type;
+    uint32_t id;  // the id returned when the command was posted, 0 for periodic updates
+    portMappingResult result;  // UPNP_COMMAND_COMMIT and UPNP_COMMAND_UPDATE
+    int ruleHandle;  // UPNP_COMMAND_ADD_RULE, the handle to pass to removeRule
+    boolean isSuccess;
+    IPAddress externalIP;
+    int numOfEntries;  // UPNP_COMMAND_GET_PORT_MAPPINGS, the number of entries filled in the reply slot, -1 on error
+} upnpCommandResult;
+
+class TinyUPnPWorker
+{
+    public:
+        TinyUPnPWorker(unsigned long timeoutMs, unsigned long updateIntervalMs);
+        // starts the task pinned to the core not running the caller (by default)
+        boolean begin(int core = -1, uint32_t stackSize = UPNP_WORKER_STACK_SIZE, UBaseType_t priority = 1);
+        // the following post a command to the task and return its id, or 0 if the command queue is full
+        uint32_t addPortMappingConfig(IPAddress ruleIP, int ruleInternalPort, int ruleExternalPort, const char *ruleProtocol, int ruleLeaseDuration, const char *ruleFriendlyName);
+        uint32_t removeRule(int ruleHandle);  // takes effect on the next commit
+        uint32_t commitPortMappings();
+        // the task fills entries with up to maxEntries port mappings of the IGD, entries must stay valid and untouched
+        // until the result of the command is polled
+        uint32_t getPortMappings(upnpPortMapping *entries, int maxEntries);
+        uint32_t getExternalIP();  // queried from the IGD by the task, see TinyUPnP::queryExternalIP
+        // non blocking, false if no result is pending
+        boolean pollResult(upnpCommandResult *result);
+    private:
+        uint32_t postCommand(upnpCommand *command);
+        void postResult(upnpCommandResult *result);
+        int readPortMappings(upnpPortMapping *entries, int maxEntries);
+        static void taskMain(void *arg);
+        void run();
+
+        /* members */
+        TinyUPnP _tinyUPnP;  // only used by the task
+        SpscQueue<upnpCommand, UPNP_WORKER_QUEUE_SIZE> _commands;  // application -> task
+        SpscQueue<upnpCommandResult, UPNP_WORKER_QUEUE_SIZE> _results;  // task -> application
+        TaskHandle_t _task;
+        unsigned long _updateIntervalMs;
+        uint32_t _nextCommandId;  // only used by the application
+};
+
+#endif
+
+#endif
@@ -0,0 +1,38 @@
+// gives the host tests and fuzz targets access to the private parsers (and probing) of TinyUPnP
+#ifndef TinyUPnPTestAccess_h
+#define TinyUPnPTestAccess_h
+
+#include "TinyUPnP.h"
+
+struct TinyUPnPTestAccess
+{
+    static boolean parseUrl(const char *url, int length, urlParts *parts) {
+        return TinyUPnP::parseUrl(url, length, parts);
+    }
+    static boolean parseIPAddress(const char *str, int length, IPAddress *ip) {
+        return TinyUPnP::parseIPAddress(str, length, ip);
+    }
+    static boolean parseSsdpResponse(const char *buffer, int length, ssdpResponse *response) {
+        return TinyUPnP::parseSsdpResponse(buffer, length, response);
+    }
+    static boolean isIgdSearchTarget(const char *st, int length) {
+        return TinyUPnP::isIgdSearchTarget(st, length);
+    }
+    static boolean parseFleetState(const char *str, int length, long *uptime, unsigned long *ageMs, IPAddress *externalIP) {
+        return TinyUPnP::parseFleetState(str, length, uptime, ageMs, externalIP);
+    }
+    static void beginSoapDecoder(soapDecoder *decoder, soapResponse *response) {
+        TinyUPnP::beginSoapDecoder(decoder, response);
+    }
+    static void decodeSoapByte(soapDecoder *decoder, char c) {
+        TinyUPnP::decodeSoapByte(decoder, c);
+    }
+    static boolean probeDescriptionLocations(TinyUPnP *tinyUPnP, gatewayInfo *deviceInfo, IPAddress gatewayIP) {
+        return tinyUPnP->probeDescriptionLocations(deviceInfo, gatewayIP);
+    }
+    static gatewayInfo getGatewayInfo(TinyUPnP *tinyUPnP) {
+        return tinyUPnP->_gwInfo;
+    }
+};
+
+#endif
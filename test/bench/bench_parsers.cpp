@@ -0,0 +1,101 @@
+// throughput of the parsers of router input over the corpus of the fuzz targets
+// usage: bench_parsers <corpus directory> [iterations]
+#include "TinyUPnPTestAccess.h"
+#include <chrono>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+typedef void (*parser_function)(const std::string &input);
+
+static void parseSsdpResponse(const std::string &input) {
+    ssdpResponse response;
+    TinyUPnPTestAccess::parseSsdpResponse(input.data(), input.size(), &response);
+}
+
+static void parseUrl(const std::string &input) {
+    urlParts parts;
+    TinyUPnPTestAccess::parseUrl(input.data(), input.size(), &parts);
+}
+
+static void decodeSoap(const std::string &input) {
+    soapDecoder decoder;
+    soapResponse response;
+    TinyUPnPTestAccess::beginSoapDecoder(&decoder, &response);
+    for (char c : input) {
+        TinyUPnPTestAccess::decodeSoapByte(&decoder, c);
+    }
+}
+
+static void parseFleetState(const std::string &input) {
+    long uptime;
+    unsigned long ageMs;
+    IPAddress externalIP;
+    TinyUPnPTestAccess::parseFleetState(input.data(), input.size(), &uptime, &ageMs, &externalIP);
+}
+
+static std::vector<std::string> readCorpus(const std::string &path) {
+    std::vector<std::string> inputs;
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return inputs;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        FILE *file = fopen((path + "/" + entry->d_name).c_str(), "rb");
+        if (file == NULL) {
+            continue;
+        }
+        std::string input;
+        char buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            input.append(buffer, count);
+        }
+        fclose(file);
+        inputs.push_back(input);
+    }
+    closedir(dir);
+    return inputs;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <corpus directory> [iterations]\n", argv[0]);
+        return 2;
+    }
+    long iterations = argc > 2 ? atol(argv[2]) : 100000;
+    struct {
+        const char *name;
+        parser_function parse;
+    } parsers[] = {
+        {"ssdp_response", parseSsdpResponse},
+        {"url", parseUrl},
+        {"soap", decodeSoap},
+        {"fleet_state", parseFleetState}
+    };
+    for (const auto &parser : parsers) {
+        std::vector<std::string> inputs = readCorpus(std::string(argv[1]) + "/" + parser.name);
+        if (inputs.empty()) {
+            fprintf(stderr, "no corpus for %s\n", parser.name);
+            return 1;
+        }
+        size_t bytes = 0;
+        for (const std::string &input : inputs) {
+            bytes += input.size();
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) {
+            for (const std::string &input : inputs) {
+                parser.parse(input);
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double runs = (double) iterations * inputs.size();
+        printf("%-14s %8.1f ns/input %8.1f MB/s\n", parser.name, seconds * 1e9 / runs, bytes * iterations / seconds / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef fuzz_h
+#define fuzz_h
+
+#include <cstdio>
+#include <cstdlib>
+
+// aborts so that both libFuzzer and the standalone driver report the input that broke the invariant
+#define FUZZ_ASSERT(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+            abort(); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,14 @@
+// fuzz target of parseFleetState, the input is the value of an X-TINYUPNP-FLEET header
+#include "TinyUPnPTestAccess.h"
+#include "fuzz.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    long uptime;
+    unsigned long ageMs;
+    IPAddress externalIP;
+    if (TinyUPnPTestAccess::parseFleetState((const char *) data, size, &uptime, &ageMs, &externalIP)) {
+        FUZZ_ASSERT(uptime >= -1);
+        FUZZ_ASSERT(externalIP != IPAddress(0, 0, 0, 0));
+    }
+    return 0;
+}
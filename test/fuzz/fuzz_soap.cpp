@@ -0,0 +1,24 @@
+// fuzz target of decodeSoapByte, the input is the body of a SOAP response
+#include "TinyUPnPTestAccess.h"
+#include "fuzz.h"
+
+static void assertTerminated(const char *str, size_t size) {
+    FUZZ_ASSERT(memchr(str, '\0', size) != NULL);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    soapDecoder decoder;
+    soapResponse response;
+    TinyUPnPTestAccess::beginSoapDecoder(&decoder, &response);
+    for (size_t i = 0; i < size; i++) {
+        TinyUPnPTestAccess::decodeSoapByte(&decoder, (char) data[i]);
+        FUZZ_ASSERT(decoder.textLength >= 0 && decoder.textLength < SOAP_VALUE_MAX_SIZE);
+    }
+    assertTerminated(response.internalClient, sizeof(response.internalClient));
+    assertTerminated(response.externalIPAddress, sizeof(response.externalIPAddress));
+    assertTerminated(response.protocol, sizeof(response.protocol));
+    assertTerminated(response.connectionStatus, sizeof(response.connectionStatus));
+    assertTerminated(response.description, sizeof(response.description));
+    FUZZ_ASSERT(response.errorCode >= 0);
+    return 0;
+}
@@ -0,0 +1,27 @@
+// fuzz target of parseSsdpResponse, the input is a single SSDP datagram
+#include "TinyUPnPTestAccess.h"
+#include "fuzz.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const char *buffer = (const char *) data;
+    const char *end = buffer + size;
+    ssdpResponse response;
+    if (!TinyUPnPTestAccess::parseSsdpResponse(buffer, size, &response)) {
+        return 0;
+    }
+    const char *values[] = {response.location, response.st, response.usn, response.server, response.nts, response.fleetState};
+    int lengths[] = {response.locationLength, response.stLength, response.usnLength, response.serverLength, response.ntsLength,
+            response.fleetStateLength};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        FUZZ_ASSERT(values[i] == NULL || (values[i] >= buffer && lengths[i] >= 0 && values[i] + lengths[i] <= end));
+    }
+    FUZZ_ASSERT(response.maxAge >= -1 && response.bootId >= -1);
+    if (response.st != NULL) {
+        TinyUPnPTestAccess::isIgdSearchTarget(response.st, response.stLength);
+    }
+    urlParts location;
+    if (response.location != NULL) {
+        TinyUPnPTestAccess::parseUrl(response.location, response.locationLength, &location);
+    }
+    return 0;
+}
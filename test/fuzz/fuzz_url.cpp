@@ -0,0 +1,21 @@
+// fuzz target of parseUrl and parseIPAddress, the input is a LOCATION or a URLBase
+#include "TinyUPnPTestAccess.h"
+#include "fuzz.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const char *url = (const char *) data;
+    urlParts parts;
+    if (!TinyUPnPTestAccess::parseUrl(url, size, &parts)) {
+        return 0;
+    }
+    const char *end = url + size;
+    FUZZ_ASSERT(parts.scheme == NULL || (parts.scheme >= url && parts.scheme + parts.schemeLength <= end));
+    FUZZ_ASSERT(parts.host == NULL || (parts.host >= url && parts.host + parts.hostLength <= end));
+    FUZZ_ASSERT(parts.path == NULL || (parts.path >= url && parts.path + parts.pathLength <= end));
+    FUZZ_ASSERT(parts.port >= 0 && parts.port <= 65535);
+    IPAddress ip;
+    if (parts.host != NULL) {
+        TinyUPnPTestAccess::parseIPAddress(parts.host, parts.hostLength, &ip);
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// runs a fuzz target without libFuzzer (e.g. with GCC): every file of the corpus, then random mutations of them
+// usage: <target> [-runs=N] [-seed=N] <file or directory>...
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static bool readFile(const std::string &path, std::vector<uint8_t> *data) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data->insert(data->end(), buffer, buffer + count);
+    }
+    fclose(file);
+    return true;
+}
+
+static void addInputs(const std::string &path, std::vector<std::vector<uint8_t>> *inputs) {
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        std::vector<uint8_t> data;
+        if (!readFile(path, &data)) {
+            fprintf(stderr, "cannot read %s\n", path.c_str());
+            exit(2);
+        }
+        inputs->push_back(data);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            addInputs(path + "/" + entry->d_name, inputs);
+        }
+    }
+    closedir(dir);
+}
+
+// the input is passed in a buffer of its exact size so that the sanitizers catch reads past its end
+static void runInput(const std::vector<uint8_t> &input) {
+    uint8_t *data = (uint8_t *) malloc(input.size() > 0 ? input.size() : 1);
+    if (!input.empty()) {
+        memcpy(data, input.data(), input.size());
+    }
+    LLVMFuzzerTestOneInput(data, input.size());
+    free(data);
+}
+
+static void mutate(std::vector<uint8_t> *data, const std::vector<std::vector<uint8_t>> &inputs) {
+    static const char interesting[] = " \r\n:/<>-.0123456789%\"";
+    int count = 1 + rand() % 4;
+    for (int i = 0; i < count; i++) {
+        size_t pos = data->empty() ? 0 : rand() % (data->size() + 1);
+        switch (rand() % 6) {
+            case 0:
+                if (pos < data->size()) {
+                    (*data)[pos] ^= 1 << (rand() % 8);
+                }
+                break;
+            case 1:
+                data->insert(data->begin() + pos, interesting[rand() % (sizeof(interesting) - 1)]);
+                break;
+            case 2:
+                if (pos < data->size()) {
+                    data->erase(data->begin() + pos, data->begin() + std::min(data->size(), pos + 1 + rand() % 8));
+                }
+                break;
+            case 3:
+                data->resize(pos);
+                break;
+            case 4:
+                data->insert(data->begin() + pos, 1 + rand() % 16, (uint8_t) rand());
+                break;
+            case 5: {
+                const std::vector<uint8_t> &other = inputs[rand() % inputs.size()];
+                if (!other.empty()) {
+                    size_t from = rand() % other.size();
+                    size_t length = std::min(other.size() - from, (size_t) (1 + rand() % 32));
+                    data->insert(data->begin() + pos, other.begin() + from, other.begin() + from + length);
+                }
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    long runs = 10000;
+    unsigned int seed = 1;
+    std::vector<std::vector<uint8_t>> inputs;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-runs=", 6) == 0) {
+            runs = atol(argv[i] + 6);
+        } else if (strncmp(argv[i], "-seed=", 6) == 0) {
+            seed = strtoul(argv[i] + 6, NULL, 10);
+        } else {
+            addInputs(argv[i], &inputs);
+        }
+    }
+    if (inputs.empty()) {
+        inputs.push_back(std::vector<uint8_t>());
+    }
+    for (const std::vector<uint8_t> &input : inputs) {
+        runInput(input);
+    }
+    srand(seed);
+    for (long run = 0; run < runs; run++) {
+        std::vector<uint8_t> data = inputs[rand() % inputs.size()];
+        mutate(&data, inputs);
+        runInput(data);
+    }
+    printf("%zu inputs and %ld mutations passed\n", inputs.size(), runs);
+    return 0;
+}
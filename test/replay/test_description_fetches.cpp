@@ -0,0 +1,94 @@
+// the description fetches of probeDescriptionLocations and enrichSsdpDevices on the pool configuration of the README,
+// none of them may take memory from the allocator
+#include "TinyUPnPTestAccess.h"
+#include "TinyUPnPAllocator.h"
+#include "TinyUPnPReplay.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#define TEST_ASSERT(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define NUM_OF_DEVICES 10
+
+static std::string connection(const std::string &status, const std::string &body) {
+    std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/xml\r\nConnection: close\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    return "C 0 192.168.1.1:80\nR 0 " + std::to_string(response.size()) + "\n" + response + "\n";
+}
+
+static std::string description(const std::string &deviceType, const std::string &friendlyName, const std::string &service) {
+    return "<?xml version=\"1.0\"?>\n<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n<device>\n"
+        "<deviceType>" + deviceType + "</deviceType>\n"
+        "<friendlyName>" + friendlyName + "</friendlyName>\n"
+        "<manufacturer>Acme</manufacturer>\n"
+        "<modelName>Model</modelName>\n"
+        "<serviceList><service><serviceType>" + service + "</serviceType></service></serviceList>\n"
+        "</device>\n</root>\n";
+}
+
+// the gateway serves its description only at the last of the default locations, so probing takes two batches
+static void testProbeDescriptionLocations() {
+    std::string capture;
+    for (int i = 0; descriptionLocationsIgd[i + 1].path != NULL; i++) {
+        capture += connection("404 Not Found", "");
+    }
+    capture += connection("200 OK", description("urn:schemas-upnp-org:device:InternetGatewayDevice:1", "Router",
+        "urn:schemas-upnp-org:service:WANIPConnection:1"));
+
+    UPnPPoolAllocator<sizeof(ssdpDevice), 16> pool;
+    UPnPReplayClient replayClient(capture.c_str());
+    TinyUPnP tinyUPnP(20000, &replayClient);
+    tinyUPnP.setAllocator(&pool);
+    tinyUPnP.resetAllocationStats();
+
+    gatewayInfo deviceInfo;
+    TEST_ASSERT(TinyUPnPTestAccess::probeDescriptionLocations(&tinyUPnP, &deviceInfo, IPAddress(192, 168, 1, 1)));
+    TEST_ASSERT(deviceInfo.port == 52869);
+    TEST_ASSERT(deviceInfo.path == "/picsdesc.xml");
+    TEST_ASSERT(replayClient.getConnectCount() == 5);
+    upnpAllocationStats stats = tinyUPnP.getAllocationStats();
+    TEST_ASSERT(stats.numOfAllocations == 0 && stats.numOfFailures == 0);
+}
+
+// more devices than fit in a pool block as an array
+static void testEnrichSsdpDevices() {
+    std::string capture;
+    ssdpDevice devices[NUM_OF_DEVICES];
+    ssdpDeviceNode nodes[NUM_OF_DEVICES];
+    for (int i = 0; i < NUM_OF_DEVICES; i++) {
+        capture += connection("200 OK", description("urn:schemas-upnp-org:device:MediaRenderer:1", "Renderer " + std::to_string(i), "urn:schemas-upnp-org:service:AVTransport:1"));
+        devices[i].host = IPAddress(192, 168, 1, 100 + i);
+        devices[i].port = 80;
+        devices[i].path = "/description.xml";
+        nodes[i].ssdpDevice = &devices[i];
+        nodes[i].next = i + 1 < NUM_OF_DEVICES ? &nodes[i + 1] : NULL;
+    }
+
+    UPnPPoolAllocator<sizeof(ssdpDevice), 16> pool;
+    UPnPReplayClient replayClient(capture.c_str());
+    TinyUPnP tinyUPnP(20000, &replayClient);
+    tinyUPnP.setAllocator(&pool);
+    tinyUPnP.resetAllocationStats();
+
+    TEST_ASSERT(tinyUPnP.enrichSsdpDevices(nodes) == NUM_OF_DEVICES);
+    for (int i = 0; i < NUM_OF_DEVICES; i++) {
+        TEST_ASSERT(devices[i].friendlyName == String(("Renderer " + std::to_string(i)).c_str()));
+        TEST_ASSERT(devices[i].manufacturer == "Acme");
+    }
+    TEST_ASSERT(replayClient.getConnectCount() == NUM_OF_DEVICES);
+    upnpAllocationStats stats = tinyUPnP.getAllocationStats();
+    TEST_ASSERT(stats.numOfAllocations == 0 && stats.numOfFailures == 0);
+}
+
+int main() {
+    testProbeDescriptionLocations();
+    testEnrichSsdpDevices();
+    printf("description fetches: ok\n");
+    return 0;
+}
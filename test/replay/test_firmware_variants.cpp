@@ -0,0 +1,163 @@
+// the commit of a single port mapping against the captures of router firmwares that differ from miniupnpd in captures/,
+// each capture starts with the answer of the router to M-SEARCH
+// usage: test_firmware_variants <captures directory> <variant>
+#include "TinyUPnPTestAccess.h"
+#include "TinyUPnPReplay.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+#define REPLAY_ASSERT(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+typedef struct _firmwareVariant {
+    const char *name;
+    portMappingResult result;
+    const char *host;
+    int port;
+    int actionPort;
+    const char *actionPath;
+    const char *serviceTypeName;
+    unsigned int numOfConnections;  // TCP round trips of the commit
+    unsigned long maxElapsedMs;  // the delays of the capture plus the sleeps of the commit, with 500 ms of slack
+} firmwareVariant;
+
+static const firmwareVariant variants[] = {
+    // the whole description, SCPD and SOAP responses on a single line
+    {"single_line", ALREADY_MAPPED, "192.168.1.1", 5000, 5000, "/ctl/IPConn", "urn:schemas-upnp-org:service:WANIPConnection:1", 5, 1500},
+    // "Location" and "st" headers, only the WANIPConnection search is answered, URLBase moves the actions to another port
+    {"location_case", ALREADY_MAPPED, "192.168.1.1", 1900, 49000, "/upnp/control/WANIPConn1", "urn:schemas-upnp-org:service:WANIPConnection:1", 5, 1700},
+    // no URLBase, the control URL is relative to the directory of the description
+    {"no_urlbase", SUCCESS, "192.168.1.1", 49000, 49000, "/igd/control/WANPPPConn1", "urn:schemas-upnp-org:service:WANPPPConnection:1", 7, 3500},
+    // every answer takes about a second, the SCPD and the missing port mapping come back as 500
+    {"slow_500", SUCCESS, "192.168.1.1", 5000, 5000, "/ctl/IPConn", "urn:schemas-upnp-org:service:WANIPConnection:1", 7, 12100},
+    {NULL, SUCCESS, NULL, 0, 0, NULL, NULL, 0, 0}
+};
+
+typedef struct _datagram {
+    unsigned long delayMs;
+    std::string searchTarget;
+    std::string payload;
+    boolean isAnswered;
+} datagram;
+
+static std::vector<datagram> datagrams;
+
+static std::string readCapture(const std::string &path) {
+    std::string capture;
+    FILE *file = fopen(path.c_str(), "rb");
+    REPLAY_ASSERT(file != NULL);
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        capture.append(buffer, count);
+    }
+    fclose(file);
+    return capture;
+}
+
+// the value of the ST header of an SSDP message, empty if there is none
+static std::string getSearchTarget(const std::string &message) {
+    size_t lineStart = 0;
+    while (lineStart < message.size()) {
+        size_t lineEnd = message.find("\r\n", lineStart);
+        if (lineEnd == std::string::npos || lineEnd == lineStart) {
+            break;
+        }
+        if (lineEnd - lineStart > 3 && strncasecmp(message.c_str() + lineStart, "ST:", 3) == 0) {
+            size_t valueStart = message.find_first_not_of(' ', lineStart + 3);
+            return message.substr(valueStart, lineEnd - valueStart);
+        }
+        lineStart = lineEnd + 2;
+    }
+    return std::string();
+}
+
+// the U records of the capture, the payloads of the R records are skipped
+static void readDatagrams(const std::string &capture) {
+    size_t pos = 0;
+    while (pos < capture.size()) {
+        size_t lineEnd = capture.find('\n', pos);
+        REPLAY_ASSERT(lineEnd != std::string::npos);
+        char type = capture[pos];
+        if (type == 'R' || type == 'U') {
+            unsigned long ms;
+            size_t length;
+            REPLAY_ASSERT(sscanf(capture.c_str() + pos + 2, "%lu %zu", &ms, &length) == 2);
+            REPLAY_ASSERT(lineEnd + 1 + length <= capture.size());
+            std::string payload = capture.substr(lineEnd + 1, length);
+            if (type == 'U') {
+                datagrams.push_back({ms, getSearchTarget(payload), payload, false});
+            }
+            lineEnd += length + 1;
+        }
+        pos = lineEnd + 1;
+    }
+}
+
+// the router answers the M-SEARCH for a search target it has a datagram for, after the captured delay
+static std::vector<uint8_t> answerMSearch(const std::vector<uint8_t> &request, IPAddress, uint16_t port) {
+    std::string message(request.begin(), request.end());
+    if (port != 1900 || message.compare(0, 8, "M-SEARCH") != 0) {
+        return std::vector<uint8_t>();
+    }
+    std::string searchTarget = getSearchTarget(message);
+    for (datagram &answer : datagrams) {
+        if (answer.searchTarget == searchTarget) {
+            if (!answer.isAnswered) {
+                delay(answer.delayMs);
+                answer.isAnswered = true;
+            }
+            return std::vector<uint8_t>(answer.payload.begin(), answer.payload.end());
+        }
+    }
+    return std::vector<uint8_t>();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <captures directory> <variant>\n", argv[0]);
+        return 2;
+    }
+    const firmwareVariant *variant = variants;
+    while (variant->name != NULL && strcmp(variant->name, argv[2]) != 0) {
+        variant++;
+    }
+    if (variant->name == NULL) {
+        fprintf(stderr, "unknown variant %s\n", argv[2]);
+        return 2;
+    }
+    std::string capture = readCapture(std::string(argv[1]) + "/" + variant->name + ".txt");
+    readDatagrams(capture);
+    REPLAY_ASSERT(!datagrams.empty());
+    WiFiUDP::onSend = answerMSearch;
+
+    UPnPReplayClient replayClient(capture.c_str());
+    TinyUPnP tinyUPnP(20000, &replayClient);
+    tinyUPnP.setNatProtocol(NAT_PROTOCOL_UPNP_IGD);
+    tinyUPnP.addPortMappingConfig(WiFi.localIP(), 80, "TCP", 36000, "web");
+
+    unsigned long startTime = millis();
+    REPLAY_ASSERT(tinyUPnP.commitPortMappings() == variant->result);
+    unsigned long elapsedMs = millis() - startTime;
+
+    gatewayInfo gwInfo = TinyUPnPTestAccess::getGatewayInfo(&tinyUPnP);
+    REPLAY_ASSERT(gwInfo.host.toString() == variant->host);
+    REPLAY_ASSERT(gwInfo.port == variant->port);
+    REPLAY_ASSERT(gwInfo.actionPort == variant->actionPort);
+    REPLAY_ASSERT(gwInfo.actionPath == variant->actionPath);
+    REPLAY_ASSERT(gwInfo.serviceTypeName == variant->serviceTypeName);
+    REPLAY_ASSERT(replayClient.getConnectCount() == variant->numOfConnections);
+    REPLAY_ASSERT(elapsedMs <= variant->maxElapsedMs);
+    REPLAY_ASSERT(tinyUPnP.getExternalIP() == IPAddress(203, 0, 113, 7));
+    printf("%s: %u connections in %lu ms, %lu bytes written, %lu bytes read\n", variant->name, replayClient.getConnectCount(),
+        elapsedMs, replayClient.getBytesWritten(), replayClient.getBytesRead());
+    return 0;
+}
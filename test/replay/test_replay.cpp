@@ -0,0 +1,118 @@
+// regression tests of the add, verify, delete and refresh flows against the captures of a miniupnpd router in captures/
+// usage: test_replay <captures directory> <add|verify|delete|coalesce|refresh>
+#include "TinyUPnP.h"
+#include "TinyUPnPReplay.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define REFRESH_INTERVAL_MS 100
+
+#define REPLAY_ASSERT(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static std::string readCapture(const std::string &path) {
+    std::string capture;
+    FILE *file = fopen(path.c_str(), "rb");
+    REPLAY_ASSERT(file != NULL);
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        capture.append(buffer, count);
+    }
+    fclose(file);
+    return capture;
+}
+
+static unsigned int countConnections(const std::string &capture) {
+    unsigned int count = 0;
+    for (size_t pos = 0; (pos = capture.find("C ", pos)) != std::string::npos; pos++) {
+        if (pos == 0 || capture[pos - 1] == '\n') {
+            count++;
+        }
+    }
+    return count;
+}
+
+// the router answers the M-SEARCH for its device type with the location of the description in the captures
+static std::vector<uint8_t> answerMSearch(const std::vector<uint8_t> &datagram, IPAddress, uint16_t port) {
+    std::string request(datagram.begin(), datagram.end());
+    std::string searchTarget = "urn:schemas-upnp-org:device:InternetGatewayDevice:1";
+    if (port != 1900 || request.compare(0, 8, "M-SEARCH") != 0 || request.find("\r\nST: " + searchTarget + "\r\n") == std::string::npos) {
+        return std::vector<uint8_t>();
+    }
+    std::string response = "HTTP/1.1 200 OK\r\n"
+        "CACHE-CONTROL: max-age=120\r\n"
+        "ST: " + searchTarget + "\r\n"
+        "USN: uuid:2b2561a3-a6c3-4506-a4ae-247efe7a5b4c::" + searchTarget + "\r\n"
+        "EXT:\r\n"
+        "SERVER: OpenWRT/OpenWrt UPnP/1.1 MiniUPnPd/2.2.1\r\n"
+        "LOCATION: http://192.168.1.1:5000/rootDesc.xml\r\n"
+        "\r\n";
+    return std::vector<uint8_t>(response.begin(), response.end());
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <captures directory> <add|verify|delete|coalesce|refresh>\n", argv[0]);
+        return 2;
+    }
+    std::string flow = argv[2];
+    // the rules of the coalesce flow end up as the single port mapping of the verify capture
+    std::string capture = readCapture(std::string(argv[1]) + "/" + (flow == "coalesce" ? "verify" : flow) + ".txt");
+    WiFiUDP::onSend = answerMSearch;
+
+    UPnPReplayClient replayClient(capture.c_str());
+    TinyUPnP tinyUPnP(20000, &replayClient);
+    tinyUPnP.setNatProtocol(NAT_PROTOCOL_UPNP_IGD);
+    tinyUPnP.addPortMappingConfig(WiFi.localIP(), 80, "TCP", 36000, "web");
+
+    if (flow == "add") {
+        // 714 on the verification, AddPortMapping and the verification of the new mapping
+        REPLAY_ASSERT(tinyUPnP.commitPortMappings() == SUCCESS);
+    } else if (flow == "verify") {
+        REPLAY_ASSERT(tinyUPnP.commitPortMappings() == ALREADY_MAPPED);
+    } else if (flow == "delete") {
+        // the rule is mapped first, so the removal must send DeletePortMapping
+        REPLAY_ASSERT(tinyUPnP.commitPortMappings() == ALREADY_MAPPED);
+        REPLAY_ASSERT(tinyUPnP.removeRule(0));
+        REPLAY_ASSERT(tinyUPnP.commitPortMappings() == ALREADY_MAPPED);
+    } else if (flow == "coalesce") {
+        // the newest rule for external port 80 wins, so the commit sends a single GetSpecificPortMappingEntry
+        int handle = tinyUPnP.addRule(WiFi.localIP(), 8080, 80, "TCP", 36000, "camera");
+        REPLAY_ASSERT(handle != UPNP_RULE_INVALID_HANDLE);
+        REPLAY_ASSERT(!tinyUPnP.removeRule(0));  // replaced by the newer rule
+        REPLAY_ASSERT(tinyUPnP.addRule(WiFi.localIP(), 8081, 80, "TCP", 36000, "camera") != UPNP_RULE_INVALID_HANDLE);
+        REPLAY_ASSERT(tinyUPnP.addRule(WiFi.localIP(), 80, 80, "TCP", 36000, "web") != UPNP_RULE_INVALID_HANDLE);
+        REPLAY_ASSERT(tinyUPnP.commitPortMappings() == ALREADY_MAPPED);
+    } else if (flow == "refresh") {
+        // the first update commits the rule, the gateway is found with a temporary object that is gone once it returns
+        delay(REFRESH_INTERVAL_MS);
+        REPLAY_ASSERT(tinyUPnP.updatePortMappings(REFRESH_INTERVAL_MS) == ALREADY_MAPPED);
+        upnpAllocationStats stats = tinyUPnP.getLastCallAllocationStats();
+        REPLAY_ASSERT(stats.numOfAllocations == 1 && stats.highWaterBytes > stats.currentBytes);
+        // the second one only asks the IGD for its status, which must allocate nothing at all: neither from the
+        // allocators of TinyUPnP nor a String from the heap
+        delay(REFRESH_INTERVAL_MS);
+        unsigned long numOfStringAllocations = String::numOfHeapAllocations;
+        REPLAY_ASSERT(tinyUPnP.updatePortMappings(REFRESH_INTERVAL_MS) == ALREADY_MAPPED);
+        stats = tinyUPnP.getLastCallAllocationStats();
+        REPLAY_ASSERT(stats.numOfAllocations == 0 && stats.allocatedBytes == 0 && stats.numOfFailures == 0);
+        REPLAY_ASSERT(stats.highWaterBytes == stats.currentBytes);
+        REPLAY_ASSERT(String::numOfHeapAllocations == numOfStringAllocations);
+    } else {
+        fprintf(stderr, "unknown flow %s\n", flow.c_str());
+        return 2;
+    }
+    // every captured connection was replayed, no more and no less
+    REPLAY_ASSERT(replayClient.getConnectCount() == countConnections(capture));
+    REPLAY_ASSERT(tinyUPnP.getExternalIP() == IPAddress(203, 0, 113, 7));
+    printf("%s: %u connections, %lu bytes written, %lu bytes read\n", flow.c_str(), replayClient.getConnectCount(),
+        replayClient.getBytesWritten(), replayClient.getBytesRead());
+    return 0;
+}
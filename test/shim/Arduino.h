@@ -0,0 +1,309 @@
+// host shim of the parts of the Arduino core used by TinyUPnP, enough to build and run the library on a PC
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+#include <strings.h>
+#include <algorithm>
+#include <functional>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define PSTR(s) (s)
+#define PROGMEM
+#define strcpy_P strcpy
+#define strcat_P strcat
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define strcmp_P strcmp
+#define strncasecmp_P strncasecmp
+#define memcpy_P memcpy
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+#if defined(ESP8266)
+#define RANDOM_REG32 ((uint32_t) rand())  // the hardware random number generator
+#else
+uint32_t esp_random();
+#endif
+
+#define STRING_SSO_MAX_LENGTH 11  // the cores keep this many characters inside the String object, longer ones go to the heap
+
+// numOfHeapAllocations counts the buffers a String of the cores would have taken from the heap, for the allocation tests
+class String
+{
+    public:
+        static unsigned long numOfHeapAllocations;
+
+        String() {}
+        String(const char *str) : _s(str != NULL ? str : "") { track(); }
+        String(const __FlashStringHelper *str) : _s((const char *) str) { track(); }
+        String(const std::string &str) : _s(str) { track(); }
+        String(const String &str) : _s(str._s) { track(); }
+        String(String &&str) : _s(std::move(str._s)), _heapCapacity(str._heapCapacity) { str._heapCapacity = 0; }
+        explicit String(char c) : _s(1, c) {}
+        String(int value) : _s(std::to_string(value)) { track(); }
+        String(unsigned int value) : _s(std::to_string(value)) { track(); }
+        String(long value) : _s(std::to_string(value)) { track(); }
+        String(unsigned long value) : _s(std::to_string(value)) { track(); }
+        String &operator=(const String &str) {
+            _s = str._s;
+            track();
+            return *this;
+        }
+        String &operator=(String &&str) {
+            _s = std::move(str._s);
+            _heapCapacity = str._heapCapacity;
+            str._heapCapacity = 0;
+            return *this;
+        }
+        unsigned int length() const { return _s.size(); }
+        const char *c_str() const { return _s.c_str(); }
+        int indexOf(char c, unsigned int from = 0) const { return toIndex(_s.find(c, from)); }
+        int indexOf(const String &str, unsigned int from = 0) const { return toIndex(_s.find(str._s, from)); }
+        int lastIndexOf(char c) const { return toIndex(_s.rfind(c)); }
+        String substring(unsigned int from) const { return from > _s.size() ? String() : String(_s.substr(from)); }
+        String substring(unsigned int from, unsigned int to) const {
+            if (from > to) {
+                std::swap(from, to);
+            }
+            return from > _s.size() ? String() : String(_s.substr(from, to - from));
+        }
+        void replace(const String &find, const String &replace) {
+            size_t pos = 0;
+            while (!find._s.empty() && (pos = _s.find(find._s, pos)) != std::string::npos) {
+                _s.replace(pos, find._s.size(), replace._s);
+                pos += replace._s.size();
+            }
+            track();
+        }
+        void trim() {
+            while (!_s.empty() && isspace((unsigned char) _s.back())) {
+                _s.pop_back();
+            }
+            size_t i = 0;
+            while (i < _s.size() && isspace((unsigned char) _s[i])) {
+                i++;
+            }
+            _s.erase(0, i);
+        }
+        void toLowerCase() {
+            for (char &c : _s) {
+                c = tolower((unsigned char) c);
+            }
+        }
+        long toInt() const { return atol(_s.c_str()); }
+        bool startsWith(const String &prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+        bool endsWith(const String &suffix) const {
+            return _s.size() >= suffix._s.size() && _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+        }
+        bool equals(const String &str) const { return _s == str._s; }
+        bool equalsIgnoreCase(const String &str) const { return strcasecmp(_s.c_str(), str._s.c_str()) == 0; }
+        bool reserve(unsigned int size) {
+            _s.reserve(size);
+            track(size);
+            return true;
+        }
+        char charAt(unsigned int i) const { return i < _s.size() ? _s[i] : '\0'; }
+        char operator[](unsigned int i) const { return charAt(i); }
+        bool concat(const char *str, unsigned int length) {
+            _s.append(str, length);
+            track();
+            return true;
+        }
+        String &operator+=(const String &str) {
+            _s += str._s;
+            track();
+            return *this;
+        }
+        String &operator+=(const char *str) {
+            _s += str;
+            track();
+            return *this;
+        }
+        String &operator+=(char c) {
+            _s += c;
+            track();
+            return *this;
+        }
+        bool operator==(const String &str) const { return _s == str._s; }
+        bool operator==(const char *str) const { return _s == str; }
+        bool operator!=(const String &str) const { return _s != str._s; }
+        friend String operator+(const String &a, const String &b) { return String(a._s + b._s); }
+        friend String operator+(const String &a, const char *b) { return String(a._s + b); }
+        friend String operator+(const char *a, const String &b) { return String(a + b._s); }
+    private:
+        static int toIndex(size_t pos) { return pos == std::string::npos ? -1 : (int) pos; }
+        // a longer String than its buffer holds gets a new one
+        void track(size_t capacity = 0) {
+            capacity = std::max(capacity, _s.size());
+            if (capacity > STRING_SSO_MAX_LENGTH && capacity > _heapCapacity) {
+                _heapCapacity = capacity;
+                numOfHeapAllocations++;
+            }
+        }
+        std::string _s;
+        size_t _heapCapacity = 0;  // 0 while the characters fit in the String object
+};
+
+class IPAddress
+{
+    public:
+        IPAddress() { memset(_bytes, 0, sizeof(_bytes)); }
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+            _bytes[0] = a;
+            _bytes[1] = b;
+            _bytes[2] = c;
+            _bytes[3] = d;
+        }
+        IPAddress(uint32_t address) { memcpy(_bytes, &address, sizeof(_bytes)); }
+        operator uint32_t() const {
+            uint32_t address;
+            memcpy(&address, _bytes, sizeof(address));
+            return address;
+        }
+        bool operator==(const IPAddress &other) const { return memcmp(_bytes, other._bytes, sizeof(_bytes)) == 0; }
+        bool operator!=(const IPAddress &other) const { return !(*this == other); }
+        uint8_t operator[](int i) const { return _bytes[i]; }
+        uint8_t &operator[](int i) { return _bytes[i]; }
+        bool fromString(const char *str) {
+            unsigned int a, b, c, d;
+            char trailing;
+            if (sscanf(str, "%u.%u.%u.%u%c", &a, &b, &c, &d, &trailing) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+                return false;
+            }
+            *this = IPAddress(a, b, c, d);
+            return true;
+        }
+        bool fromString(const String &str) { return fromString(str.c_str()); }
+        String toString() const {
+            char str[16];
+            snprintf(str, sizeof(str), "%u.%u.%u.%u", _bytes[0], _bytes[1], _bytes[2], _bytes[3]);
+            return String(str);
+        }
+    private:
+        uint8_t _bytes[4];
+};
+
+class Print
+{
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                write(buffer[i]);
+            }
+            return size;
+        }
+        size_t write(const char *str) { return write((const uint8_t *) str, strlen(str)); }
+        size_t print(const char *str) { return write(str); }
+        size_t print(const String &str) { return write(str.c_str()); }
+        size_t print(const __FlashStringHelper *str) { return write((const char *) str); }
+        size_t print(char c) { return write((uint8_t) c); }
+        // numbers and IP addresses are printed without a String, as the cores do
+        size_t print(int value) { return print((long) value); }
+        size_t print(unsigned int value) { return print((unsigned long) value); }
+        size_t print(long value) {
+            char str[24];
+            snprintf(str, sizeof(str), "%ld", value);
+            return write(str);
+        }
+        size_t print(unsigned long value) {
+            char str[24];
+            snprintf(str, sizeof(str), "%lu", value);
+            return write(str);
+        }
+        size_t print(const IPAddress &ip) {
+            char str[16];
+            snprintf(str, sizeof(str), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+            return write(str);
+        }
+        template <typename T> size_t println(const T &value) { return print(value) + println(); }
+        size_t println() { return write("\r\n"); }
+};
+
+class Stream : public Print
+{
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+        virtual void flush() {}
+        void setTimeout(unsigned long timeout) { _timeout = timeout; }
+        size_t readBytes(char *buffer, size_t length) {
+            size_t i = 0;
+            while (i < length && available()) {
+                buffer[i++] = read();
+            }
+            return i;
+        }
+        String readStringUntil(char terminator) {
+            String str;
+            while (available()) {
+                int c = read();
+                if (c == terminator) {
+                    break;
+                }
+                str += (char) c;
+            }
+            return str;
+        }
+    protected:
+        unsigned long _timeout = 1000;
+};
+
+class HardwareSerial : public Stream
+{
+    public:
+        void begin(unsigned long) {}
+        size_t write(uint8_t c) override { return fputc(c, stdout) == EOF ? 0 : 1; }
+        using Print::write;
+        int available() override { return 0; }
+        int read() override { return -1; }
+        int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+class Client : public Stream
+{
+    public:
+        virtual int connect(IPAddress ip, uint16_t port) = 0;
+        virtual int connect(const char *host, uint16_t port) = 0;
+        virtual int read(uint8_t *buffer, size_t size) = 0;
+        using Stream::read;
+        virtual void stop() = 0;
+        virtual uint8_t connected() = 0;
+        virtual operator bool() = 0;
+};
+
+class UDP : public Stream
+{
+    public:
+        virtual uint8_t begin(uint16_t port) = 0;
+        virtual void stop() = 0;
+        virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+        virtual int endPacket() = 0;
+        virtual int parsePacket() = 0;
+        virtual int read(unsigned char *buffer, size_t length) = 0;
+        virtual int read(char *buffer, size_t length) = 0;
+        using Stream::read;
+        virtual IPAddress remoteIP() = 0;
+        virtual uint16_t remotePort() = 0;
+};
+
+#endif
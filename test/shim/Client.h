@@ -0,0 +1,6 @@
+#ifndef Client_h
+#define Client_h
+
+#include "Arduino.h"
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include "WiFi.h"
+
+#endif
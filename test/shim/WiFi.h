@@ -0,0 +1,68 @@
+#ifndef WiFi_h
+#define WiFi_h
+
+#include "Arduino.h"
+#include "WiFiClient.h"
+#include "WiFiUdp.h"
+
+#define WL_CONNECTED 3
+typedef int wl_status_t;
+
+#ifdef ESP32
+typedef enum {
+    ARDUINO_EVENT_WIFI_STA_CONNECTED,
+    ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+    ARDUINO_EVENT_WIFI_STA_GOT_IP,
+    ARDUINO_EVENT_WIFI_STA_LOST_IP,
+    ARDUINO_EVENT_MAX
+} arduino_event_id_t;
+typedef struct {
+    int reason;
+} arduino_event_info_t;
+typedef arduino_event_id_t WiFiEvent_t;
+typedef arduino_event_info_t WiFiEventInfo_t;
+typedef size_t wifi_event_id_t;
+typedef std::function<void(arduino_event_id_t event, arduino_event_info_t info)> WiFiEventFuncCb;
+#define ESP_ARDUINO_VERSION_MAJOR 2
+#endif
+
+#ifdef ESP8266
+#include <memory>
+struct WiFiEventStationModeGotIP {
+    IPAddress ip;
+    IPAddress mask;
+    IPAddress gw;
+};
+struct WiFiEventStationModeDisconnected {
+    int reason;
+};
+struct WiFiEventHandlerOpaque {};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+#endif
+
+// a station at 192.168.1.10 behind the gateway 192.168.1.1, the events are never raised
+class WiFiClass
+{
+    public:
+        IPAddress localIP() { return IPAddress(192, 168, 1, 10); }
+        IPAddress gatewayIP() { return IPAddress(192, 168, 1, 1); }
+        IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+        String macAddress() { return String("AA:BB:CC:DD:EE:FF"); }
+        wl_status_t status() { return WL_CONNECTED; }
+#ifdef ESP32
+        wifi_event_id_t onEvent(WiFiEventFuncCb, arduino_event_id_t = ARDUINO_EVENT_MAX) { return 1; }
+        void removeEvent(wifi_event_id_t) {}
+#endif
+#ifdef ESP8266
+        WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)>) {
+            return std::make_shared<WiFiEventHandlerOpaque>();
+        }
+        WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)>) {
+            return std::make_shared<WiFiEventHandlerOpaque>();
+        }
+#endif
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef WiFiClient_h
+#define WiFiClient_h
+
+#include "Arduino.h"
+#include <deque>
+
+// connects to anything, whatever is put in incoming is read back and whatever is written is dropped
+class WiFiClient : public Client
+{
+    public:
+        std::deque<char> incoming;
+        int connect(IPAddress, uint16_t) override { _isConnected = true; return 1; }
+        int connect(const char *, uint16_t) override { _isConnected = true; return 1; }
+        size_t write(uint8_t) override { return 1; }
+        using Print::write;
+        int available() override { return incoming.size(); }
+        int read() override {
+            if (incoming.empty()) {
+                return -1;
+            }
+            uint8_t c = incoming.front();
+            incoming.pop_front();
+            return c;
+        }
+        int read(uint8_t *buffer, size_t size) override {
+            size_t i = 0;
+            while (i < size && !incoming.empty()) {
+                buffer[i++] = incoming.front();
+                incoming.pop_front();
+            }
+            return i;
+        }
+        int peek() override { return incoming.empty() ? -1 : (uint8_t) incoming.front(); }
+        void stop() override { _isConnected = false; }
+        uint8_t connected() override { return _isConnected; }
+        operator bool() override { return _isConnected; }
+#ifdef ESP32
+        int fd() const { return _isConnected ? 3 : -1; }
+#endif
+    private:
+        boolean _isConnected = false;
+};
+
+#endif
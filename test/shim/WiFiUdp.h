@@ -0,0 +1,69 @@
+#ifndef WiFiUdp_h
+#define WiFiUdp_h
+
+#include "Arduino.h"
+#include <vector>
+
+// onSend is called with each datagram sent and its destination, the datagram it returns (if not empty) is then received
+// from the gateway, e.g. the answer of the IGD to an M-SEARCH
+class WiFiUDP : public UDP
+{
+    public:
+        static std::function<std::vector<uint8_t>(const std::vector<uint8_t> &datagram, IPAddress ip, uint16_t port)> onSend;
+        uint8_t begin(uint16_t) override { return 1; }
+#ifdef ESP8266
+        uint8_t beginMulticast(IPAddress, IPAddress, uint16_t) { return 1; }
+        int beginPacketMulticast(IPAddress ip, uint16_t port, IPAddress, int = 1) { return beginPacket(ip, port); }
+#else
+        uint8_t beginMulticast(IPAddress, uint16_t) { return 1; }
+        int beginMulticastPacket() { return beginPacket(IPAddress(239, 255, 255, 250), 1900); }
+#endif
+        void stop() override { _pending.clear(); }
+        int beginPacket(IPAddress ip, uint16_t port) override {
+            _tx.clear();
+            _txIP = ip;
+            _txPort = port;
+            return 1;
+        }
+        int endPacket() override {
+            if (onSend) {
+                std::vector<uint8_t> response = onSend(_tx, _txIP, _txPort);
+                if (!response.empty()) {
+                    _pending = response;
+                }
+            }
+            return 1;
+        }
+        int parsePacket() override {
+            if (_pending.empty()) {
+                return 0;
+            }
+            _rx.swap(_pending);
+            _pending.clear();
+            _rxPos = 0;
+            return _rx.size();
+        }
+        size_t write(uint8_t c) override { _tx.push_back(c); return 1; }
+        using Print::write;
+        int read(unsigned char *buffer, size_t length) override {
+            size_t count = std::min(length, _rx.size() - _rxPos);
+            memcpy(buffer, _rx.data() + _rxPos, count);
+            _rxPos += count;
+            return count;
+        }
+        int read(char *buffer, size_t length) override { return read((unsigned char *) buffer, length); }
+        int read() override { return _rxPos < _rx.size() ? _rx[_rxPos++] : -1; }
+        int peek() override { return _rxPos < _rx.size() ? _rx[_rxPos] : -1; }
+        int available() override { return _rx.size() - _rxPos; }
+        IPAddress remoteIP() override { return IPAddress(192, 168, 1, 1); }  // everything comes from the gateway
+        uint16_t remotePort() override { return _txPort; }
+    private:
+        std::vector<uint8_t> _tx;
+        std::vector<uint8_t> _rx;
+        std::vector<uint8_t> _pending;
+        IPAddress _txIP;
+        uint16_t _txPort = 0;
+        size_t _rxPos = 0;
+};
+
+#endif
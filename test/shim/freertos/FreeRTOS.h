@@ -0,0 +1,13 @@
+#ifndef FreeRTOS_h
+#define FreeRTOS_h
+
+#include <cstdint>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) (ms)
+#define portMAX_DELAY 0xffffffff
+
+#endif
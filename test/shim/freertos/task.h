@@ -0,0 +1,16 @@
+#ifndef task_h
+#define task_h
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// tasks are never started on the host, TinyUPnPWorker only has to build
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *parameters,
+        UBaseType_t priority, TaskHandle_t *handle, BaseType_t coreID);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+BaseType_t xPortGetCoreID();
+
+#endif
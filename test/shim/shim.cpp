@@ -0,0 +1,60 @@
+#include "Arduino.h"
+#include "WiFi.h"
+#include <chrono>
+#include <thread>
+#ifdef ESP32
+#include "freertos/task.h"
+#endif
+
+unsigned long String::numOfHeapAllocations = 0;
+HardwareSerial Serial;
+WiFiClass WiFi;
+std::function<std::vector<uint8_t>(const std::vector<uint8_t> &datagram, IPAddress ip, uint16_t port)> WiFiUDP::onSend;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+}
+
+long random(long max) {
+    return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max) {
+    return max > min ? min + rand() % (max - min) : min;
+}
+
+#ifndef ESP8266
+uint32_t esp_random() {
+    return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+#endif
+
+#ifdef ESP32
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *, BaseType_t) {
+    return 0;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    delay(ticks);
+}
+
+void vTaskDelete(TaskHandle_t) {
+}
+
+BaseType_t xPortGetCoreID() {
+    return 1;
+}
+#endif